@@ -67,23 +67,64 @@ static void waste_cycle_time() {
 }
 
 void disk_write_sector(uint32_t lba, uint8_t *buf, uint16_t nchar);
+void disk_write_internal(uint32_t lba, uint8_t *buf, uint8_t nsectors);
 
 void disk_write(uint32_t lba, uint8_t *buf, uint32_t nchar) {
-    uint32_t chars_written = 0;
-    uint8_t *c_buf = buf;
-    uint32_t c_lba = lba;
-    for (; chars_written < nchar; c_buf += ATA_SECTOR_SIZE, c_lba += 1) {
-        uint16_t chars_to_write = ATA_SECTOR_SIZE;
-        if ((nchar - chars_written) < ATA_SECTOR_SIZE) {
-            chars_to_write = nchar - chars_written;
-        }
-
-        disk_write_sector(c_lba, c_buf, chars_to_write);
-
-        chars_written += chars_to_write;
+    // whole sectors go out in as few commands as we can.
+    uint32_t nsectors = nchar / ATA_SECTOR_SIZE;
+    while (nsectors > 0) {
+        uint8_t chunk = SECTOR_CHUNK;
+        if (nsectors < SECTOR_CHUNK) chunk = nsectors;
+
+        asm volatile ("cli");
+        disk_write_internal(lba, buf, chunk);
+        asm volatile ("sti");
+
+        lba += chunk;
+        buf += chunk * ATA_SECTOR_SIZE;
+        nsectors -= chunk;
+    }
+
+    // leftover bytes get padded out to a sector.
+    uint32_t rest = nchar % ATA_SECTOR_SIZE;
+    if (rest != 0) {
+        disk_write_sector(lba, buf, rest);
     }
 }
 
+/* writes nsectors whole sectors with one command 
+ * (and one cache flush). interrupts should be off. */
+void disk_write_internal(uint32_t lba, uint8_t *buf, uint8_t nsectors) {
+    ata_wait_until_status(ATA_STATUS_READY);
+    ata_wait_until_not_busy();
+
+    uint8_t lba_highest = ((lba >> 24) & 0x0f);
+    port_byte_out(ATA_DRIVE_HEAD_REGISTER, 0xe0 | lba_highest);
+
+    port_byte_out(ATA_SECTOR_COUNT_REGISTER, nsectors);
+
+    port_byte_out(ATA_LBA_LOW_REGISTER, (uint8_t) (lba & 0xff));
+    port_byte_out(ATA_LBA_MID_REGISTER, (uint8_t) ((lba >> 8) & 0xff));
+    port_byte_out(ATA_LBA_HIGH_REGISTER, (uint8_t) ((lba >> 16) & 0xff));
+
+    port_byte_out(ATA_COMMAND_REGISTER, ATA_WRITE_WITH_RETRY);
+
+    waste_cycle_time();
+
+    for (int i = 0; i < nsectors; i++) {
+        ata_wait_until_status(ATA_STATUS_DATA_TRANSFER_REQUESTED);
+        port_multiword_out(ATA_DATA_REGISTER, buf + i*ATA_SECTOR_SIZE, ATA_SECTOR_SIZE / 2);
+    }
+
+    port_byte_out(ATA_COMMAND_REGISTER, ATA_CACHE_FLUSH);
+
+    ata_wait_until_not_busy();
+
+    uint8_t status = port_byte_in(ATA_STATUS_REGISTER);
+    if (status & ATA_STATUS_ERR) {
+        print("Error writing disk... (2)");
+    }
+}
 
 /* NOTE: if you don't write a full sector 
  * in port_multiword_out, it will somehow leave the disk in 
@@ -221,4 +262,18 @@ void disk_read(uint32_t lba, uint8_t *buf) {
     asm volatile ("sti");
 }
 
+/* reads nsectors sectors into buf, in as few commands as we can. */
+void disk_read_sectors(uint32_t lba, uint8_t *buf, uint32_t nsectors) {
+    while (nsectors > 0) {
+        uint8_t chunk = SECTOR_CHUNK;
+        if (nsectors < SECTOR_CHUNK) chunk = nsectors;
+
+        asm volatile ("cli");
+        disk_read_internal(lba, buf, chunk);
+        asm volatile ("sti");
 
+        lba += chunk;
+        buf += chunk * ATA_SECTOR_SIZE;
+        nsectors -= chunk;
+    }
+}
@@ -0,0 +1,447 @@
+/* filesystem benchmark, run on the host (see host/shim.h).
+ *
+ * makes a fresh filesystem in an image file, then times
+ * mkdir, file creation, path lookups, sequential reads/writes,
+ * small files and directories growing out of their inodes,
+ * listing them, a sparse file and filling its holes, writing into
+ * fallocated blocks, a remount and a check, counting the disk
+ * requests each one costs. the files' contents are checked as
+ * they're read back.
+ *
+ * the "disk" is a file in the host's page cache, so the times
+ * are mostly our own CPU time. the request counts are what
+ * would cost real seeks on the ATA disk.
+ *
+ * usage: fsbench [image] [dirs] [files] [lookups] [file Mb] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shim.h"
+
+// fs.h has its own FILE.
+#define FILE fs_FILE
+#include "fs.h"
+#undef FILE
+
+#define FS_START_MB     8
+#define FS_LEN_MB       24
+#define DISK_MB         (FS_START_MB + FS_LEN_MB)
+
+#define N_TOP_DIRS      16
+#define IO_CHUNK        (64 * 1024)
+
+// the sparse file: a block of data every SPARSE_STRIDE bytes, 
+// enough of them that its extent tree has to split.
+#define SPARSE_ISLANDS  512
+#define SPARSE_STRIDE   (8 * 1024)
+#define ISLAND_LEN      1024
+
+// small files and directories, which start out in their inodes. 
+// the files all grow out of them, and every other directory does.
+#define N_SMALL         256
+#define SMALL_LEN       40
+#define GROWN_LEN       140
+#define DIR_GROWTH      6
+
+// the fallocated file, and the bits of it written afterwards.
+#define FALLOC_LEN      (2 << 20)
+#define FALLOC_STRIDE   (32 * 1024)
+#define FALLOC_OFF      5000
+#define FALLOC_WRITE    3000
+
+static double phase_start;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void begin() {
+    shim_reset_stats();
+    phase_start = now();
+}
+
+// bytes is 0 for phases that aren't about throughput.
+static void report(const char *name, uint32_t ops, uint64_t bytes) {
+    double secs = now() - phase_start;
+    if (secs <= 0) secs = 1e-9;
+
+    printf("%-12s %8u %12.0f", name, ops, ops / secs);
+    if (bytes > 0) {
+        printf(" %9.1f", bytes / secs / (1 << 20));
+    } else {
+        printf(" %9s", "-");
+    }
+
+    double n = ops > 0 ? ops : 1;
+    printf(" %9.3f %9.3f %9.1f %9.1f\n",
+            shim_stats.read_reqs / n, shim_stats.write_reqs / n,
+            shim_stats.read_sectors / n, shim_stats.write_sectors / n);
+}
+
+static void fail(const char *what, const char *path) {
+    fprintf(stderr, "%s failed: %s\n", what, path);
+    exit(1);
+}
+
+// what the sparse file should hold at pos: its islands, and 
+// zeroes in the holes until they're filled.
+static uint8_t sparse_byte(uint32_t pos, int filled) {
+    if (pos % SPARSE_STRIDE < ISLAND_LEN) return 0xa5;
+    return filled ? 0x5a : 0;
+}
+
+// what a small file should hold, before and after it grows.
+static uint8_t small_byte(uint32_t pos, int unused) {
+    return pos < SMALL_LEN ? 'i' : 'u';
+}
+
+// list the rest of the directory open at fd (path) with getdents() 
+// (or getdents_plus()), checking that the records hang together. 
+// returns how many entries there were, not counting . and .. 
+// (which an inline directory doesn't have).
+static uint32_t list_fd(int fd, const char *path, int plus) {
+    static uint8_t dbuf[4096];
+
+    uint32_t n = 0;
+    int got;
+    while (1) {
+        if (plus) {
+            got = getdents_plus(fd, (mochi_dirent_plus *) dbuf, sizeof(dbuf));
+        } else {
+            got = getdents(fd, (mochi_dirent *) dbuf, sizeof(dbuf));
+        }
+        if (got <= 0) break;
+
+        for (int pos = 0; pos < got; ) {
+            mochi_dirent *r = (mochi_dirent *) (dbuf + pos);
+            mochi_dirent_plus *rp = (mochi_dirent_plus *) (dbuf + pos);
+            char *name = plus ? rp->d_name : r->d_name;
+
+            if (r->d_reclen == 0 || pos + r->d_reclen > got) fail("getdents", path);
+            // the small files' sizes come along with getdents_plus().
+            if (plus && name[0] == 'f' && rp->i_size != GROWN_LEN) fail("getdents_plus", path);
+
+            if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) n++;
+            pos += r->d_reclen;
+        }
+    }
+    if (got < 0) fail("getdents", path);
+    return n;
+}
+
+static uint32_t list_dir(const char *path, int plus) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) fail("open", path);
+
+    uint32_t n = list_fd(fd, path, plus);
+    close(fd);
+    return n;
+}
+
+// list a directory, then add entries until it grows out of its 
+// inode, and carry on listing it through the same fd. 
+// where the first listing stopped has to still be an entry.
+static void list_growing() {
+    char path[64];
+    if (mkdir("/grow")) fail("mkdir", "/grow");
+
+    int fd = open("/grow", O_RDONLY);
+    if (fd < 0) fail("open", "/grow");
+    if (list_fd(fd, "/grow", 0) != 0) fail("getdents", "/grow");
+
+    for (uint32_t k = 0; k < 2 * DIR_GROWTH; k++) {
+        snprintf(path, sizeof(path), "/grow/entry%u", k);
+        int f = open(path, O_RDWR | O_CREAT);
+        if (f < 0) fail("create", path);
+        close(f);
+    }
+
+    // (the ones added while it was inline went in behind it.)
+    if (list_fd(fd, "/grow", 0) == 0) fail("getdents", "/grow");
+    close(fd);
+    if (list_dir("/grow", 0) != 2 * DIR_GROWTH) fail("getdents", "/grow");
+}
+
+// list /small and everything in it, checking that nothing's missing.
+static void list_small(int plus) {
+    char path[64];
+    if (list_dir("/small", plus) != 2 * N_SMALL) fail("getdents", "/small");
+
+    for (uint32_t i = 0; i < N_SMALL; i++) {
+        snprintf(path, sizeof(path), "/small/d%u", i);
+        uint32_t want = 1 + (i % 2 == 0 ? DIR_GROWTH : 0);
+        if (list_dir(path, plus) != want) fail("getdents", path);
+    }
+}
+
+// what the fallocated file should hold: zeroes, 
+// but for the writes once they're done.
+static uint8_t falloc_byte(uint32_t pos, int written) {
+    if (written && pos % FALLOC_STRIDE - FALLOC_OFF < FALLOC_WRITE) return 0x3c;
+    return 0;
+}
+
+// read all of path, checking that it's size bytes of byte_at(pos, arg).
+static void verify(const char *path, uint32_t size, 
+        uint8_t (*byte_at)(uint32_t, int), int arg) {
+    static uint8_t vbuf[IO_CHUNK];
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) fail("open", path);
+
+    uint32_t pos = 0;
+    int n;
+    while ((n = read(fd, vbuf, IO_CHUNK)) > 0) {
+        for (int i = 0; i < n; i++) {
+            if (vbuf[i] != byte_at(pos + i, arg)) fail("verify", path);
+        }
+        pos += n;
+    }
+    if (n < 0 || pos != size) fail("verify", path);
+    close(fd);
+}
+
+int main(int argc, char **argv) {
+    const char *image = argc > 1 ? argv[1] : "fsbench.img";
+    uint32_t n_dirs = argc > 2 ? strtoul(argv[2], NULL, 0) : 1000;
+    uint32_t n_files = argc > 3 ? strtoul(argv[3], NULL, 0) : 1000;
+    uint32_t n_lookups = argc > 4 ? strtoul(argv[4], NULL, 0) : 20000;
+    uint32_t file_mb = argc > 5 ? strtoul(argv[5], NULL, 0) : 8;
+
+    if (shim_open_disk(image, DISK_MB)) return 1;
+
+    char path[64];
+    static uint8_t buf[IO_CHUNK];
+    for (int i = 0; i < IO_CHUNK; i++) buf[i] = i;
+
+    printf("%-12s %8s %12s %9s %9s %9s %9s %9s\n", "phase", "ops",
+            "ops/s", "MB/s", "rd/op", "wr/op", "rsec/op", "wsec/op");
+
+    begin();
+    mkfs(FS_START_MB, FS_LEN_MB);
+    report("mkfs", 1, 0);
+
+    // a few top-level directories, and everything else under them.
+    begin();
+    for (uint32_t i = 0; i < n_dirs; i++) {
+        if (i < N_TOP_DIRS) {
+            snprintf(path, sizeof(path), "/d%u", i);
+        } else {
+            snprintf(path, sizeof(path), "/d%u/s%u", i % N_TOP_DIRS, i);
+        }
+        if (mkdir(path)) fail("mkdir", path);
+    }
+    report("mkdir", n_dirs, 0);
+
+    begin();
+    for (uint32_t i = 0; i < n_files; i++) {
+        snprintf(path, sizeof(path), "/d%u/f%u", i % N_TOP_DIRS, i);
+        int fd = open(path, O_RDWR | O_CREAT);
+        if (fd < 0) fail("create", path);
+        close(fd);
+    }
+    report("create", n_files, 0);
+
+    begin();
+    for (uint32_t i = 0; i < n_lookups; i++) {
+        uint32_t f = (i * 7919) % n_files;
+        snprintf(path, sizeof(path), "/d%u/f%u", f % N_TOP_DIRS, f);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) fail("lookup", path);
+        close(fd);
+    }
+    report("lookup", n_lookups, 0);
+
+    begin();
+    fs_sync();
+    report("sync", 1, 0);
+
+    // sequential write, including getting it all to disk.
+    uint32_t n_chunks = file_mb * (1 << 20) / IO_CHUNK;
+    uint64_t bytes = (uint64_t) n_chunks * IO_CHUNK;
+
+    begin();
+    int fd = open("/big", O_RDWR | O_CREAT);
+    if (fd < 0) fail("create", "/big");
+    for (uint32_t i = 0; i < n_chunks; i++) {
+        if (write(fd, buf, IO_CHUNK) != IO_CHUNK) fail("write", "/big");
+    }
+    close(fd);
+    fs_sync();
+    report("seq write", n_chunks, bytes);
+
+    // sequential read, with nothing cached.
+    pcache_shrink(0xffffffff);
+
+    begin();
+    fd = open("/big", O_RDONLY);
+    if (fd < 0) fail("open", "/big");
+    for (uint32_t i = 0; i < n_chunks; i++) {
+        if (read(fd, buf, IO_CHUNK) != IO_CHUNK) fail("read", "/big");
+    }
+    close(fd);
+    report("seq read", n_chunks, bytes);
+
+    // again, from the page cache.
+    begin();
+    fd = open("/big", O_RDONLY);
+    for (uint32_t i = 0; i < n_chunks; i++) {
+        if (read(fd, buf, IO_CHUNK) != IO_CHUNK) fail("read", "/big");
+    }
+    close(fd);
+    report("cached read", n_chunks, bytes);
+
+    // files and directories small enough to live in their inodes, 
+    // then grown past that, which moves them out to a block.
+    if (mkdir("/small")) fail("mkdir", "/small");
+
+    begin();
+    memset(buf, 'i', SMALL_LEN);
+    for (uint32_t i = 0; i < N_SMALL; i++) {
+        snprintf(path, sizeof(path), "/small/f%u", i);
+        fd = open(path, O_RDWR | O_CREAT);
+        if (fd < 0) fail("create", path);
+        if (write(fd, buf, SMALL_LEN) != SMALL_LEN) fail("write", path);
+        close(fd);
+
+        snprintf(path, sizeof(path), "/small/d%u", i);
+        if (mkdir(path)) fail("mkdir", path);
+        snprintf(path, sizeof(path), "/small/d%u/x", i);
+        fd = open(path, O_RDWR | O_CREAT);
+        if (fd < 0) fail("create", path);
+        close(fd);
+    }
+    fs_sync();
+    report("inline", N_SMALL, N_SMALL * SMALL_LEN);
+
+    begin();
+    memset(buf, 'u', GROWN_LEN - SMALL_LEN);
+    for (uint32_t i = 0; i < N_SMALL; i++) {
+        snprintf(path, sizeof(path), "/small/f%u", i);
+        fd = open(path, O_RDWR | O_APPEND);
+        if (fd < 0) fail("open", path);
+        if (write(fd, buf, GROWN_LEN - SMALL_LEN) != GROWN_LEN - SMALL_LEN) fail("write", path);
+        close(fd);
+
+        for (uint32_t k = 0; i % 2 == 0 && k < DIR_GROWTH; k++) {
+            snprintf(path, sizeof(path), "/small/d%u/entry%u", i, k);
+            fd = open(path, O_RDWR | O_CREAT);
+            if (fd < 0) fail("create", path);
+            close(fd);
+        }
+    }
+    fs_sync();
+    report("uninline", N_SMALL, N_SMALL * (GROWN_LEN - SMALL_LEN));
+
+    pcache_shrink(0xffffffff);
+    for (uint32_t i = 0; i < N_SMALL; i++) {
+        snprintf(path, sizeof(path), "/small/f%u", i);
+        verify(path, GROWN_LEN, small_byte, 0);
+        for (uint32_t k = 0; i % 2 == 0 && k < DIR_GROWTH; k++) {
+            snprintf(path, sizeof(path), "/small/d%u/entry%u", i, k);
+            fd = open(path, O_RDONLY);
+            if (fd < 0) fail("lookup", path);
+            close(fd);
+        }
+    }
+
+    // listing them all, half from blocks and half from inodes. 
+    // getdents_plus() reads the entries' inodes as well.
+    pcache_shrink(0xffffffff);
+    begin();
+    list_small(0);
+    report("getdents", N_SMALL + 1, 0);
+
+    pcache_shrink(0xffffffff);
+    begin();
+    list_small(1);
+    report("getdents+", N_SMALL + 1, 0);
+    list_growing();
+
+    // a file that's mostly holes, with each block of data its own 
+    // extent. then the holes are filled, last first, so the extents 
+    // grow and merge in the middle of the tree as well as at its end.
+    uint32_t sparse_size = (SPARSE_ISLANDS - 1) * SPARSE_STRIDE + ISLAND_LEN;
+    uint32_t gap = SPARSE_STRIDE - ISLAND_LEN;
+
+    begin();
+    memset(buf, 0xa5, ISLAND_LEN);
+    fd = open("/sparse", O_RDWR | O_CREAT);
+    if (fd < 0) fail("create", "/sparse");
+    for (uint32_t i = 0; i < SPARSE_ISLANDS; i++) {
+        lseek(fd, i * SPARSE_STRIDE, SEEK_SET);
+        if (write(fd, buf, ISLAND_LEN) != ISLAND_LEN) fail("write", "/sparse");
+    }
+    close(fd);
+    fs_sync();
+    report("sparse write", SPARSE_ISLANDS, SPARSE_ISLANDS * ISLAND_LEN);
+
+    pcache_shrink(0xffffffff);
+    begin();
+    verify("/sparse", sparse_size, sparse_byte, 0);
+    report("sparse read", 1, sparse_size);
+
+    begin();
+    memset(buf, 0x5a, gap);
+    fd = open("/sparse", O_RDWR);
+    for (uint32_t i = SPARSE_ISLANDS - 1; i-- > 0; ) {
+        lseek(fd, i * SPARSE_STRIDE + ISLAND_LEN, SEEK_SET);
+        if (write(fd, buf, gap) != gap) fail("write", "/sparse");
+    }
+    close(fd);
+    fs_sync();
+    report("hole fill", SPARSE_ISLANDS - 1, (uint64_t) (SPARSE_ISLANDS - 1) * gap);
+
+    pcache_shrink(0xffffffff);
+    verify("/sparse", sparse_size, sparse_byte, 1);
+
+    // blocks laid out ahead of time, read before they're written 
+    // (as zeroes), then written in pieces, which splits the 
+    // unwritten extents around each piece.
+    begin();
+    fd = open("/falloc", O_RDWR | O_CREAT);
+    if (fd < 0) fail("create", "/falloc");
+    if (fallocate(fd, 0, FALLOC_LEN)) fail("fallocate", "/falloc");
+    close(fd);
+    fs_sync();
+    report("fallocate", 1, 0);
+
+    verify("/falloc", FALLOC_LEN, falloc_byte, 0);
+
+    begin();
+    memset(buf, 0x3c, FALLOC_WRITE);
+    fd = open("/falloc", O_RDWR);
+    for (uint32_t pos = 0; pos < FALLOC_LEN; pos += FALLOC_STRIDE) {
+        lseek(fd, pos + FALLOC_OFF, SEEK_SET);
+        if (write(fd, buf, FALLOC_WRITE) != FALLOC_WRITE) fail("write", "/falloc");
+    }
+    close(fd);
+    fs_sync();
+    report("falloc write", FALLOC_LEN / FALLOC_STRIDE, 
+            (uint64_t) FALLOC_LEN / FALLOC_STRIDE * FALLOC_WRITE);
+
+    pcache_shrink(0xffffffff);
+    begin();
+    verify("/falloc", FALLOC_LEN, falloc_byte, 1);
+    report("falloc read", 1, FALLOC_LEN);
+
+    begin();
+    umount_fs();
+    report("umount", 1, 0);
+
+    // what a boot costs, now that there's a filesystem.
+    begin();
+    if (mount_fs(FS_START_MB)) fail("mount", image);
+    report("mount", 1, 0);
+
+    begin();
+    if (fsck(0) != 0) fail("fsck", image);
+    report("fsck", 1, 0);
+
+    shim_close_disk();
+    return 0;
+}
@@ -0,0 +1,158 @@
+/* the kernel services fs.c needs, on top of Linux. see shim.h. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "shim.h"
+
+// for the prototypes we're implementing.
+#include "disk.h"
+#include "kalloc.h"
+#include "screen.h"
+#include "memory.h"
+#include "hardware.h"
+
+disk_stats shim_stats;
+int shim_verbose = 0;
+uint32_t shim_free_pages = 16384; // 64Mb
+
+static int disk_fd = -1;
+
+int shim_open_disk(const char *path, uint32_t size_mb) {
+    disk_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (disk_fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    // a fresh, all-zero disk. (mkfs expects one.)
+    if (ftruncate(disk_fd, (off_t) size_mb << 20)) {
+        perror("ftruncate");
+        return -1;
+    }
+
+    shim_reset_stats();
+    return 0;
+}
+
+void shim_close_disk() {
+    if (disk_fd >= 0) close(disk_fd);
+    disk_fd = -1;
+}
+
+void shim_reset_stats() {
+    memset(&shim_stats, 0, sizeof(shim_stats));
+}
+
+/* disk.h */
+
+static void disk_io_failed(const char *what, uint32_t lba) {
+    fprintf(stderr, "%s failed at lba %u\n", what, lba);
+    exit(1);
+}
+
+void disk_read_sectors(uint32_t lba, uint8_t *buf, uint32_t nsectors) {
+    shim_stats.read_reqs++;
+    shim_stats.read_sectors += nsectors;
+
+    size_t n = (size_t) nsectors * DISK_SECTOR_SIZE;
+    if (pread(disk_fd, buf, n, (off_t) lba * DISK_SECTOR_SIZE) != n) {
+        disk_io_failed("read", lba);
+    }
+}
+
+void disk_read(uint32_t lba, uint8_t *buf) {
+    disk_read_sectors(lba, buf, 1);
+}
+
+// like the ATA driver, a write that isn't a whole number
+// of sectors still costs the whole last sector.
+void disk_write(uint32_t lba, uint8_t *buf, uint32_t nchar) {
+    shim_stats.write_reqs++;
+    shim_stats.write_sectors += (nchar + DISK_SECTOR_SIZE - 1) / DISK_SECTOR_SIZE;
+
+    if (pwrite(disk_fd, buf, nchar, (off_t) lba * DISK_SECTOR_SIZE) != nchar) {
+        disk_io_failed("write", lba);
+    }
+}
+
+void disk_read_bootloader(uint32_t lba, uint8_t *buf, uint8_t chunk) {
+    disk_read_sectors(lba, buf, chunk);
+}
+
+/* kalloc.h */
+
+void *kmalloc(uint32_t req_size) {
+    return malloc(req_size);
+}
+
+void kfree(void *p) {
+    free(p);
+}
+
+void *kcalloc(uint32_t nitems, uint32_t size) {
+    return calloc(nitems, size);
+}
+
+void *krealloc(void *ptr, uint32_t size) {
+    return realloc(ptr, size);
+}
+
+/* screen.h */
+
+void print(char *message) {
+    if (shim_verbose) fputs(message, stdout);
+}
+
+void print_byte(uint8_t i) {
+    if (shim_verbose) printf("%02x ", i);
+}
+
+void print_word(uint32_t word) {
+    if (shim_verbose) printf("0x%08x\n", word);
+}
+
+void print_int(uint32_t i) {
+    if (shim_verbose) printf("%u", i);
+}
+
+/* hardware.h */
+
+void sys_exit() {
+    fflush(stdout);
+    abort();
+}
+
+/* memory.h
+ * there's no paging here: the page cache gets ordinary memory,
+ * and the mmap() fault path has nothing to map into. */
+
+void *alloc_kernel_page() {
+    return aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+}
+
+void free_kernel_page(void *p) {
+    free(p);
+}
+
+uint32_t free_page_count() {
+    return shim_free_pages;
+}
+
+uint8_t map_page(uint32_t virtual_addr, uint32_t phy_page_addr) {
+    return 0;
+}
+
+uint8_t map_free_page(uint32_t virtual_addr) {
+    return 0;
+}
+
+uint32_t unmap_page(uint32_t virtual_addr) {
+    return 0;
+}
+
+uint32_t virt_to_phys(uint32_t virtual_addr) {
+    return virtual_addr;
+}
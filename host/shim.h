@@ -0,0 +1,34 @@
+/* host build of the filesystem.
+ *
+ * kernel/fs.c and kernel/mkfs.c call into the disk driver, the
+ * kernel allocator, the screen and the page allocator. shim.c
+ * stands in for all of those, with the "disk" being an image file,
+ * so the filesystem runs as a normal Linux program.
+ *
+ * this header is for host code only. it can't include fs.h,
+ * since fs.h's open/read/write/FILE clash with libc's. */
+#pragma once
+#include <stdint.h>
+
+// device I/O since the last shim_reset_stats().
+// a request is one call into the disk driver.
+typedef struct {
+    uint64_t read_reqs;
+    uint64_t read_sectors;
+    uint64_t write_reqs;
+    uint64_t write_sectors;
+} disk_stats;
+
+extern disk_stats shim_stats;
+
+// the filesystem's messages (e.g. "mkdir: ...") are dropped unless set.
+extern int shim_verbose;
+
+// what free_page_count() reports. the page cache sizes itself from it.
+extern uint32_t shim_free_pages;
+
+// use path as the disk, creating it (zeroed) with size_mb Mb.
+int shim_open_disk(const char *path, uint32_t size_mb);
+void shim_close_disk();
+
+void shim_reset_stats();
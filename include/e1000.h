@@ -4,6 +4,20 @@
 
 void initialize_e1000();
 
-int send_eth_to_e1000(eth_pkt *ep);
-eth_pkt recv_eth_from_e1000();
+// m holds a whole ethernet frame. (and is freed.) it's queued 
+// on the transmit ring, and this returns without waiting for it 
+// to go out. -1 if the ring is full.
+int send_eth_to_e1000(mbuf *m);
+
+// frames sent between these are handed to the card all at once, 
+// at e1000_tx_end(). (they can nest.)
+void e1000_tx_begin();
+void e1000_tx_end();
+
+// sends a few frames as one burst, and checks the card got them 
+// with one TDT write. 0 if it did.
+int e1000_tx_test();
+
+// the next frame received. waits for one if there isn't any.
+mbuf *recv_eth_from_e1000();
 
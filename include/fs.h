@@ -18,6 +18,11 @@
 
 #define EXT2_ERRORS_RO  2
 
+// mounts before a check is suggested.
+#define EXT2_DFL_MAX_MNT_COUNT  20
+
+#define EXT2_DYNAMIC_REV    1
+
 #define EXT2_GOOD_OLD_FIRST_INO 11
 #define EXT2_GOOD_OLD_INODE_SIZE 128
 
@@ -28,11 +33,13 @@
 #define EXT2_ACL_DATA_INO       4
 #define EXT2_BOOT_LOADER_INO    5
 #define EXT2_UNDEL_DIR_INO      6
+#define EXT2_JOURNAL_INO        8
 
 #define EXT2_FREE_INO_START     11
 /* i_mode */
 
 /* file format */
+#define EXT2_S_IFMT     0xf000      // mask for the format
 #define EXT2_S_IFSOCK   0xc000      // socket
 #define EXT2_S_IFLNK    0xa000      // symlink
 #define EXT2_S_IFREG    0x8000      // regular file
@@ -69,6 +76,39 @@
 #define EXT2_FT_SYMLINK     7
 
 
+/* i_flags */
+#define EXT4_EXTENTS_FL     0x00080000  // blocks are mapped by an extent tree
+
+// the contents are in i_block. our own flag, not ext4's 
+// EXT4_INLINE_DATA_FL (0x10000000): ext4 keeps inline data in an 
+// extended attribute too, with a different layout. it's a bit 
+// ext4 doesn't use, and only means this with the feature below.
+#define MOCHI_INLINE_DATA_FL    0x00800000
+
+// how much fits in i_block.
+#define MOCHI_INLINE_DATA_MAX   60
+
+/* s_feature_compat */
+#define EXT3_FEATURE_COMPAT_HAS_JOURNAL 0x0004
+
+/* s_feature_ro_compat */
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001  // backups only in groups 0, 1 and powers of 3, 5, 7
+
+/* s_feature_incompat */
+#define EXT4_FEATURE_INCOMPAT_EXTENTS   0x0040
+
+// files with MOCHI_INLINE_DATA_FL. the top bit, far from the ones 
+// ext4 has used, so ext2/3/4 tools refuse the filesystem instead of 
+// reading our inline layout as theirs (INCOMPAT_INLINE_DATA, 0x8000).
+#define MOCHI_FEATURE_INCOMPAT_INLINE_DATA  0x80000000
+
+// what we know how to handle. a filesystem using anything 
+// else (incompat or ro_compat) doesn't get mounted.
+#define MOCHI_FEATURE_INCOMPAT_SUPP     (EXT4_FEATURE_INCOMPAT_EXTENTS | \
+        MOCHI_FEATURE_INCOMPAT_INLINE_DATA)
+#define MOCHI_FEATURE_RO_COMPAT_SUPP    EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER
+
+
 /* located at byte offset 1024
  * and 1024 bytes long. */
 typedef struct {
@@ -149,11 +189,18 @@ typedef struct {
     uint16_t bg_free_blocks_count;
     uint16_t bg_free_inodes_count;
     uint16_t bg_used_dirs_count;
-    uint16_t bg_pad;
+    uint16_t bg_flags;
 
     uint8_t bg_reserved[12];
 } bgdesc_t;
 
+/* bg_flags (ext4 values) */
+#define EXT4_BG_INODE_UNINIT    0x0001  // inode bitmap not written yet: all free
+#define EXT4_BG_BLOCK_UNINIT    0x0002  // block bitmap not written yet: only metadata used
+#define EXT4_BG_INODE_ZEROED    0x0004  // inode table has been zeroed
+
+#define MAX_BLOCK_GROUPS    1024
+
 // 128 bytes
 typedef struct {
     uint16_t i_mode;
@@ -177,15 +224,91 @@ typedef struct {
 } inode_t;
 
 
-// 32, 32, 64 = 128
+/* Extent trees (ext4 layout). 
+ * the root node sits in i_block: a header and up to 4 entries. 
+ * every other node takes up a whole block. */
+#define EXT4_EXT_MAGIC  0xf30a
+
+typedef struct {
+    uint16_t eh_magic;
+    uint16_t eh_entries;    // entries in use
+    uint16_t eh_max;        // entries that fit in this node
+    uint16_t eh_depth;      // 0 if the entries are leaves (ext4_extent)
+    uint32_t eh_generation;
+} ext4_extent_header;
+
+// leaf entry: ee_len blocks, starting at logical block ee_block.
+typedef struct {
+    uint32_t ee_block;
+    uint16_t ee_len;
+    uint16_t ee_start_hi;
+    uint32_t ee_start_lo;
+} ext4_extent;
+
+// index entry: the node at ei_leaf covers logical blocks from ei_block.
+typedef struct {
+    uint32_t ei_block;
+    uint32_t ei_leaf_lo;
+    uint16_t ei_leaf_hi;
+    uint16_t ei_unused;
+} ext4_extent_idx;
+
+
+/* Journal (JBD layout).
+ * block 0 of the journal is a journal_superblock_t. after it, each 
+ * transaction is one or more descriptor blocks, each followed by 
+ * the blocks its tags describe, and then a commit block. */
+#define JBD_MAGIC_NUMBER        0xc03b3998
+
+#define JBD_DESCRIPTOR_BLOCK    1
+#define JBD_COMMIT_BLOCK        2
+#define JBD_SUPERBLOCK_V2       4
+
+#define JBD_FLAG_ESCAPE         1   // block started with JBD_MAGIC_NUMBER
+#define JBD_FLAG_LAST_TAG       8   // last tag in this descriptor
+
+typedef struct {
+    uint32_t h_magic;
+    uint32_t h_blocktype;
+    uint32_t h_sequence;    // transaction this block belongs to
+} journal_header_t;
+
+typedef struct {
+    journal_header_t s_header;
+    uint32_t s_blocksize;
+    uint32_t s_maxlen;      // blocks in the journal
+    uint32_t s_first;       // first block of the log
+    uint32_t s_sequence;    // first transaction expected in the log
+    uint32_t s_start;       // where it starts. 0 if the log is empty.
+    uint32_t s_errno;
+} journal_superblock_t;
+
+typedef struct {
+    uint32_t t_blocknr;     // where the block goes on disk
+    uint32_t t_flags;
+} journal_block_tag_t;
+
+
+#define EXT2_NAME_LEN   255
+
+// only the 8-byte header and the first name_len bytes of 
+// the name are stored on disk (not null-terminated), 
+// padded out to a 4-byte boundary. rec_len can be bigger 
+// than that, in which case the rest is slack that 
+// add_dentry can hand out to a new entry.
 typedef struct {
     uint32_t inode;
     uint16_t rec_len; // points to end of block if no next
     uint8_t name_len;
     uint8_t file_type;
-    char name[64]; // wasteful
+    char name[EXT2_NAME_LEN + 1]; // +1 so we can null-terminate in memory
 } dentry_t;
 
+#define DENTRY_HDR_LEN  8
+
+// smallest rec_len that holds a name of length n
+#define dentry_rec_len(n)   ((DENTRY_HDR_LEN + (n) + 3) & ~3)
+
 // for use in the OS. has helpful backpointers 
 // when doing disk operations. 
 typedef struct {
@@ -204,14 +327,52 @@ void mkfs(uint32_t offset, uint32_t len);
 // once the metadata is in place, creates the root directory.
 void finish_fs_init(uint32_t mb_start);
 
+// does group_n hold a backup of the superblock and BGDT?
+uint8_t ext2_bg_has_super(superblock_t *sb, uint32_t group_n);
+
+// how many blocks the BGDT takes up.
+uint32_t ext2_bgdt_blocks(superblock_t *sb);
+
+// a bit of background work (writing back dirty data, committing 
+// the journal, zeroing inode tables). returns 0 once there's 
+// nothing left to do, for now.
+int fs_idle();
+
 
 // cast mb to bytes, then divide by disk sector size (512)
 #define mb_to_lba(mb) (mb * 1024 * 2)
 
+// lba of the superblock of a filesystem starting at mb_start.
+uint32_t fs_start_to_lba_superblk(uint32_t mb_start);
+
 void read_fs(uint32_t location);
 
+// use the filesystem already at mb_start (replaying its journal 
+// if need be). returns -1 if there isn't one we can use.
+int mount_fs(uint32_t mb_start);
+
+// write everything out and mark the filesystem clean. 
+// nothing should touch the filesystem after this.
+void umount_fs();
+
+// check the mounted filesystem. with fix set, the bitmaps and free 
+// counts are rebuilt from what's actually in use. 
+// returns how many problems were found.
+uint32_t fsck(uint8_t fix);
+
 void test_fs();
 
+// write all cached metadata (bitmaps, BGDT, superblock) 
+// back to disk, including the backup copies.
+void fs_sync();
+
+// drives the filesystem's background write-back. call once a second.
+void fs_timer_tick();
+
+// evict up to npages pages of cached file data 
+// (writing back any that are dirty).
+void pcache_shrink(uint32_t npages);
+
 /* interface to the filesystem! */
 
 typedef uint32_t fd_t;      // file descriptor type
@@ -232,26 +393,89 @@ int ls(char *path);
 
 /* open file structure.*/
 typedef struct {
-    // inode for this file
-    inode_t *inode;
+    // the file itself. the inode is kept up to date as we write.
+    mochi_file file;
 
-    // where we are in this file
-    uint32_t cursor_blockn;
-    uint16_t cursor_offset;
+    // where we are in this file (in bytes)
+    uint32_t offset;
     
     // read/write? kerrisk describes this...
-    uint8_t flags; 
+    uint32_t flags; 
+
+    uint8_t in_use;
 } FILE;
 
-// the "file table" (more of a linked list than a table.)
-typedef struct _ft {
-    int fd; // the number associated with this file descriptor.
-    struct _ft *next;
-    struct _ft *prev;
-} ft_entry;
+// the "file table". a file descriptor is an index into it.
+#define MAX_OPEN_FILES  32
+
+/* open() flags (same values as Linux) */
+#define O_RDONLY    0x0000
+#define O_WRONLY    0x0001
+#define O_RDWR      0x0002
+#define O_ACCMODE   0x0003
+#define O_CREAT     0x0040
+#define O_APPEND    0x0400
+
+/* lseek() whence */
+#define SEEK_SET    0
+#define SEEK_CUR    1
+#define SEEK_END    2
 
 
 /* the following are from the Linux manpages.*/
 int open(const char *pathname, int flags);
+int read(int fd, void *buf, uint32_t count);
+int write(int fd, const void *buf, uint32_t count);
+int lseek(int fd, int32_t offset, int whence);
+int close(int fd);
+
+// lay out blocks for [offset, offset + len) ahead of writing them,
+// contiguously where possible. they read as zeroes until written.
+int fallocate(int fd, uint32_t offset, uint32_t len);
 
+/* directory listing */
 
+// one entry, as getdents() hands it out. the records are 
+// back to back, each d_reclen long (a multiple of 4).
+typedef struct {
+    uint32_t d_ino;
+    uint32_t d_off;         // offset of the next entry
+    uint16_t d_reclen;
+    uint8_t d_type;         // EXT2_FT_*
+    char d_name[];          // null-terminated
+} mochi_dirent;
+
+// getdents_plus() also gives the attributes from each entry's inode.
+typedef struct {
+    uint32_t d_ino;
+    uint32_t d_off;
+    uint16_t d_reclen;
+    uint8_t d_type;
+    uint8_t d_pad;
+    uint16_t i_mode;
+    uint16_t i_links_count;
+    uint32_t i_size;
+    uint32_t i_blocks;
+    uint32_t i_mtime;
+    char d_name[];
+} mochi_dirent_plus;
+
+// fd is an open directory. fills buf with as many entries as fit 
+// in count bytes, and returns how many bytes that was: 0 at the 
+// end of the directory, -1 if not even one entry fit.
+int getdents(int fd, mochi_dirent *buf, uint32_t count);
+int getdents_plus(int fd, mochi_dirent_plus *buf, uint32_t count);
+
+/* memory-mapped files */
+
+// map len bytes of inode_n's data, starting offset bytes in 
+// (a multiple of the page size). pages are read in as they're 
+// touched. the mapping is for reading: writes to it aren't caught 
+// (see "Memory-mapped files" in fs.c), and aren't written back.
+void *mmap(uint32_t inode_n, uint32_t offset, uint32_t len);
+int munmap(void *addr);
+
+// for the page fault handler. if addr is in a mapped file, fills 
+// in its page and returns 0, or -1 if the page can't be read in. 
+// returns 1 if addr isn't in a mapped file.
+int mmap_fault(uint32_t addr);
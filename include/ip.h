@@ -1,6 +1,7 @@
 #pragma once
 
 #include "kalloc.h"
+#include "mbuf.h"
 
 // https://en.wikipedia.org/wiki/List_of_IP_protocol_numbers
 #define IP_PROTOCOL_TCP 6
@@ -20,7 +21,9 @@ typedef struct {
     uint32_t dst_addr;
 } ip_hdr;
 
-int send_pkt_to_ip(uint8_t *tpkt, uint16_t tlen, uint8_t protocol);
+// m holds the TCP/UDP packet. (and is freed.)
+int send_pkt_to_ip(mbuf *m, uint8_t protocol);
 
-// could be TCP, UDP
-uint8_t *recv_pkt_from_ip(uint8_t *protocol);
+// could be TCP, UDP. the IP header is stripped off. 
+// malformed packets are dropped and waited past.
+mbuf *recv_pkt_from_ip(uint8_t *protocol);
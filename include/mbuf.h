@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+
+/* packet buffers, a bit like BSD's mbufs (or Linux's sk_buffs).
+ *
+ * a packet stays in one mbuf all the way down the stack (or up it).
+ * the packet's bytes start at data, with free space before and
+ * after them, so each layer adds its header with mbuf_push() or
+ * strips it with mbuf_pull() instead of copying the packet.
+ *
+ * whoever an mbuf is handed to owns it: the send functions free
+ * the mbufs they're given, and the recv functions' callers free
+ * the ones they get back.
+ *
+ * most mbufs come from kmalloc. a driver that can't call it (in an
+ * interrupt handler), or needs buffers it can DMA into, keeps its
+ * own mbuf_pool instead, and mbuf_free() puts those back in it. */
+
+#define MBUF_SIZE       2048    // a whole ethernet frame, with room to spare
+#define MBUF_HEADROOM   64      // enough for the eth, ip and udp headers
+
+struct mbuf_pool;
+
+typedef struct mbuf {
+    uint8_t buf[MBUF_SIZE] __attribute__((aligned (16))); // (for DMA)
+    uint8_t *data;      // the packet's first byte
+    uint16_t len;       // bytes from data on
+    struct mbuf *next;  // in a queue of them
+    struct mbuf_pool *pool; // where it goes back to (NULL if kmalloc'd)
+} mbuf;
+
+typedef struct mbuf_pool {
+    mbuf *free;         // through next
+    uint32_t nfree;
+} mbuf_pool;
+
+// an empty mbuf, with MBUF_HEADROOM bytes free in front.
+// NULL if we're out of memory.
+mbuf *mbuf_alloc();
+void mbuf_free(mbuf *m);
+
+// hand the n mbufs at bufs to pool p.
+void mbuf_pool_init(mbuf_pool *p, mbuf *bufs, uint32_t n);
+
+// an empty mbuf from p, like mbuf_alloc(). NULL if they're all in use.
+// safe to call with interrupts off.
+mbuf *mbuf_pool_get(mbuf_pool *p);
+
+// make room for n more bytes at the front (push) or the back (put),
+// and return where they go. NULL if there isn't room.
+uint8_t *mbuf_push(mbuf *m, uint16_t n);
+uint8_t *mbuf_put(mbuf *m, uint16_t n);
+
+// drop n bytes from the front, and return the new front.
+// NULL if the packet is shorter than that.
+uint8_t *mbuf_pull(mbuf *m, uint16_t n);
+
+// cut the packet down to len bytes, if it's longer.
+void mbuf_trim(mbuf *m, uint16_t len);
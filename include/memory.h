@@ -18,5 +18,20 @@ typedef struct {
 
 void setup_memory();
 
-uint8_t map_free_page();
+uint8_t map_free_page(uint32_t virtual_addr);
+uint8_t map_page(uint32_t virtual_addr, uint32_t phy_page_addr);
+uint32_t unmap_page(uint32_t virtual_addr);
+uint32_t virt_to_phys(uint32_t virtual_addr);
+
+uint32_t alloc_page();
+void free_page(uint32_t addr);
+
+// a whole page of kernel memory, page-aligned. 
+// returns NULL if we're out.
+void *alloc_kernel_page();
+void free_kernel_page(void *p);
+
+// physical pages not yet handed out. 
+// (the page cache sizes itself from this.)
+uint32_t free_page_count();
 
@@ -1,7 +1,11 @@
 #pragma once
 #include <stdint.h>
 #include "kalloc.h"
+#include "mbuf.h"
 
-int send_pkt_to_udp(uint8_t *pkt, uint16_t len, uint16_t src_port, uint16_t dst_port);
+// m holds the payload. (and is freed.)
+int send_pkt_to_udp(mbuf *m, uint16_t src_port, uint16_t dst_port);
 
-uint8_t *recv_pkt_from_udp(uint16_t *src_port, uint16_t *dst_port);
+// the payload of the next UDP packet, or NULL if the next 
+// IP packet isn't UDP (or is cut short). the ports are in host order.
+mbuf *recv_pkt_from_udp(uint16_t *src_port, uint16_t *dst_port);
@@ -8,12 +8,14 @@
 #include "kalloc.h"
 #include "string.h"
 #include "screen.h"
+#include "memory.h"
 
 #define S_BLOCK_SIZE    (1024 << super.s_log_block_size)
 
 #define SECTORS_PER_BLOCK   (S_BLOCK_SIZE / DISK_SECTOR_SIZE)
 
-#define SUPERBLOCK_OFFSET   SECTORS_PER_BLOCK
+// the superblock is always 1024 bytes in, whatever the block size.
+#define SUPERBLOCK_OFFSET   (1024 / DISK_SECTOR_SIZE)
 
 
 // TODO: maybe...move this into the "disk" section?
@@ -23,29 +25,64 @@ static uint8_t fs_start_set = 0;
 static uint16_t n_block_groups;
 
 // TODO: initialize this with a calloc
-static bgdesc_t bgdt[1024];
+static bgdesc_t bgdt[MAX_BLOCK_GROUPS];
+
+// what the primary BGDT on disk holds, so only the 
+// blocks of it that changed get written.
+static bgdesc_t bgdt_on_disk[MAX_BLOCK_GROUPS];
 
 static superblock_t super;
 
+// in-memory copies of each group's block and inode bitmaps. 
+// they're read in the first time they're needed, changed in place, 
+// and written back lazily by flush_bitmaps() (see fs_commit).
+typedef struct {
+    uint32_t *words;        // NULL until loaded
+    uint32_t first_free;    // no bit below this one is free
+    uint8_t dirty;
+} bitmap_cache;
 
-int disk_read_blk(uint32_t block_num, uint8_t *buf) {
+static bitmap_cache block_bitmaps[MAX_BLOCK_GROUPS];
+static bitmap_cache inode_bitmaps[MAX_BLOCK_GROUPS];
+
+// the free counts in super and bgdt are only changed in memory. 
+// fs_commit() writes them out (primary copies only), either from 
+// fs_sync() or once the timer says a commit is due. 
+// the backup copies are only written by fs_sync().
+static uint8_t super_dirty = 0;
+static uint8_t bgdt_dirty = 0;
+
+#define FS_COMMIT_INTERVAL  5   // seconds
+static uint32_t secs_since_commit = 0;
+static uint8_t commit_due = 0;
+
+static uint32_t fs_clock = 0;   // seconds, counted by fs_timer_tick
+static uint8_t wb_due = 0;      // the flusher should look for old pages
+
+
+// n consecutive blocks, as one device request.
+int disk_read_blks(uint32_t block_num, uint8_t *buf, uint32_t n) {
     if (!fs_start_set) return 1;
 
     uint32_t lba = filesys_start + block_num * SECTORS_PER_BLOCK;
-
-    for (int i = 0; i < SECTORS_PER_BLOCK; i++) {
-        disk_read(lba + i, buf + DISK_SECTOR_SIZE * i);
-    }
+    disk_read_sectors(lba, buf, n * SECTORS_PER_BLOCK);
     return 0;
 }
 
-int disk_write_blk(uint32_t block_num, uint8_t *buf) {
+int disk_write_blks(uint32_t block_num, uint8_t *buf, uint32_t n) {
     if (!fs_start_set) return -1;
 
     uint32_t lba = filesys_start + block_num * SECTORS_PER_BLOCK;
-    for (int i = 0; i < SECTORS_PER_BLOCK; i++) {
-        disk_write(lba + i, buf + DISK_SECTOR_SIZE * i, DISK_SECTOR_SIZE);
-    }
+    disk_write(lba, buf, n * S_BLOCK_SIZE);
+    return 0;
+}
+
+int disk_read_blk(uint32_t block_num, uint8_t *buf) {
+    return disk_read_blks(block_num, buf, 1);
+}
+
+int disk_write_blk(uint32_t block_num, uint8_t *buf) {
+    return disk_write_blks(block_num, buf, 1);
 }
 
 // TODO: replace disk_write_blk with disk_write_bn
@@ -58,87 +95,791 @@ int disk_write_bn(uint32_t block_num, uint8_t *buf, uint16_t len) {
     disk_write(lba, buf, len);
 }
 
-// finds 0-valued entry in bitmap (len S_BLOCK_SIZE)
-uint32_t first_free_bm(uint8_t *bitmap, uint8_t allowed_start) {
-    uint32_t first_free_block;
-    uint8_t first_val = allowed_start / 8;
-    for (int j = first_val; j < S_BLOCK_SIZE; j++) {
-        uint8_t bmj = bitmap[j];
-        if (bmj == 255) continue; // everything filled...
-        // TODO: remember that this is little-endian. might be doing this 
-        // backwards (compared to an official implementation)
-        uint8_t match;
-        for (int k = 0; k < 8; k++) {
-            if (((bmj >> k) & 1) == 0) {
-               match = k; 
-               break; 
+/* Journal.
+ *
+ * metadata (bitmaps, the inode table, BGDT, superblock, directory, 
+ * indirect and extent blocks) doesn't go to its home on disk right 
+ * away. meta_write_blk() copies it into a buffer in the running 
+ * transaction, and many operations share one transaction. 
+ * journal_commit() appends the whole transaction to the journal 
+ * (a contiguous file, inode s_journal_inum) in a few sequential 
+ * writes, then a commit block. the buffers stay in memory until 
+ * the log fills up (or fs_sync), and are only then checkpointed: 
+ * written home, in block order, and dropped. after a crash, 
+ * journal_recover() replays each transaction that has a commit block.
+ *
+ * meta_read_blk() sees the newest copy, journaled or not. 
+ * with no journal, both just go to the disk. */
+
+#define JOURNAL_BLOCKS      1024    // size mkfs tries for
+#define JOURNAL_MIN_BLOCKS  64
+#define JOURNAL_IO_BLOCKS   64      // biggest single write to the log
+#define N_JBUF_BUCKETS      256
+
+typedef struct jbuf {
+    uint32_t blockn;    // home location
+    uint8_t *data;      // newest contents
+    uint8_t *frozen;    // contents as logged, once data has moved on
+    uint8_t running;    // changed in the running transaction
+    uint8_t logged;     // in the log, but not written home yet
+    struct jbuf *next;  // hash chain
+} jbuf;
+
+static jbuf *jbuf_hash[N_JBUF_BUCKETS];
+static uint32_t n_jbufs = 0;
+static uint32_t n_running = 0;
+
+static uint8_t journal_on = 0;
+static uint32_t journal_blk;    // where the journal starts on disk
+static uint32_t journal_len;    // in blocks
+static uint32_t journal_head;   // next free block in the log
+static uint32_t journal_seq;    // the running transaction's sequence number
+static journal_superblock_t jsb;
+
+static uint8_t *journal_io = NULL; // staging for log and checkpoint writes
+
+jbuf *find_jbuf(uint32_t blockn) {
+    for (jbuf *jb = jbuf_hash[blockn % N_JBUF_BUCKETS]; jb != NULL; jb = jb->next) {
+        if (jb->blockn == blockn) return jb;
+    }
+    return NULL;
+}
+
+int meta_read_blk(uint32_t blockn, uint8_t *buf) {
+    jbuf *jb = find_jbuf(blockn);
+    if (jb == NULL) return disk_read_blk(blockn, buf);
+
+    memmove(buf, jb->data, S_BLOCK_SIZE);
+    return 0;
+}
+
+int meta_write_blk(uint32_t blockn, uint8_t *buf) {
+    if (!journal_on) return disk_write_blk(blockn, buf);
+
+    jbuf *jb = find_jbuf(blockn);
+    if (jb == NULL) {
+        jb = (jbuf *) kmalloc(sizeof(jbuf));
+        if (jb == NULL) return -1;
+        jb->data = (uint8_t *) kmalloc(S_BLOCK_SIZE);
+        if (jb->data == NULL) {
+            kfree(jb);
+            return -1;
+        }
+        jb->blockn = blockn;
+        jb->frozen = NULL;
+        jb->running = 0;
+        jb->logged = 0;
+        jb->next = jbuf_hash[blockn % N_JBUF_BUCKETS];
+        jbuf_hash[blockn % N_JBUF_BUCKETS] = jb;
+        n_jbufs++;
+    }
+
+    // the checkpoint has to write what was logged, 
+    // not changes that haven't been committed yet.
+    if (jb->logged && !jb->running && jb->frozen == NULL) {
+        jb->frozen = (uint8_t *) kmalloc(S_BLOCK_SIZE);
+        if (jb->frozen == NULL) return -1;
+        memmove(jb->frozen, jb->data, S_BLOCK_SIZE);
+    }
+
+    memmove(jb->data, buf, S_BLOCK_SIZE);
+    if (!jb->running) {
+        jb->running = 1;
+        n_running++;
+    }
+    return 0;
+}
+
+// blocks read straight from the disk (e.g. directory blocks going 
+// into the page cache) may have newer copies here.
+void journal_overlay(uint32_t blockn, uint8_t *buf, uint32_t n) {
+    if (n_jbufs == 0) return;
+
+    for (uint32_t i = 0; i < n; i++) {
+        jbuf *jb = find_jbuf(blockn + i);
+        if (jb != NULL) memmove(buf + i * S_BLOCK_SIZE, jb->data, S_BLOCK_SIZE);
+    }
+}
+
+// every buffer that's running (or logged), sorted by home block. 
+// the caller kfrees the array.
+jbuf **collect_jbufs(uint8_t want_running, uint32_t *n) {
+    jbuf **list = (jbuf **) kmalloc(n_jbufs * sizeof(jbuf *) + 1);
+    if (list == NULL) return NULL;
+
+    *n = 0;
+    for (int b = 0; b < N_JBUF_BUCKETS; b++) {
+        for (jbuf *jb = jbuf_hash[b]; jb != NULL; jb = jb->next) {
+            if (want_running ? !jb->running : !jb->logged) continue;
+
+            // insertion sort. there are at most a journal's worth.
+            uint32_t k = *n;
+            while (k > 0 && list[k - 1]->blockn > jb->blockn) {
+                list[k] = list[k - 1];
+                k--;
             }
+            list[k] = jb;
+            (*n)++;
+        }
+    }
+    return list;
+}
+
+void journal_write_super() {
+    uint8_t buf[S_BLOCK_SIZE];
+    memset(buf, 0, S_BLOCK_SIZE);
+    memmove(buf, &jsb, sizeof(jsb));
+    disk_write_blk(journal_blk, buf);
+}
+
+uint32_t tags_per_descriptor() {
+    return (S_BLOCK_SIZE - sizeof(journal_header_t)) / sizeof(journal_block_tag_t);
+}
+
+void init_journal_header(uint8_t *blk, uint32_t type) {
+    memset(blk, 0, S_BLOCK_SIZE);
+    journal_header_t *h = (journal_header_t *) blk;
+    h->h_magic = JBD_MAGIC_NUMBER;
+    h->h_blocktype = type;
+    h->h_sequence = journal_seq;
+}
+
+void drop_jbuf(jbuf *jb);
+
+// write every logged buffer home, in block order, with contiguous 
+// blocks going out as one request. then the log is empty again.
+void journal_checkpoint() {
+    if (!journal_on || jsb.s_start == 0) return;
+
+    uint32_t n;
+    jbuf **list = collect_jbufs(0, &n);
+    if (list == NULL) return;
+
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    for (uint32_t k = 0; k < n; k++) {
+        jbuf *jb = list[k];
+        if (run_len > 0 && (jb->blockn != run_start + run_len || run_len == JOURNAL_IO_BLOCKS)) {
+            disk_write_blks(run_start, journal_io, run_len);
+            run_len = 0;
+        }
+        if (run_len == 0) run_start = jb->blockn;
+
+        uint8_t *src = jb->frozen != NULL ? jb->frozen : jb->data;
+        memmove(journal_io + run_len * S_BLOCK_SIZE, src, S_BLOCK_SIZE);
+        run_len++;
+    }
+    if (run_len > 0) disk_write_blks(run_start, journal_io, run_len);
+
+    for (uint32_t k = 0; k < n; k++) {
+        jbuf *jb = list[k];
+        jb->logged = 0;
+        if (jb->frozen != NULL) {
+            kfree(jb->frozen);
+            jb->frozen = NULL;
         }
-        uint16_t first_free_entry = j * 8 + match;
-        if (first_free_entry < allowed_start) continue;
-        return first_free_entry;
+        // the disk is up to date with these now.
+        if (!jb->running) drop_jbuf(jb);
     }
+    kfree(list);
+
+    jsb.s_start = 0;
+    jsb.s_sequence = journal_seq;
+    journal_write_super();
+    journal_head = jsb.s_first;
 }
 
-// assumes there is a free block!
-// check that before calling this function.
-uint32_t first_free_block(bgdesc_t *d) {
-    // there is a free block; read the block bitmap.
-    uint8_t bitmap[S_BLOCK_SIZE]; // S_BLOCK_SIZE is 1024
-    disk_read_blk(d->bg_block_bitmap, bitmap);
+void drop_jbuf(jbuf *jb) {
+    jbuf **link = &jbuf_hash[jb->blockn % N_JBUF_BUCKETS];
+    while (*link != jb) link = &(*link)->next;
+    *link = jb->next;
 
-    // find the first free block in the bitmap. 
-    return first_free_bm(bitmap, 0);
+    if (jb->frozen != NULL) kfree(jb->frozen);
+    kfree(jb->data);
+    kfree(jb);
+    n_jbufs--;
 }
 
-uint32_t first_free_inode(bgdesc_t *d) {
-    uint8_t bitmap[S_BLOCK_SIZE];
+// the running transaction is too big for the journal: 
+// write it in place, with no protection.
+void journal_bypass() {
+    print("journal: transaction too big, writing in place\n");
+    journal_checkpoint();
 
-    disk_read_blk(d->bg_inode_bitmap, bitmap);
+    uint32_t n;
+    jbuf **list = collect_jbufs(1, &n);
+    if (list == NULL) return;
 
-    return first_free_bm(bitmap, EXT2_FREE_INO_START);
+    for (uint32_t k = 0; k < n; k++) {
+        disk_write_blk(list[k]->blockn, list[k]->data);
+        drop_jbuf(list[k]);
+    }
+    kfree(list);
+    n_running = 0;
 }
 
-// write the in-memory BGDT out to disk.
-void disk_sync_bgdt() {
-    // pad with 0s.
-    // (probably horribly inefficient)
+// append the running transaction to the log. 
+void journal_commit() {
+    if (!journal_on || n_running == 0) return;
+
+    uint32_t per_desc = tags_per_descriptor();
+    uint32_t ndesc = (n_running + per_desc - 1) / per_desc;
+    uint32_t needed = ndesc + n_running + 1;
+
+    if (needed > journal_len - jsb.s_first) {
+        journal_bypass();
+        return;
+    }
+
+    // only now does the log get checkpointed: when it's full.
+    if (journal_head + needed > journal_len) journal_checkpoint();
+
+    uint32_t n;
+    jbuf **list = collect_jbufs(1, &n);
+    if (list == NULL) return;
+
+    if (jsb.s_start == 0) {
+        // the first transaction in an empty log.
+        jsb.s_start = journal_head;
+        jsb.s_sequence = journal_seq;
+        journal_write_super();
+    }
+
+    // descriptors and blocks are gathered in journal_io, 
+    // and written out whenever it fills up.
+    uint32_t pos = journal_head;
+    uint32_t nio = 0;
+
+    for (uint32_t k = 0; k < n; k += per_desc) {
+        uint32_t chunk = n - k;
+        if (chunk > per_desc) chunk = per_desc;
+
+        if (nio == JOURNAL_IO_BLOCKS) {
+            disk_write_blks(journal_blk + pos, journal_io, nio);
+            pos += nio;
+            nio = 0;
+        }
+        uint8_t *desc = journal_io + (nio++) * S_BLOCK_SIZE;
+        init_journal_header(desc, JBD_DESCRIPTOR_BLOCK);
+        journal_block_tag_t *tags = (journal_block_tag_t *) (desc + sizeof(journal_header_t));
+
+        // the tags all have to be in place before the descriptor 
+        // can go out, which may happen partway through its blocks.
+        for (uint32_t j = 0; j < chunk; j++) {
+            jbuf *jb = list[k + j];
+            tags[j].t_blocknr = jb->blockn;
+            tags[j].t_flags = 0;
+            if (j == chunk - 1) tags[j].t_flags |= JBD_FLAG_LAST_TAG;
+
+            // a block that looks like a journal block would 
+            // confuse recovery, so its magic gets hidden.
+            if (*(uint32_t *) jb->data == JBD_MAGIC_NUMBER) {
+                tags[j].t_flags |= JBD_FLAG_ESCAPE;
+            }
+        }
+
+        for (uint32_t j = 0; j < chunk; j++) {
+            if (nio == JOURNAL_IO_BLOCKS) {
+                disk_write_blks(journal_blk + pos, journal_io, nio);
+                pos += nio;
+                nio = 0;
+            }
+            uint8_t *slot = journal_io + (nio++) * S_BLOCK_SIZE;
+            // (desc may have been written out and reused by now.)
+            memmove(slot, list[k + j]->data, S_BLOCK_SIZE);
+            if (*(uint32_t *) slot == JBD_MAGIC_NUMBER) *(uint32_t *) slot = 0;
+        }
+    }
+    if (nio > 0) disk_write_blks(journal_blk + pos, journal_io, nio);
+    pos += nio;
+
+    // the commit block goes last, once everything else is on disk.
+    init_journal_header(journal_io, JBD_COMMIT_BLOCK);
+    disk_write_blk(journal_blk + pos, journal_io);
+    journal_head = pos + 1;
+    journal_seq++;
+
+    for (uint32_t k = 0; k < n; k++) {
+        jbuf *jb = list[k];
+        jb->running = 0;
+        jb->logged = 1;
+        if (jb->frozen != NULL) {
+            kfree(jb->frozen);
+            jb->frozen = NULL;
+        }
+    }
+    n_running = 0;
+    kfree(list);
+}
+
+// walk the log from s_start. with replay == 0, counts the 
+// transactions that made it to their commit block. otherwise, 
+// writes the blocks of the first ntx transactions home.
+uint32_t journal_walk(uint32_t ntx, uint8_t replay) {
     uint8_t buf[S_BLOCK_SIZE];
-    uint8_t *bgdt_cast = (uint8_t *) bgdt;
-    uint32_t lim = n_block_groups * sizeof(bgdesc_t);
-    for (int i = 0; i < lim; i++) {
-        *(buf + i) = *(bgdt_cast + i);
+    uint8_t data[S_BLOCK_SIZE];
+    uint32_t per_desc = tags_per_descriptor();
+
+    uint32_t pos = jsb.s_start;
+    uint32_t seq = jsb.s_sequence;
+    uint32_t done = 0;
+
+    while (pos < journal_len && (!replay || done < ntx)) {
+        disk_read_blk(journal_blk + pos, buf);
+        journal_header_t *h = (journal_header_t *) buf;
+        if (h->h_magic != JBD_MAGIC_NUMBER || h->h_sequence != seq) break;
+        pos++;
+
+        if (h->h_blocktype == JBD_COMMIT_BLOCK) {
+            done++;
+            seq++;
+            continue;
+        }
+        if (h->h_blocktype != JBD_DESCRIPTOR_BLOCK) break;
+
+        journal_block_tag_t *tags = (journal_block_tag_t *) (buf + sizeof(journal_header_t));
+        for (uint32_t t = 0; t < per_desc; t++) {
+            if (replay) {
+                disk_read_blk(journal_blk + pos, data);
+                if (tags[t].t_flags & JBD_FLAG_ESCAPE) {
+                    *(uint32_t *) data = JBD_MAGIC_NUMBER;
+                }
+                disk_write_blk(tags[t].t_blocknr, data);
+            }
+            pos++;
+            if (tags[t].t_flags & JBD_FLAG_LAST_TAG) break;
+        }
     }
-    for (int i = lim; i < S_BLOCK_SIZE; i++) {
-        *buf = 0;
+    return done;
+}
+
+// replay whatever committed transactions the log still has. 
+// returns how many there were.
+uint32_t journal_recover() {
+    if (jsb.s_start == 0) return 0;
+
+    uint32_t ntx = journal_walk(0, 0);
+    journal_walk(ntx, 1);
+
+    jsb.s_sequence += ntx;
+    jsb.s_start = 0;
+    journal_write_super();
+    return ntx;
+}
+
+// forget all buffers, without writing them anywhere.
+void drop_journal() {
+    for (int b = 0; b < N_JBUF_BUCKETS; b++) {
+        while (jbuf_hash[b] != NULL) drop_jbuf(jbuf_hash[b]);
     }
+    n_running = 0;
+    journal_on = 0;
+
+    if (journal_io != NULL) kfree(journal_io);
+    journal_io = NULL;
+}
+
+/* Layout.
+ *
+ * with 1kb blocks, the superblock is block 1 (block 0 is for booting). 
+ * with bigger blocks, it's 1024 bytes into block 0. either way, 
+ * that's block s_first_data_block, and the BGDT starts right after. 
+ * groups 0 and 1, and groups that are powers of 3, 5 and 7 
+ * (with sparse_super; otherwise all of them), start with a copy 
+ * of both, at the same offsets from the start of the group. */
+
+uint8_t is_power_of(uint32_t n, uint32_t base) {
+    while (n > 1 && n % base == 0) n /= base;
+    return n == 1;
+}
+
+uint8_t ext2_bg_has_super(superblock_t *sb, uint32_t group_n) {
+    if (!(sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) return 1;
+    if (group_n <= 1) return 1;
+    return is_power_of(group_n, 3) || is_power_of(group_n, 5) || is_power_of(group_n, 7);
+}
 
-    uint8_t bgdt_blockn = 2;
-    // write out to disk.
-    disk_write_blk(bgdt_blockn, buf);
+uint32_t ext2_bgdt_blocks(superblock_t *sb) {
+    uint32_t block_size = 1024 << sb->s_log_block_size;
+    uint32_t n_groups = (sb->s_blocks_count + sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
+    return (n_groups * sizeof(bgdesc_t) + block_size - 1) / block_size;
+}
+
+uint32_t bgdt_start_blk() {
+    return super.s_first_data_block + 1;
+}
+
+// where the superblock sits in block s_first_data_block.
+uint32_t super_offset_in_blk() {
+    return 1024 - super.s_first_data_block * S_BLOCK_SIZE;
+}
+
+/* Metadata write-back. */
+
+// block i of the BGDT, padded out with 0s.
+void bgdt_to_block(bgdesc_t *table, uint32_t i, uint8_t *buf) {
+    uint32_t per_block = S_BLOCK_SIZE / sizeof(bgdesc_t);
+    uint32_t first = i * per_block;
+    uint32_t n = n_block_groups - first;
+    if (n > per_block) n = per_block;
+
+    memset(buf, 0, S_BLOCK_SIZE);
+    memmove(buf, &table[first], n * sizeof(bgdesc_t));
+}
+
+// write the blocks of the in-memory BGDT that changed out to disk.
+void disk_sync_bgdt() {
+    uint8_t buf[S_BLOCK_SIZE];
+    uint32_t per_block = S_BLOCK_SIZE / sizeof(bgdesc_t);
 
-    // also write the backup block.
-    disk_write_blk(bgdt_blockn + super.s_blocks_per_group, buf);
+    for (uint32_t i = 0; i < ext2_bgdt_blocks(&super); i++) {
+        uint32_t first = i * per_block;
+        uint32_t n = n_block_groups - first;
+        if (n > per_block) n = per_block;
+
+        if (!memcmp(&bgdt[first], &bgdt_on_disk[first], n * sizeof(bgdesc_t))) continue;
+
+        bgdt_to_block(bgdt, i, buf);
+        meta_write_blk(bgdt_start_blk() + i, buf);
+        memmove(&bgdt_on_disk[first], &bgdt[first], n * sizeof(bgdesc_t));
+    }
 }
 
 // write the in-memory superblock out to disk.
 void disk_sync_super() {
-    // superblock is 1024 bytes long, so we don't need to pad.
+    uint32_t blkn = super.s_first_data_block;
+    uint8_t buf[S_BLOCK_SIZE];
+
+    // with big blocks, the superblock shares its block.
+    if (super_offset_in_blk() != 0) meta_read_blk(blkn, buf);
+    memmove(buf + super_offset_in_blk(), &super, sizeof(superblock_t));
+    meta_write_blk(blkn, buf);
+}
+
+// the backups live at the same offsets in the groups that have them. 
+// they aren't journaled: the primaries are what recovery trusts.
+void disk_sync_backups() {
+    uint8_t buf[S_BLOCK_SIZE];
+    uint32_t n_bgdt = ext2_bgdt_blocks(&super);
+
+    for (uint32_t g = 1; g < n_block_groups; g++) {
+        if (!ext2_bg_has_super(&super, g)) continue;
+
+        uint32_t blkn = g * super.s_blocks_per_group + super.s_first_data_block;
+
+        // backups start their group's block, and say where they are.
+        memset(buf, 0, S_BLOCK_SIZE);
+        memmove(buf, &super, sizeof(superblock_t));
+        ((superblock_t *) buf)->s_block_group_nr = g;
+        disk_write_blk(blkn, buf);
+
+        for (uint32_t i = 0; i < n_bgdt; i++) {
+            bgdt_to_block(bgdt, i, buf);
+            disk_write_blk(blkn + 1 + i, buf);
+        }
+    }
+}
+
+/* Bitmaps. */
+
+void set_bit(uint8_t *bitmap, uint16_t i);
+uint32_t group_n_blocks(uint32_t group_n);
+
+// a group with an UNINIT flag has never had that bitmap written 
+// (mkfs leaves them all like that), so it's made up instead of read.
+bitmap_cache *load_bitmap(bitmap_cache *bm, uint32_t blkn, uint8_t uninit) {
+    if (bm->words == NULL) {
+        bm->words = (uint32_t *) kmalloc(S_BLOCK_SIZE);
+        if (uninit) {
+            memset(bm->words, 0, S_BLOCK_SIZE);
+        } else {
+            meta_read_blk(blkn, (uint8_t *) bm->words);
+        }
+        bm->first_free = 0;
+        bm->dirty = 0;
+    }
+    return bm;
+}
+
+// an unwritten block bitmap: the group's metadata is in use, 
+// and so are the bits past the end of a short last group.
+void init_block_bitmap(uint32_t group_n, bitmap_cache *bm) {
+    uint32_t start = group_n * super.s_blocks_per_group;
+    uint32_t itable_len = super.s_inodes_per_group * sizeof(inode_t) / S_BLOCK_SIZE;
+    uint32_t meta_end = bgdt[group_n].bg_inode_table + itable_len - start;
+
+    // see make_bgdt() in mkfs.c.
+    uint32_t i = (group_n == 0) ? 0 : super.s_first_data_block;
+    for (; i < meta_end; i++) set_bit((uint8_t *) bm->words, i);
+
+    for (i = group_n_blocks(group_n); i < super.s_blocks_per_group; i++) {
+        set_bit((uint8_t *) bm->words, i);
+    }
+}
+
+bitmap_cache *block_bitmap(uint32_t group_n) {
+    bitmap_cache *bm = &block_bitmaps[group_n];
+    if (bm->words != NULL) return bm;
+
+    uint8_t uninit = bgdt[group_n].bg_flags & EXT4_BG_BLOCK_UNINIT;
+    load_bitmap(bm, bgdt[group_n].bg_block_bitmap, uninit);
+    if (uninit) init_block_bitmap(group_n, bm);
+    return bm;
+}
+
+bitmap_cache *inode_bitmap(uint32_t group_n) {
+    uint8_t uninit = bgdt[group_n].bg_flags & EXT4_BG_INODE_UNINIT;
+    return load_bitmap(&inode_bitmaps[group_n], bgdt[group_n].bg_inode_bitmap, uninit);
+}
+
+// write every dirty bitmap back to disk.
+void flush_bitmaps() {
+    for (uint32_t i = 0; i < n_block_groups; i++) {
+        if (block_bitmaps[i].dirty) {
+            meta_write_blk(bgdt[i].bg_block_bitmap, (uint8_t *) block_bitmaps[i].words);
+            block_bitmaps[i].dirty = 0;
+            if (bgdt[i].bg_flags & EXT4_BG_BLOCK_UNINIT) {
+                bgdt[i].bg_flags &= ~EXT4_BG_BLOCK_UNINIT;
+                bgdt_dirty = 1;
+            }
+        }
+        if (inode_bitmaps[i].dirty) {
+            meta_write_blk(bgdt[i].bg_inode_bitmap, (uint8_t *) inode_bitmaps[i].words);
+            inode_bitmaps[i].dirty = 0;
+            if (bgdt[i].bg_flags & EXT4_BG_INODE_UNINIT) {
+                bgdt[i].bg_flags &= ~EXT4_BG_INODE_UNINIT;
+                bgdt_dirty = 1;
+            }
+        }
+    }
+}
+
+// forget the cached bitmaps (e.g. when a new filesystem is read in).
+void drop_bitmaps() {
+    for (int i = 0; i < MAX_BLOCK_GROUPS; i++) {
+        if (block_bitmaps[i].words != NULL) kfree(block_bitmaps[i].words);
+        if (inode_bitmaps[i].words != NULL) kfree(inode_bitmaps[i].words);
+        block_bitmaps[i].words = NULL;
+        inode_bitmaps[i].words = NULL;
+    }
+}
+
+/* Metadata write-back. */
+
+// write out everything that's dirty (bitmaps, BGDT, superblock). 
+// only the primary copies of the BGDT and superblock are written.
+void pcache_writeback_all();
+void drop_page_cache();
+void drop_delayed();
+void drop_bmap_caches();
+
+void fs_commit() {
+    // file data first, so the metadata never points at blocks 
+    // that haven't been written.
+    pcache_writeback_all();
+
+    flush_bitmaps();
+
+    if (bgdt_dirty) {
+        disk_sync_bgdt();
+        bgdt_dirty = 0;
+    }
+
+    if (super_dirty) {
+        disk_sync_super();
+        super_dirty = 0;
+    }
+
+    // everything above went into the running transaction.
+    journal_commit();
+
+    secs_since_commit = 0;
+    commit_due = 0;
+}
+
+// commit, and bring the home locations and 
+// backup copies up to date.
+void fs_sync() {
+    fs_commit();
+    journal_checkpoint();
+    disk_sync_backups();
+}
+
+// called once a second by the timer. we don't touch the disk from 
+// the interrupt; the flusher (fs_writeback) does the work.
+void fs_timer_tick() {
+    fs_clock++;
+    wb_due = 1;
+    if (++secs_since_commit >= FS_COMMIT_INTERVAL) commit_due = 1;
+}
+
+// operations only commit themselves when they have to: the running 
+// transaction is a good fraction of the log, or the flusher hasn't 
+// had a chance to in a long time.
+void commit_if_due() {
+    if ((journal_on && n_running >= journal_len / 4) || 
+            secs_since_commit >= 2 * FS_COMMIT_INTERVAL) {
+        fs_commit();
+    }
+}
+
+/* Lazy inode table init.
+ *
+ * mkfs doesn't zero the inode tables (on a big disk that's most of 
+ * the formatting time). fs_idle() does it a few blocks at a time 
+ * instead, whenever the kernel has nothing better to do, and sets 
+ * EXT4_BG_INODE_ZEROED on each group as it finishes. 
+ *
+ * nothing depends on the zeroing: an inode is written in full when 
+ * it's allocated, and free inodes are never read. it's so that 
+ * leftovers from an old filesystem can't pass for inodes later. */
+
+#define ITABLE_ZERO_BLOCKS  64  // blocks zeroed per fs_idle() call
+
+static uint32_t zero_group = 0;     // groups below this are done
+static uint32_t zero_next = 0;      // next block of zero_group's table
+static uint8_t *zero_buf = NULL;
+
+bitmap_cache *inode_bitmap(uint32_t group_n);
+
+// is any inode in block blk_i of group_n's inode table allocated?
+uint8_t itable_block_used(uint32_t group_n, uint32_t blk_i) {
+    if (bgdt[group_n].bg_flags & EXT4_BG_INODE_UNINIT) return 0;
+
+    uint32_t *words = inode_bitmap(group_n)->words;
+    uint32_t per_block = S_BLOCK_SIZE / sizeof(inode_t);
+    for (uint32_t i = blk_i * per_block; i < (blk_i + 1) * per_block; i++) {
+        if ((words[i / 32] >> (i % 32)) & 1) return 1;
+    }
+    return 0;
+}
+
+// clear the free inodes in a block that has some in use.
+void zero_free_inodes(uint32_t group_n, uint32_t blk_i) {
+    uint8_t buf[S_BLOCK_SIZE];
+    uint32_t blkn = bgdt[group_n].bg_inode_table + blk_i;
+    uint32_t *words = inode_bitmap(group_n)->words;
+    uint32_t per_block = S_BLOCK_SIZE / sizeof(inode_t);
+
+    meta_read_blk(blkn, buf);
+    for (uint32_t k = 0; k < per_block; k++) {
+        uint32_t i = blk_i * per_block + k;
+        if ((words[i / 32] >> (i % 32)) & 1) continue;
+        memset(buf + k * sizeof(inode_t), 0, sizeof(inode_t));
+    }
+    meta_write_blk(blkn, buf);
+}
+
+// start over, for a newly read filesystem.
+void drop_lazy_init() {
+    zero_group = 0;
+    zero_next = 0;
+    if (zero_buf != NULL) kfree(zero_buf);
+    zero_buf = NULL;
+}
+
+int fs_writeback();
+
+int fs_idle() {
+    if (!fs_start_set) return 0;
+
+    // write-back first: that's what the other operations are waiting on.
+    if (fs_writeback()) return 1;
+
+    while (zero_group < n_block_groups && 
+            (bgdt[zero_group].bg_flags & EXT4_BG_INODE_ZEROED)) {
+        zero_group++;
+        zero_next = 0;
+    }
+    if (zero_group == n_block_groups) {
+        if (zero_buf != NULL) kfree(zero_buf);
+        zero_buf = NULL;
+        return 0;
+    }
+
+    if (zero_buf == NULL) {
+        zero_buf = (uint8_t *) kcalloc(ITABLE_ZERO_BLOCKS, S_BLOCK_SIZE);
+        if (zero_buf == NULL) return 0;
+    }
+
+    uint32_t g = zero_group;
+    uint32_t itable_len = super.s_inodes_per_group * sizeof(inode_t) / S_BLOCK_SIZE;
+    uint32_t end = zero_next + ITABLE_ZERO_BLOCKS;
+    if (end > itable_len) end = itable_len;
+
+    // runs of blocks nobody's using go out in one write. 
+    uint32_t run_start = zero_next;
+    for (uint32_t i = zero_next; i <= end; i++) {
+        uint8_t skip = (i == end);
+        if (!skip) {
+            uint32_t blkn = bgdt[g].bg_inode_table + i;
+            skip = itable_block_used(g, i) || find_jbuf(blkn) != NULL;
+            if (skip) zero_free_inodes(g, i);
+        }
+        if (skip) {
+            if (i > run_start) {
+                disk_write_blks(bgdt[g].bg_inode_table + run_start, zero_buf, i - run_start);
+            }
+            run_start = i + 1;
+        }
+    }
+    zero_next = end;
+
+    if (zero_next == itable_len) {
+        bgdt[g].bg_flags |= EXT4_BG_INODE_ZEROED;
+        bgdt_dirty = 1;
+        commit_if_due();
+    }
+    return 1;
+}
+
+// first 0 bit in [i, end), or end if there isn't one. 
+// checks 32 bits at a time; ctz compiles down to bsf.
+uint32_t next_zero_bit(uint32_t *words, uint32_t i, uint32_t end) {
+    while (i < end) {
+        uint32_t free_bits = ~words[i / 32] >> (i % 32);
+        if (free_bits) {
+            i += __builtin_ctz(free_bits);
+            return (i < end) ? i : end;
+        }
+        i = (i / 32 + 1) * 32;
+    }
+    return end;
+}
+
+// first 1 bit in [i, end), or end if there isn't one.
+uint32_t next_set_bit(uint32_t *words, uint32_t i, uint32_t end) {
+    while (i < end) {
+        uint32_t used_bits = words[i / 32] >> (i % 32);
+        if (used_bits) {
+            i += __builtin_ctz(used_bits);
+            return (i < end) ? i : end;
+        }
+        i = (i / 32 + 1) * 32;
+    }
+    return end;
+}
 
-    uint8_t super_blockn = 1; 
-    disk_write_blk(super_blockn, (uint8_t *) &super);
-    // write backup
-    disk_write_blk(super_blockn + super.s_blocks_per_group, (uint8_t *) &super);
+// first free bit at or after start, using (and updating) the hint.
+// returns end if the bitmap is full.
+uint32_t first_free_bm(bitmap_cache *bm, uint32_t start, uint32_t end) {
+    if (start <= bm->first_free) {
+        bm->first_free = next_zero_bit(bm->words, bm->first_free, end);
+        return bm->first_free;
+    }
+    return next_zero_bit(bm->words, start, end);
 }
 
 // TODO: should be given a superblock or some argument
 int first_free_block_num(uint32_t *res) {
     for (int i = 0; i < n_block_groups; i++) {
-        bgdesc_t d = bgdt[i];
-        uint16_t n_free_blocks = d.bg_free_blocks_count;
-        if (n_free_blocks == 0) continue;
+        if (bgdt[i].bg_free_blocks_count == 0) continue;
+
+        uint32_t end = super.s_blocks_per_group;
+        uint32_t bit = first_free_bm(block_bitmap(i), 0, end);
+        if (bit == end) continue;
 
-        *res = first_free_block(&d);
+        *res = i * super.s_blocks_per_group + bit;
         return 0;
     }
 
@@ -146,13 +887,21 @@ int first_free_block_num(uint32_t *res) {
     return -1;
 }
 
-int first_free_inode_num(uint32_t *res) {
-    for (int i = 0; i < n_block_groups; i++) {
-        bgdesc_t d = bgdt[i];
-        uint16_t n_free_inodes = d.bg_free_inodes_count;
-        if (n_free_inodes == 0) continue;
-
-        *res = first_free_inode(&d);
+// the first free inode in group_n, or failing that, 
+// in the groups after it (wrapping around).
+int first_free_inode_num(uint32_t group_n, uint32_t *res) {
+    for (uint32_t k = 0; k < n_block_groups; k++) {
+        uint32_t i = (group_n + k) % n_block_groups;
+        if (bgdt[i].bg_free_inodes_count == 0) continue;
+
+        // the first inodes in group 0 are reserved.
+        uint32_t start = (i == 0) ? super.s_first_ino - 1 : 0;
+        uint32_t end = super.s_inodes_per_group;
+        uint32_t bit = first_free_bm(inode_bitmap(i), start, end);
+        if (bit == end) continue;
+
+        // inode numbers start from 1
+        *res = i * super.s_inodes_per_group + bit + 1;
         return 0;
     }
 
@@ -170,7 +919,17 @@ void unset_bit(uint8_t *bitmap, uint16_t i) {
     uint16_t byte = i / 8;
     uint8_t bit = i % 8;
 
-    bitmap[byte] ^= (1 << bit);
+    bitmap[byte] &= ~(1 << bit);
+}
+
+void mark_bit(bitmap_cache *bm, uint16_t i, uint8_t val) {
+    if (val == 1) {
+        set_bit((uint8_t *) bm->words, i);
+    } else {
+        unset_bit((uint8_t *) bm->words, i);
+        if (i < bm->first_free) bm->first_free = i;
+    }
+    bm->dirty = 1;
 }
 
 void mark_block(uint32_t block_num, uint8_t val) {
@@ -178,21 +937,10 @@ void mark_block(uint32_t block_num, uint8_t val) {
     // from the block
     uint16_t block_grp_n = block_num / super.s_blocks_per_group;
 
-    // using appropriate block descriptor, access the block bitmap
-    bgdesc_t d = bgdt[block_grp_n];
-    uint8_t bitmap[S_BLOCK_SIZE];
-    disk_read_blk(d.bg_block_bitmap, bitmap);
-
-    uint16_t bit_to_set = block_num % super.s_inodes_per_group;
-
-    if (val == 1) {
-        set_bit(bitmap, bit_to_set);
-    } else {
-        unset_bit(bitmap, bit_to_set);
-    }
+    uint16_t bit_to_set = block_num % super.s_blocks_per_group;
 
-    // write back out to disk
-    disk_write_blk(d.bg_block_bitmap, bitmap);
+    // only the cached copy changes; flush_bitmaps() writes it out.
+    mark_bit(block_bitmap(block_grp_n), bit_to_set, val);
 }
 
 void set_block_bitmap(uint32_t block_num) {
@@ -208,21 +956,9 @@ void mark_inode(uint32_t inode_num, uint8_t val) {
     // from the inode number
     uint16_t block_grp_n = (inode_num - 1) / super.s_inodes_per_group;
 
-    // using appropriate block descriptor, access the inode bitmap
-    bgdesc_t d = bgdt[block_grp_n];
-    uint8_t bitmap[S_BLOCK_SIZE];
-    disk_read_blk(d.bg_inode_bitmap, bitmap);
-
     uint16_t bit_to_set = (inode_num - 1) % super.s_inodes_per_group;
 
-    if (val == 1) {
-        set_bit(bitmap, bit_to_set);
-    } else {
-        unset_bit(bitmap, bit_to_set);
-    }
-
-    // write back out to disk
-    disk_write_blk(d.bg_inode_bitmap, bitmap);
+    mark_bit(inode_bitmap(block_grp_n), bit_to_set, val);
 }
 
 void set_inode_bitmap(uint32_t inode_num) {
@@ -233,6 +969,10 @@ void unset_inode_bitmap(uint32_t inode_num) {
     mark_inode(inode_num, 0);
 }
 
+void update_open_files(mochi_file *file);
+
+// also brings every open copy of the inode up to date, so no 
+// fd goes on with a stale size, block map or inline data.
 void write_inode_table(uint32_t inode_n, inode_t new_inode) {
     // inode numbers start from 1
     uint32_t index = inode_n - 1;
@@ -248,31 +988,32 @@ void write_inode_table(uint32_t inode_n, inode_t new_inode) {
     uint32_t block_to_update = d.bg_inode_table + block_offset;
 
     uint8_t buf[S_BLOCK_SIZE];
-    disk_read_blk(block_to_update, buf);
+    meta_read_blk(block_to_update, buf);
 
     inode_t *to_update = (inode_t *) (buf + in_block_offset);
     *to_update = new_inode;
 
     // write the updated block back!
-    disk_write_blk(block_to_update, buf);
+    meta_write_blk(block_to_update, buf);
+
+    mochi_file file = { .inode = new_inode, .inode_n = inode_n };
+    update_open_files(&file);
 }
 
-void update_inode_bg_desc(uint32_t free_inode_n) {
-    uint16_t inode_bg_n = (free_inode_n - 1) / super.s_blocks_per_group;
-    bgdesc_t inode_bg_desc = bgdt[inode_bg_n];
-    inode_bg_desc.bg_free_inodes_count -= 1;
-    inode_bg_desc.bg_used_dirs_count += 1;
+void update_inode_bg_desc(uint32_t free_inode_n, uint8_t dir) {
+    uint16_t inode_bg_n = (free_inode_n - 1) / super.s_inodes_per_group;
+    bgdt[inode_bg_n].bg_free_inodes_count -= 1;
+    if (dir) bgdt[inode_bg_n].bg_used_dirs_count += 1;
 }
 
 void update_block_bg_desc(uint32_t free_block_n) {
     uint16_t block_bg_n = free_block_n / super.s_blocks_per_group;
-    bgdesc_t block_bg_desc = bgdt[block_bg_n];
-    block_bg_desc.bg_free_blocks_count -= 1;
+    bgdt[block_bg_n].bg_free_blocks_count -= 1;
 }
 
 // we shouldn't automatically attach a free block to the directory. 
 inode_t new_dir_inode() {
-    inode_t new_inode;
+    inode_t new_inode = { 0 };
     new_inode.i_mode = EXT2_S_IFDIR;
     new_inode.i_links_count = 1;
     new_inode.i_blocks = 0; 
@@ -280,6 +1021,13 @@ inode_t new_dir_inode() {
     new_inode.i_file_acl = 0;
     new_inode.i_dir_acl = 0;
     new_inode.i_faddr = 0;
+
+    // its entries start out in i_block (see uninline), 
+    // as one empty entry covering all of it.
+    if (super.s_feature_incompat & MOCHI_FEATURE_INCOMPAT_INLINE_DATA) {
+        new_inode.i_flags |= MOCHI_INLINE_DATA_FL;
+        ((dentry_t *) new_inode.i_block)->rec_len = MOCHI_INLINE_DATA_MAX;
+    }
     return new_inode;
 }
 
@@ -298,14 +1046,15 @@ uint32_t fs_start_to_lba_superblk(uint32_t mb_start) {
 
 
 void set_superblock() {
-    // set superblock 
-    superblock_t b;
-    if (disk_read_blk(1, (uint8_t *) &b)) {
+    // set superblock. we don't know the block size 
+    // until we have it, so read it by sector.
+    if (!fs_start_set) {
         print("Failed to read superblock.\n");
         sys_exit();
     }
 
-    super = b;
+    disk_read_sectors(filesys_start + SUPERBLOCK_OFFSET, (uint8_t *) &super, 
+            sizeof(superblock_t) / DISK_SECTOR_SIZE);
 }
 
 void set_bgdt() {
@@ -316,26 +1065,35 @@ void set_bgdt() {
     if (bc % bpg != 0) n_block_groups++;
 
 
-    uint32_t bgdt_start_blkno = 2;
     uint8_t buf[S_BLOCK_SIZE];
+    uint32_t per_block = S_BLOCK_SIZE / sizeof(bgdesc_t);
 
-    // the BGDT fits in 1 disk block 
-    // if we have < (1024 / 32) block groups
-    // (which we do)
-    disk_read_blk(bgdt_start_blkno, buf);
+    for (uint32_t i = 0; i < ext2_bgdt_blocks(&super); i++) {
+        uint32_t first = i * per_block;
+        uint32_t n = n_block_groups - first;
+        if (n > per_block) n = per_block;
 
-    // copy into bgdt
-    uint8_t *bgdt_buf = (uint8_t *) bgdt;
-    for (int i = 0; i < n_block_groups * sizeof(bgdesc_t); i++) {
-        bgdt_buf[i] = buf[i];
+        disk_read_blk(bgdt_start_blk() + i, buf);
+        memmove(&bgdt[first], buf, n * sizeof(bgdesc_t));
     }
+    memmove(bgdt_on_disk, bgdt, n_block_groups * sizeof(bgdesc_t));
 }
 
+void journal_load();
+
 void read_fs(uint32_t fs_start_in_mb) {
     // file-global
     filesys_start = mb_to_lba(fs_start_in_mb);
     fs_start_set = 1;
 
+    // cached bitmaps belong to whatever filesystem was there before.
+    drop_bitmaps();
+    drop_bmap_caches();
+    drop_page_cache();
+    drop_delayed();
+    drop_journal();
+    drop_lazy_init();
+
     // once filesys is set, we can use disk_read_blk.
     set_superblock();
 
@@ -343,6 +1101,7 @@ void read_fs(uint32_t fs_start_in_mb) {
     // next, we want to set the bgdt entries.
     set_bgdt();
 
+    journal_load();
 }
 
 inode_t get_inode(uint32_t inode_n) {
@@ -357,211 +1116,2231 @@ inode_t get_inode(uint32_t inode_n) {
     // each 1024-byte block evenly fits 8 inodes (128 bytes each)
     uint16_t inodes_per_blk = S_BLOCK_SIZE / sizeof(inode_t);
 
-    uint16_t inode_blk_n = inode_table_blkn + inode_offset / inodes_per_blk;
+    uint32_t inode_blk_n = inode_table_blkn + inode_offset / inodes_per_blk;
     uint16_t inode_blk_offset = inode_offset % inodes_per_blk;
 
     inode_t blk_nodes[S_BLOCK_SIZE / sizeof(inode_t)];
 
-    disk_read_blk(inode_blk_n, (uint8_t *) blk_nodes);
+    meta_read_blk(inode_blk_n, (uint8_t *) blk_nodes);
 
     return blk_nodes[inode_blk_offset];
 }
 
-// get the block number of the ith data block for a file. 
-// hides all the "indirect block" stuff
-// at the cost of a bit of efficiency.
-//
-uint32_t get_data_block_n(inode_t file, uint32_t i) {
-    uint32_t dir_blk_len = 12;
-    if (i < dir_blk_len) {
-        return file.i_block[i];
-    }
-
-    uint32_t ind_blk_len = S_BLOCK_SIZE / sizeof(uint32_t);
-
-    if (i < dir_blk_len + ind_blk_len) {
-        uint32_t blocks[ind_blk_len];
-        disk_read_blk(file.i_block[12], (uint8_t *) blocks);
-        uint16_t j = i - dir_blk_len;
-        return blocks[j];
-    }
+/* Block allocation.
+ * 
+ * blocks are handed out as close as possible to a "goal" block 
+ * (for file data, the block right after the file's last block), 
+ * and in contiguous runs where we can get them. */
 
-    uint32_t dbl_ind_blk_len = S_BLOCK_SIZE * ind_blk_len;
-    if (i < dir_blk_len + ind_blk_len + dbl_ind_blk_len) {
-        uint32_t blocks[ind_blk_len];
-        disk_read_blk(file.i_block[13], (uint8_t *) blocks);
+// block n of the disk is bit (n % blocks_per_group) 
+// in the bitmap of group (n / blocks_per_group).
+uint32_t block_group_of(uint32_t block_n) {
+    return block_n / super.s_blocks_per_group;
+}
 
-        uint32_t j = i - dir_blk_len - ind_blk_len;
+uint32_t group_first_block(uint32_t group_n) {
+    return group_n * super.s_blocks_per_group;
+}
 
-        uint32_t ind_blk_index = j / ind_blk_len;
-        uint32_t blk_index = j % ind_blk_len;
+// the last group can be shorter than the rest.
+uint32_t group_n_blocks(uint32_t group_n) {
+    uint32_t left = super.s_blocks_count - group_first_block(group_n);
+    if (left < super.s_blocks_per_group) return left;
+    return super.s_blocks_per_group;
+}
 
-        disk_read_blk(blocks[ind_blk_index], (uint8_t *) blocks);
+// length of the run of 0 bits starting at bit i (at most want long).
+uint32_t free_run_at(uint32_t *words, uint32_t i, uint32_t end, uint32_t want) {
+    if (end - i > want) end = i + want;
+    return next_set_bit(words, i, end) - i;
+}
 
-        return blocks[blk_index];
+// finds the longest run of 0 bits in [start, end), stopping 
+// early once a run of want bits is found. returns the run length.
+uint32_t longest_free_run(uint32_t *words, uint32_t start, uint32_t end, 
+        uint32_t want, uint32_t *run_start) {
+    uint32_t best = 0;
+    uint32_t i = next_zero_bit(words, start, end);
+    while (i < end) {
+        uint32_t len = free_run_at(words, i, end, want);
+        if (len > best) {
+            best = len;
+            *run_start = i;
+            if (best == want) break;
+        }
+        i = next_zero_bit(words, i + len, end);
     }
-
-    // TODO: triply-independent.
-    // i.e. file needs more than 65536 1kb blocks, 
-    // so the file is greater than 65 Mb in size. 
-    // our OS is not at that point yet. 
-    return 0;
+    return best;
 }
 
-/* Get the ith block for a file. */
-uint8_t *get_file_block(mochi_file file, uint32_t i) {
-    uint32_t block_n = get_data_block_n(file.inode, i);
-
-    uint8_t *buf = (uint8_t *) kcalloc(S_BLOCK_SIZE, sizeof(uint8_t));
+// blocks reserved for dirty pages that don't have them yet, and 
+// for the extent or indirect blocks mapping them will take, all 
+// files together. (see "Delayed allocation".)
+static uint32_t delayed_blocks = 0;
 
-    if (disk_read_blk(block_n, buf)) return NULL;
-
-    return buf;
+// free blocks that nobody has reserved.
+uint32_t unreserved_blocks() {
+    if (super.s_free_blocks_count < delayed_blocks) return 0;
+    return super.s_free_blocks_count - delayed_blocks;
 }
 
-
-/* Finds a free block and updates all relevant metadata. */
-/* Splitting into separate functions "reserve free block" 
- * and "reserve free inode" will often double the number of 
- * disk syncs of the superblock and the BGDT. 
- * To get around this, a future optimization could defer 
- * actually writing out to disk for a while. */
-int reserve_free_block(uint32_t *block_n) {
-    if (first_free_block_num(block_n)) {
+// allocates up to want contiguous blocks near goal, in one pass over 
+// one bitmap. *first is the first block, *got how many we got (>= 1).
+// blocks reserved for delayed allocation are off limits, so 
+// alloc_delayed() gives a file's reservation back before it calls this.
+int alloc_blocks(uint32_t goal, uint32_t want, uint32_t *first, uint32_t *got) {
+    uint32_t avail = unreserved_blocks();
+    if (want > avail) want = avail;
+    if (want == 0) {
         print("No free blocks available.\n");
         return -1;
     }
-    set_block_bitmap(*block_n);
 
-    update_block_bg_desc(*block_n);
-    disk_sync_bgdt();
+    if (goal >= super.s_blocks_count) goal = 0;
+    uint32_t goal_grp = block_group_of(goal);
 
-    super.s_free_blocks_count -= 1;
-    disk_sync_super();
+    // start at the goal's group, then try the rest in order.
+    for (uint32_t k = 0; k < n_block_groups; k++) {
+        uint32_t g = (goal_grp + k) % n_block_groups;
+        if (bgdt[g].bg_free_blocks_count == 0) continue;
 
-    return 0;
-}
+        bitmap_cache *bm = block_bitmap(g);
 
-int reserve_inode(uint32_t inode_n) {
-    set_inode_bitmap(inode_n);
+        uint32_t end = group_n_blocks(g);
+        uint32_t start = (g == goal_grp) ? goal - group_first_block(g) : 0;
 
-    update_inode_bg_desc(inode_n);
-    disk_sync_bgdt();
+        // nothing below the hint is free, so don't look there.
+        uint32_t lowest = first_free_bm(bm, 0, end);
+        if (start < lowest) start = lowest;
 
-    super.s_free_inodes_count -= 1;
-    disk_sync_super();
-}
+        // the goal itself is free: extend from it, even if the 
+        // run is short. that keeps a growing file in one piece.
+        uint32_t run_start = start;
+        uint32_t run = free_run_at(bm->words, start, end, want);
 
-int reserve_free_inode(uint32_t *inode_n) {
-    if (first_free_inode_num(inode_n)) {
-        print("No free inodes available.\n");
+        if (run == 0) {
+            run = longest_free_run(bm->words, start, end, want, &run_start);
+        }
+
+        if (run < want && start > lowest) {
+            // wrap around to the front of the group.
+            uint32_t wrap_start;
+            uint32_t wrap = longest_free_run(bm->words, lowest, start, want, &wrap_start);
+            if (wrap > run) {
+                run = wrap;
+                run_start = wrap_start;
+            }
+        }
+
+        // counts said there was space, but the bitmap disagrees.
+        if (run == 0) continue;
+
+        for (uint32_t i = 0; i < run; i++) {
+            set_bit((uint8_t *) bm->words, run_start + i);
+        }
+        bm->dirty = 1;
+
+        bgdt[g].bg_free_blocks_count -= run;
+        bgdt_dirty = 1;
+
+        super.s_free_blocks_count -= run;
+        super_dirty = 1;
+
+        *first = group_first_block(g) + run_start;
+        *got = run;
+        return 0;
+    }
+
+    print("No free blocks available.\n");
+    return -1;
+}
+
+// gives back n contiguous blocks (which must be in one group).
+void free_blocks(uint32_t first, uint32_t n) {
+    if (n == 0) return;
+
+    uint32_t g = block_group_of(first);
+    bitmap_cache *bm = block_bitmap(g);
+
+    uint32_t bit = first - group_first_block(g);
+    for (uint32_t i = 0; i < n; i++) {
+        mark_bit(bm, bit + i, 0);
+    }
+
+    bgdt[g].bg_free_blocks_count += n;
+    bgdt_dirty = 1;
+
+    super.s_free_blocks_count += n;
+    super_dirty = 1;
+}
+
+// a block for a file's mapping metadata (indirect blocks, extent 
+// tree nodes). these go near the inode, out of the way of the 
+// file's data, so they don't break up its runs.
+int alloc_meta_block(uint32_t inode_n, uint32_t *blockn) {
+    uint32_t g = (inode_n - 1) / super.s_inodes_per_group;
+    uint32_t got;
+    return alloc_blocks(group_first_block(g), 1, blockn, &got);
+}
+
+/* Finds a free block and updates all relevant metadata. */
+/* The superblock and BGDT are only marked dirty here; 
+ * fs_commit() writes them out in one go. */
+int reserve_free_block(uint32_t *block_n) {
+    uint32_t got;
+    return alloc_blocks(0, 1, block_n, &got);
+}
+
+/* Block map cache.
+ *
+ * finding a block past the direct blocks means reading 1 to 3 
+ * indirect blocks (or extent tree nodes). for the inodes we've 
+ * looked at recently, we keep the indirect blocks (or nodes) from 
+ * the last lookup, one per level, and the last extent (or hole) 
+ * found. reading a file front to back then costs one indirect read 
+ * per 256 blocks, not one or two per block, and a lookup in an 
+ * extent tree only reads the nodes that differ from last time. the cache is per inode and every 
+ * change to the map goes through it, so it never goes stale. */
+
+#define N_BMAP_CACHES   8
+#define IND_LEVELS      3
+
+typedef struct {
+    uint32_t inode_n;               // 0 if unused
+    uint32_t ind_blkn[IND_LEVELS];  // which block is in ind[level]
+    uint32_t *ind[IND_LEVELS];      // allocated on first use. (with 
+                                    // extents, the nodes below the root.)
+
+    // the last extent found (ext_len is 0 if none), 
+    // or hole (ext_start is 0).
+    uint32_t ext_block;
+    uint32_t ext_len;
+    uint32_t ext_start;
+    uint8_t ext_unwritten;
+} bmap_cache;
+
+static bmap_cache bmap_caches[N_BMAP_CACHES];
+static uint8_t next_bmap_victim = 0;
+
+// forget the blocks in ind[], but keep the buffers.
+void drop_cached_inds(bmap_cache *c) {
+    for (int level = 0; level < IND_LEVELS; level++) {
+        c->ind_blkn[level] = 0;
+    }
+}
+
+void reset_bmap_cache(bmap_cache *c, uint32_t inode_n) {
+    c->inode_n = inode_n;
+    drop_cached_inds(c);
+    c->ext_len = 0;
+}
+
+bmap_cache *get_bmap_cache(uint32_t inode_n) {
+    for (int i = 0; i < N_BMAP_CACHES; i++) {
+        if (bmap_caches[i].inode_n == inode_n) return &bmap_caches[i];
+    }
+
+    bmap_cache *c = &bmap_caches[next_bmap_victim];
+    next_bmap_victim = (next_bmap_victim + 1) % N_BMAP_CACHES;
+    reset_bmap_cache(c, inode_n);
+    return c;
+}
+
+// (the buffers go too: the next filesystem's blocks may be bigger.)
+void drop_bmap_caches() {
+    for (int i = 0; i < N_BMAP_CACHES; i++) {
+        reset_bmap_cache(&bmap_caches[i], 0);
+        for (int level = 0; level < IND_LEVELS; level++) {
+            if (bmap_caches[i].ind[level] != NULL) kfree(bmap_caches[i].ind[level]);
+            bmap_caches[i].ind[level] = NULL;
+        }
+    }
+}
+
+// the indirect block blkn, which sits at this level of the tree. 
+// with no cache, it's read into scratch.
+uint32_t *read_ind(bmap_cache *c, int level, uint32_t blkn, uint32_t *scratch) {
+    if (c == NULL) {
+        meta_read_blk(blkn, (uint8_t *) scratch);
+        return scratch;
+    }
+
+    if (c->ind[level] == NULL) {
+        c->ind[level] = (uint32_t *) kmalloc(S_BLOCK_SIZE);
+    }
+
+    if (c->ind_blkn[level] != blkn) {
+        meta_read_blk(blkn, (uint8_t *) c->ind[level]);
+        c->ind_blkn[level] = blkn;
+    }
+    return c->ind[level];
+}
+
+// a freshly allocated indirect block: all zeroes, on disk and in the cache.
+uint32_t *new_ind(bmap_cache *c, int level, uint32_t blkn, uint32_t *scratch) {
+    uint32_t *ind = scratch;
+    if (c != NULL) {
+        if (c->ind[level] == NULL) {
+            c->ind[level] = (uint32_t *) kmalloc(S_BLOCK_SIZE);
+        }
+        ind = c->ind[level];
+        c->ind_blkn[level] = blkn;
+    }
+
+    memset(ind, 0, S_BLOCK_SIZE);
+    meta_write_blk(blkn, (uint8_t *) ind);
+    return ind;
+}
+
+/* Extents.
+ *
+ * an inode with EXT4_EXTENTS_FL maps its blocks with an extent tree 
+ * instead of direct/indirect blocks, so a contiguous file needs one 
+ * entry per 32768 blocks instead of one per block. 
+ * blocks are mostly added at the end of a file, and then a full 
+ * node just gets a new sibling. filling in a hole (see "Holes") 
+ * can land in the middle of a node, which then splits in half. 
+ *
+ * like ext4, an ee_len over EXT_MAX_LEN marks an unwritten extent 
+ * (ee_len - EXT_MAX_LEN blocks long): its blocks belong to the file 
+ * but read as zeroes until written. fallocate() makes these. */
+
+#define EXT_MAX_LEN     32768
+
+uint8_t ext_unwritten(ext4_extent *e) {
+    return e->ee_len > EXT_MAX_LEN;
+}
+
+uint32_t ext_len(ext4_extent *e) {
+    if (ext_unwritten(e)) return e->ee_len - EXT_MAX_LEN;
+    return e->ee_len;
+}
+
+void ext_set_len(ext4_extent *e, uint32_t len, uint8_t unwritten) {
+    e->ee_len = unwritten ? len + EXT_MAX_LEN : len;
+}
+
+// (an unwritten one can't be EXT_MAX_LEN long.)
+uint32_t ext_max_len(uint8_t unwritten) {
+    return unwritten ? EXT_MAX_LEN - 1 : EXT_MAX_LEN;
+}
+
+ext4_extent_header *ext_root(inode_t *inode) {
+    return (ext4_extent_header *) inode->i_block;
+}
+
+// the entries sit right after the header.
+ext4_extent *ext_leaves(ext4_extent_header *h) {
+    return (ext4_extent *) (h + 1);
+}
+
+ext4_extent_idx *ext_indexes(ext4_extent_header *h) {
+    return (ext4_extent_idx *) (h + 1);
+}
+
+void ext_init_node(ext4_extent_header *h, uint16_t depth, uint32_t node_size) {
+    h->eh_magic = EXT4_EXT_MAGIC;
+    h->eh_entries = 0;
+    h->eh_max = (node_size - sizeof(ext4_extent_header)) / sizeof(ext4_extent);
+    h->eh_depth = depth;
+    h->eh_generation = 0;
+}
+
+// binary search for the last entry starting at or before logical block i.
+// returns -1 if i comes before every entry. 
+// (leaves and indexes are both 12 bytes and both start with 
+// their first logical block, so one search works for either.)
+int ext_search(ext4_extent_header *h, uint32_t i) {
+    int lo = 0;
+    int hi = h->eh_entries - 1;
+    int found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (ext_leaves(h)[mid].ee_block <= i) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+// physical block for logical block i, or 0 if it isn't mapped.
+// logical blocks [i, end) are a hole. the cache keeps that too 
+// (as an extent starting at block 0), so reading through a sparse 
+// file doesn't walk the tree for every block of every hole. 
+// returns 0, the block number a hole maps to.
+uint32_t ext_hole(bmap_cache *c, uint32_t i, uint32_t end) {
+    if (c != NULL && end > i) {
+        c->ext_block = i;
+        c->ext_len = end - i;
+        c->ext_start = 0;
+        c->ext_unwritten = 0;
+    }
+    return 0;
+}
+
+uint32_t ext_lookup(inode_t *inode, bmap_cache *c, uint32_t i) {
+    if (c != NULL && i - c->ext_block < c->ext_len) {
+        if (c->ext_start == 0) return 0; // a hole
+        return c->ext_start + (i - c->ext_block);
+    }
+
+    uint32_t buf[S_BLOCK_SIZE / 4];
+    ext4_extent_header *h = ext_root(inode);
+
+    // where the next thing mapped could start, as far as we know.
+    uint32_t next = 0xffffffff;
+
+    // the nodes are cached like indirect blocks, one per level.
+    int level = 0;
+    while (h->eh_depth > 0) {
+        int k = ext_search(h, i);
+        if (k < 0) return ext_hole(c, i, ext_indexes(h)[0].ei_block);
+        if (k + 1 < h->eh_entries) next = ext_indexes(h)[k + 1].ei_block;
+
+        uint32_t blkn = ext_indexes(h)[k].ei_leaf_lo;
+        h = (ext4_extent_header *) read_ind(level < IND_LEVELS ? c : NULL, level, blkn, buf);
+        level++;
+    }
+
+    int k = ext_search(h, i);
+    if (k + 1 < h->eh_entries) next = ext_leaves(h)[k + 1].ee_block;
+    if (k < 0) return ext_hole(c, i, next);
+
+    ext4_extent *e = &ext_leaves(h)[k];
+    if (i >= e->ee_block + ext_len(e)) return ext_hole(c, i, next);
+
+    if (c != NULL) {
+        c->ext_block = e->ee_block;
+        c->ext_len = ext_len(e);
+        c->ext_start = e->ee_start_lo;
+        c->ext_unwritten = ext_unwritten(e);
+    }
+
+    return e->ee_start_lo + (i - e->ee_block);
+}
+
+// the root is written along with the inode, by the caller.
+void ext_write_node(ext4_extent_header *h, uint32_t node_blkn) {
+    if (node_blkn != 0) meta_write_blk(node_blkn, (uint8_t *) h);
+}
+
+// make room for an entry at k in h, moving the ones from k on up. 
+// (leaves and indexes are the same size.)
+void ext_open_slot(ext4_extent_header *h, int k) {
+    ext4_extent *e = ext_leaves(h);
+    memmove(&e[k + 1], &e[k], (h->eh_entries - k) * sizeof(ext4_extent));
+    h->eh_entries++;
+}
+
+// add extent x, whose blocks aren't mapped yet, to the subtree 
+// at h, which is stored at node_blkn (0 for the root). 
+// returns 0 when done. if h is full, it splits: a new node of the 
+// same depth, *sibling, takes the entries after the new one (or, when 
+// it's in the middle, the upper half), and it returns 1. the caller 
+// has to index the new node, which starts at logical block *sibling_first.
+int ext_insert(uint32_t inode_n, ext4_extent_header *h, uint32_t node_blkn, 
+        ext4_extent *x, uint32_t *sibling, uint32_t *sibling_first) {
+    uint8_t buf[S_BLOCK_SIZE];
+    int k = ext_search(h, x->ee_block);
+
+    // what goes in at k + 1, if it doesn't fit in an existing entry.
+    ext4_extent new_e = { 0 };
+
+    if (h->eh_depth > 0) {
+        // before everything: the first child takes it, and starts earlier.
+        uint8_t moved = (k < 0);
+        if (moved) {
+            k = 0;
+            ext_indexes(h)[0].ei_block = x->ee_block;
+        }
+
+        uint32_t child_blkn = ext_indexes(h)[k].ei_leaf_lo;
+        meta_read_blk(child_blkn, buf);
+
+        uint32_t child_sibling, child_first;
+        int ret = ext_insert(inode_n, (ext4_extent_header *) buf, child_blkn, 
+                x, &child_sibling, &child_first);
+        if (ret <= 0) {
+            if (moved) ext_write_node(h, node_blkn);
+            return ret;
+        }
+
+        // the child split. index the new node.
+        ext4_extent_idx *ix = (ext4_extent_idx *) &new_e;
+        ix->ei_block = child_first;
+        ix->ei_leaf_lo = child_sibling;
+    } else {
+        ext4_extent *e = ext_leaves(h);
+        uint8_t unwritten = ext_unwritten(x);
+        uint32_t len = ext_len(x);
+
+        // extend the extent before it or after it, if x continues 
+        // it. (one before everything else can only be in the 
+        // leftmost leaf, whose index was moved back already.)
+        if (k >= 0 && ext_unwritten(&e[k]) == unwritten && 
+                e[k].ee_block + ext_len(&e[k]) == x->ee_block && 
+                e[k].ee_start_lo + ext_len(&e[k]) == x->ee_start_lo && 
+                ext_len(&e[k]) + len <= ext_max_len(unwritten)) {
+            ext_set_len(&e[k], ext_len(&e[k]) + len, unwritten);
+            ext_write_node(h, node_blkn);
+            return 0;
+        }
+        if (k + 1 < h->eh_entries && ext_unwritten(&e[k + 1]) == unwritten && 
+                e[k + 1].ee_block == x->ee_block + len && 
+                e[k + 1].ee_start_lo == x->ee_start_lo + len && 
+                ext_len(&e[k + 1]) + len <= ext_max_len(unwritten)) {
+            e[k + 1].ee_block = x->ee_block;
+            e[k + 1].ee_start_lo = x->ee_start_lo;
+            ext_set_len(&e[k + 1], ext_len(&e[k + 1]) + len, unwritten);
+            ext_write_node(h, node_blkn);
+            return 0;
+        }
+
+        new_e = *x;
+    }
+
+    uint32_t pos = k + 1;
+    if (h->eh_entries < h->eh_max) {
+        ext_open_slot(h, pos);
+        ext_leaves(h)[pos] = new_e;
+        ext_write_node(h, node_blkn);
+        return 0;
+    }
+
+    // h is full. appending (the usual case) starts a new node with 
+    // just the new entry; anything else splits h in half.
+    if (alloc_meta_block(inode_n, sibling)) return -1;
+
+    memset(buf, 0, S_BLOCK_SIZE);
+    ext4_extent_header *n = (ext4_extent_header *) buf;
+    ext_init_node(n, h->eh_depth, S_BLOCK_SIZE);
+
+    uint32_t split = (pos == h->eh_entries) ? pos : h->eh_entries / 2;
+    n->eh_entries = h->eh_entries - split;
+    memmove(ext_leaves(n), &ext_leaves(h)[split], n->eh_entries * sizeof(ext4_extent));
+    h->eh_entries = split;
+
+    if (pos >= split) {
+        ext_open_slot(n, pos - split);
+        ext_leaves(n)[pos - split] = new_e;
+    } else {
+        ext_open_slot(h, pos);
+        ext_leaves(h)[pos] = new_e;
+    }
+    *sibling_first = ext_leaves(n)[0].ee_block;
+
+    meta_write_blk(*sibling, buf);
+    ext_write_node(h, node_blkn);
+    return 1;
+}
+
+// add extent x, whose blocks aren't mapped yet, to inode's tree.
+int ext_add(inode_t *inode, uint32_t inode_n, ext4_extent *x) {
+    ext4_extent_header *root = ext_root(inode);
+
+    // x goes in a hole, which the cache may be keeping. 
+    // and any of the nodes it keeps may change.
+    bmap_cache *c = get_bmap_cache(inode_n);
+    if (c->ext_start == 0) c->ext_len = 0;
+    drop_cached_inds(c);
+
+    uint32_t sibling, sibling_first;
+    int ret = ext_insert(inode_n, root, 0, x, &sibling, &sibling_first);
+    if (ret <= 0) return ret;
+
+    // the root itself split. move what's left in it down into a new 
+    // block, and make the root an index over that block and the sibling.
+    uint32_t child;
+    if (alloc_meta_block(inode_n, &child)) return -1;
+
+    uint8_t buf[S_BLOCK_SIZE];
+    memset(buf, 0, S_BLOCK_SIZE);
+    ext4_extent_header *h = (ext4_extent_header *) buf;
+    ext_init_node(h, root->eh_depth, S_BLOCK_SIZE);
+    h->eh_entries = root->eh_entries;
+    memmove(h + 1, root + 1, root->eh_entries * sizeof(ext4_extent));
+    meta_write_blk(child, buf);
+
+    uint32_t first = ext_leaves(root)[0].ee_block;
+
+    root->eh_depth++;
+    root->eh_entries = 2;
+
+    ext4_extent_idx *ix = ext_indexes(root);
+    ix[0].ei_block = first;
+    ix[0].ei_leaf_lo = child;
+    ix[0].ei_leaf_hi = 0;
+    ix[0].ei_unused = 0;
+
+    ix[1].ei_block = sibling_first;
+    ix[1].ei_leaf_lo = sibling;
+    ix[1].ei_leaf_hi = 0;
+    ix[1].ei_unused = 0;
+
+    return 0;
+}
+
+// map logical block i (which isn't mapped yet) to blockn.
+int ext_set(inode_t *inode, uint32_t inode_n, uint32_t i, uint32_t blockn) {
+    ext4_extent x = { .ee_block = i, .ee_len = 1, .ee_start_lo = blockn };
+    return ext_add(inode, inode_n, &x);
+}
+
+// fold h's entry k + 1 into entry k, if both are written 
+// and the second carries on from the first.
+void ext_merge_next(ext4_extent_header *h, int k) {
+    if (k < 0 || k + 1 >= h->eh_entries) return;
+
+    ext4_extent *e = ext_leaves(h);
+    if (ext_unwritten(&e[k]) || ext_unwritten(&e[k + 1])) return;
+    if (e[k].ee_block + e[k].ee_len != e[k + 1].ee_block) return;
+    if (e[k].ee_start_lo + e[k].ee_len != e[k + 1].ee_start_lo) return;
+    if (e[k].ee_len + e[k + 1].ee_len > EXT_MAX_LEN) return;
+
+    e[k].ee_len += e[k + 1].ee_len;
+    memmove(&e[k + 1], &e[k + 2], (h->eh_entries - k - 2) * sizeof(ext4_extent));
+    h->eh_entries--;
+}
+
+// the leaf logical block i would be in: the root, or 
+// a node read into buf from *node_blkn.
+ext4_extent_header *ext_find_leaf(inode_t *inode, uint32_t i, 
+        uint8_t *buf, uint32_t *node_blkn) {
+    ext4_extent_header *h = ext_root(inode);
+    *node_blkn = 0;
+
+    while (h->eh_depth > 0) {
+        int k = ext_search(h, i);
+        if (k < 0) k = 0;
+
+        *node_blkn = ext_indexes(h)[k].ei_leaf_lo;
+        meta_read_blk(*node_blkn, buf);
+        h = (ext4_extent_header *) buf;
+    }
+    return h;
+}
+
+// logical blocks [i, i + n) of inode now hold data: the unwritten 
+// extents among them become ordinary ones. an extent only partly 
+// written splits, with the rest staying unwritten on either side.
+int ext_mark_written(inode_t *inode, uint32_t inode_n, uint32_t i, uint32_t n) {
+    uint8_t buf[S_BLOCK_SIZE];
+    uint32_t end = i + n;
+    int ret = 0;
+
+    while (i < end && ret == 0) {
+        uint32_t node_blkn;
+        ext4_extent_header *h = ext_find_leaf(inode, i, buf, &node_blkn);
+        int k = ext_search(h, i);
+
+        ext4_extent *e = (k >= 0) ? &ext_leaves(h)[k] : NULL;
+        if (e == NULL || i >= e->ee_block + ext_len(e)) {
+            // a hole.
+            i++;
+            continue;
+        }
+
+        uint32_t e_end = e->ee_block + ext_len(e);
+        if (!ext_unwritten(e)) {
+            i = e_end;
+            continue;
+        }
+        uint32_t stop = (e_end < end) ? e_end : end;
+
+        ext4_extent mid = { .ee_block = i, 
+            .ee_start_lo = e->ee_start_lo + (i - e->ee_block) };
+        ext_set_len(&mid, stop - i, 0);
+
+        ext4_extent right = { .ee_block = stop, 
+            .ee_start_lo = e->ee_start_lo + (stop - e->ee_block) };
+        ext_set_len(&right, e_end - stop, 1);
+
+        if (e->ee_block == i && stop == e_end) {
+            // all of it, which may now join its neighbours.
+            ext_set_len(e, stop - i, 0);
+            ext_merge_next(h, k);
+            ext_merge_next(h, k - 1);
+            ext_write_node(h, node_blkn);
+        } else if (e->ee_block == i) {
+            // the front: e keeps the rest, and mid can 
+            // join the extent before it.
+            *e = right;
+            ext_write_node(h, node_blkn);
+            ret = ext_add(inode, inode_n, &mid);
+        } else {
+            ext_set_len(e, i - e->ee_block, 1);
+            ext_write_node(h, node_blkn);
+            ret = ext_add(inode, inode_n, &mid);
+            if (ret == 0 && stop < e_end) ret = ext_add(inode, inode_n, &right);
+        }
+        i = stop;
+    }
+
+    // the cached extent may have changed under it.
+    reset_bmap_cache(get_bmap_cache(inode_n), inode_n);
+    return ret;
+}
+
+// regular files get an extent tree if the filesystem supports it.
+// the (empty) block map a file starts with, if it isn't inline.
+void init_block_map(inode_t *inode) {
+    if (super.s_feature_incompat & EXT4_FEATURE_INCOMPAT_EXTENTS) {
+        inode->i_flags |= EXT4_EXTENTS_FL;
+        ext_init_node(ext_root(inode), 0, sizeof(inode->i_block));
+    }
+}
+
+inode_t new_file_inode() {
+    inode_t new_inode = { 0 };
+    new_inode.i_mode = EXT2_S_IFREG;
+    new_inode.i_links_count = 1;
+
+    if (super.s_feature_incompat & MOCHI_FEATURE_INCOMPAT_INLINE_DATA) {
+        new_inode.i_flags |= MOCHI_INLINE_DATA_FL;
+    } else {
+        init_block_map(&new_inode);
+    }
+    return new_inode;
+}
+
+/* Indirect blocks.
+ *
+ * i_block[0-11] point at data blocks. i_block[12] points at a block 
+ * of pointers to data blocks, i_block[13] at a block of pointers to 
+ * those, and i_block[14] adds a third level. with 1kb blocks that 
+ * covers about 16 million blocks (16 Gb). */
+
+// splits logical block i into the index at each level of the tree: 
+// off[0] indexes i_block, off[1..] the indirect blocks below it. 
+// returns how many indirect blocks are on the way (0-3), 
+// or -1 if i is past what triple-indirect blocks can map.
+int ind_path(uint32_t i, uint32_t *off) {
+    uint32_t per_blk = S_BLOCK_SIZE / sizeof(uint32_t);
+
+    uint32_t dir_blk_len = 12;
+    if (i < dir_blk_len) {
+        off[0] = i;
+        return 0;
+    }
+    i -= dir_blk_len;
+
+    if (i < per_blk) {
+        off[0] = 12;
+        off[1] = i;
+        return 1;
+    }
+    i -= per_blk;
+
+    if (i < per_blk * per_blk) {
+        off[0] = 13;
+        off[1] = i / per_blk;
+        off[2] = i % per_blk;
+        return 2;
+    }
+    i -= per_blk * per_blk;
+
+    if (i < per_blk * per_blk * per_blk) {
+        off[0] = 14;
+        off[1] = i / (per_blk * per_blk);
+        off[2] = (i / per_blk) % per_blk;
+        off[3] = i % per_blk;
+        return 3;
+    }
+
+    return -1;
+}
+
+uint32_t ind_lookup(inode_t *inode, bmap_cache *c, uint32_t i) {
+    uint32_t off[IND_LEVELS + 1];
+    int depth = ind_path(i, off);
+    if (depth < 0) return 0;
+
+    uint32_t scratch[S_BLOCK_SIZE / sizeof(uint32_t)];
+    uint32_t blkn = inode->i_block[off[0]];
+
+    for (int level = 0; level < depth; level++) {
+        if (blkn == 0) return 0; // nothing mapped down here.
+        uint32_t *ind = read_ind(c, level, blkn, scratch);
+        blkn = ind[off[level + 1]];
+    }
+    return blkn;
+}
+
+// point logical block i at blockn, allocating any indirect blocks 
+// that aren't there yet. i_block is only changed in memory.
+int ind_set(inode_t *inode, uint32_t inode_n, uint32_t i, uint32_t blockn) {
+    uint32_t off[IND_LEVELS + 1];
+    int depth = ind_path(i, off);
+    if (depth < 0) return -1;
+
+    if (depth == 0) {
+        inode->i_block[off[0]] = blockn;
+        return 0;
+    }
+
+    bmap_cache *c = get_bmap_cache(inode_n);
+    uint32_t scratch[S_BLOCK_SIZE / sizeof(uint32_t)];
+    uint32_t *ind;
+
+    uint32_t blkn = inode->i_block[off[0]];
+    if (blkn == 0) {
+        if (alloc_meta_block(inode_n, &blkn)) return -1;
+        inode->i_block[off[0]] = blkn;
+        ind = new_ind(c, 0, blkn, scratch);
+    } else {
+        ind = read_ind(c, 0, blkn, scratch);
+    }
+
+    for (int level = 1; level < depth; level++) {
+        uint32_t next = ind[off[level]];
+        if (next == 0) {
+            if (alloc_meta_block(inode_n, &next)) return -1;
+            ind[off[level]] = next;
+            meta_write_blk(blkn, (uint8_t *) ind);
+            ind = new_ind(c, level, next, scratch);
+        } else {
+            ind = read_ind(c, level, next, scratch);
+        }
+        blkn = next;
+    }
+
+    ind[off[depth]] = blockn;
+    meta_write_blk(blkn, (uint8_t *) ind);
+    return 0;
+}
+
+uint32_t lookup_block(inode_t *inode, bmap_cache *c, uint32_t i) {
+    // i_block holds data, not a map.
+    if (inode->i_flags & MOCHI_INLINE_DATA_FL) return 0;
+
+    if (inode->i_flags & EXT4_EXTENTS_FL) {
+        return ext_lookup(inode, c, i);
+    }
+    return ind_lookup(inode, c, i);
+}
+
+// get the block number of the ith data block for a file. 
+// hides all the "indirect block" stuff. 
+// (no cache, since all we have is the inode.)
+uint32_t get_data_block_n(inode_t file, uint32_t i) {
+    return lookup_block(&file, NULL, i);
+}
+
+// same, but through the file's block map cache.
+uint32_t map_block(mochi_file *file, uint32_t i) {
+    return lookup_block(&file->inode, get_bmap_cache(file->inode_n), i);
+}
+
+// whether logical block i of file is in an unwritten extent.
+uint8_t block_unwritten(mochi_file *file, uint32_t i) {
+    if (!(file->inode.i_flags & EXT4_EXTENTS_FL)) return 0;
+    if (file->inode.i_flags & MOCHI_INLINE_DATA_FL) return 0;
+
+    bmap_cache *c = get_bmap_cache(file->inode_n);
+    if (ext_lookup(&file->inode, c, i) == 0) return 0;
+    return c->ext_unwritten;
+}
+
+// where to read logical block i of file from: 0 for holes 
+// and unwritten blocks, which both read as zeroes.
+uint32_t data_block(mochi_file *file, uint32_t i) {
+    uint32_t blockn = map_block(file, i);
+    if (blockn != 0 && block_unwritten(file, i)) return 0;
+    return blockn;
+}
+
+/* Get the ith block for a file. */
+
+
+int reserve_inode(uint32_t inode_n, uint8_t dir) {
+    set_inode_bitmap(inode_n);
+
+    update_inode_bg_desc(inode_n, dir);
+    bgdt_dirty = 1;
+
+    super.s_free_inodes_count -= 1;
+    super_dirty = 1;
+    return 0;
+}
+
+// undoes reserve_inode, for an inode that never got linked in.
+void release_inode(uint32_t inode_n, uint8_t dir) {
+    unset_inode_bitmap(inode_n);
+
+    uint16_t inode_bg_n = (inode_n - 1) / super.s_inodes_per_group;
+    bgdt[inode_bg_n].bg_free_inodes_count += 1;
+    if (dir) bgdt[inode_bg_n].bg_used_dirs_count -= 1;
+    bgdt_dirty = 1;
+
+    super.s_free_inodes_count += 1;
+    super_dirty = 1;
+}
+
+/* Inode placement.
+ *
+ * new directories are spread across the groups, the way ext2's 
+ * Orlov allocator does it. a top-level directory goes to the group 
+ * with the fewest directories, out of those with at least the 
+ * average free inodes and blocks. a deeper one stays near its 
+ * parent, unless that group already has more than its share of 
+ * directories or too little room. files go in their directory's 
+ * group. a file's blocks go after its group's inode table (see 
+ * find_goal), so each subtree stays together on disk, and different 
+ * subtrees don't all fill up the same group. */
+
+uint32_t inode_group(uint32_t inode_n) {
+    return (inode_n - 1) / super.s_inodes_per_group;
+}
+
+// for a directory in the root. n_block_groups if nothing qualifies.
+uint32_t find_group_top() {
+    uint32_t avg_inodes = super.s_free_inodes_count / n_block_groups;
+    uint32_t avg_blocks = super.s_free_blocks_count / n_block_groups;
+
+    uint32_t best = n_block_groups;
+    for (uint32_t g = 0; g < n_block_groups; g++) {
+        if (bgdt[g].bg_free_inodes_count == 0) continue;
+        if (bgdt[g].bg_free_inodes_count < avg_inodes) continue;
+        if (bgdt[g].bg_free_blocks_count < avg_blocks) continue;
+
+        if (best == n_block_groups || 
+                bgdt[g].bg_used_dirs_count < bgdt[best].bg_used_dirs_count) {
+            best = g;
+        }
+    }
+    return best;
+}
+
+// for a directory deeper down: the first group from the parent's 
+// on that isn't too far from average. (ext2 allows the same slack.)
+uint32_t find_group_dir(uint32_t parent_group) {
+    uint32_t ipg = super.s_inodes_per_group;
+    uint32_t bpg = super.s_blocks_per_group;
+
+    uint32_t ndirs = 0;
+    for (uint32_t g = 0; g < n_block_groups; g++) ndirs += bgdt[g].bg_used_dirs_count;
+
+    uint32_t avg_inodes = super.s_free_inodes_count / n_block_groups;
+    uint32_t avg_blocks = super.s_free_blocks_count / n_block_groups;
+
+    uint32_t max_dirs = ndirs / n_block_groups + ipg / 16;
+    uint32_t min_inodes = (avg_inodes > ipg / 4) ? avg_inodes - ipg / 4 : 1;
+    uint32_t min_blocks = (avg_blocks > bpg / 4) ? avg_blocks - bpg / 4 : 1;
+
+    for (uint32_t k = 0; k < n_block_groups; k++) {
+        uint32_t g = (parent_group + k) % n_block_groups;
+        if (bgdt[g].bg_used_dirs_count >= max_dirs) continue;
+        if (bgdt[g].bg_free_inodes_count < min_inodes) continue;
+        if (bgdt[g].bg_free_blocks_count < min_blocks) continue;
+        return g;
+    }
+    return n_block_groups;
+}
+
+// for a file: its directory's group, if there's any room there.
+uint32_t find_group_file(uint32_t parent_group) {
+    for (uint32_t k = 0; k < n_block_groups; k++) {
+        uint32_t g = (parent_group + k) % n_block_groups;
+        if (bgdt[g].bg_free_inodes_count > 0 && bgdt[g].bg_free_blocks_count > 0) return g;
+    }
+    return n_block_groups;
+}
+
+// an inode for a new file (or directory, with dir set) in parent.
+int reserve_free_inode(mochi_file *parent, uint8_t dir, uint32_t *inode_n) {
+    uint32_t parent_group = inode_group(parent->inode_n);
+
+    uint32_t g;
+    if (!dir) {
+        g = find_group_file(parent_group);
+    } else if (parent->inode_n == EXT2_ROOT_INO) {
+        g = find_group_top();
+    } else {
+        g = find_group_dir(parent_group);
+    }
+    // nowhere good. take whatever's free, near the parent.
+    if (g == n_block_groups) g = parent_group;
+
+    if (first_free_inode_num(g, inode_n)) {
+        print("No free inodes available.\n");
         return -1;
     }
-    reserve_inode(*inode_n);
+    reserve_inode(*inode_n, dir);
+    return 0;
+}
+
+// changes to the inode itself (i_block, the extent root) are only made 
+// in memory. the caller writes the inode out.
+int set_i_block(inode_t *file, uint32_t inode_n, uint32_t i, uint32_t blockn) {
+    if (file->i_flags & EXT4_EXTENTS_FL) {
+        return ext_set(file, inode_n, i, blockn);
+    }
+
+    return ind_set(file, inode_n, i, blockn);
+}
+
+uint32_t i_block_len(inode_t i) {
+    return i.i_blocks / (2 << super.s_log_block_size);
+}
+
+/* Holes.
+ *
+ * a regular file's block map can skip logical blocks. block number 0 
+ * (in i_block or an indirect block), or a gap between extents, is a 
+ * hole: it reads as zeroes without going to the disk, and only gets 
+ * a block once something is written there (see alloc_delayed). so a 
+ * file's length in blocks comes from its size, and i_blocks only 
+ * counts the blocks it really has. directories don't have holes. */
+
+// how many logical blocks the inode spans, holes and all.
+uint32_t file_blocks(inode_t *inode) {
+    if ((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFREG) return i_block_len(*inode);
+    return (inode->i_size + S_BLOCK_SIZE - 1) / S_BLOCK_SIZE;
+}
+
+// put blockn at logical block i of file, which has to be a hole 
+// (or past the end). only the in-memory inode is changed.
+int fill_hole(mochi_file *file, uint32_t i, uint32_t blockn) {
+    if (set_i_block(&file->inode, file->inode_n, i, blockn)) return -1;
+
+    file->inode.i_blocks += 2 << super.s_log_block_size;
+    return 0;
+}
+
+/* Preallocation.
+ * 
+ * when a file needs a block, we grab a few more right after it 
+ * (the superblock's s_prealloc_blocks / s_prealloc_dir_blocks hints) 
+ * and keep them in a window for that inode. the blocks are marked 
+ * used on disk, like ext2 does, and are given back by 
+ * discard_prealloc(). */
+
+#define N_PREALLOC_WINDOWS  16
+
+typedef struct {
+    uint32_t inode_n;   // 0 if this slot is unused
+    uint32_t start;     // next block to hand out
+    uint32_t len;       // blocks left in the window
+} prealloc_window;
+
+static prealloc_window prealloc[N_PREALLOC_WINDOWS];
+static uint8_t next_prealloc_victim = 0;
+
+prealloc_window *find_prealloc(uint32_t inode_n) {
+    for (int i = 0; i < N_PREALLOC_WINDOWS; i++) {
+        if (prealloc[i].inode_n == inode_n) return &prealloc[i];
+    }
+    return NULL;
+}
+
+void release_window(prealloc_window *w) {
+    free_blocks(w->start, w->len);
+    w->inode_n = 0;
+    w->start = 0;
+    w->len = 0;
+}
+
+// give back whatever is left of this inode's window.
+void discard_prealloc(uint32_t inode_n) {
+    prealloc_window *w = find_prealloc(inode_n);
+    if (w != NULL) release_window(w);
+}
+
+void discard_all_prealloc() {
+    for (int i = 0; i < N_PREALLOC_WINDOWS; i++) {
+        if (prealloc[i].inode_n != 0) release_window(&prealloc[i]);
+    }
+}
+
+// gets a slot for a new window, evicting round-robin if all are taken.
+prealloc_window *new_prealloc(uint32_t inode_n) {
+    prealloc_window *w = find_prealloc(0);
+    if (w == NULL) {
+        w = &prealloc[next_prealloc_victim];
+        release_window(w);
+        next_prealloc_victim = (next_prealloc_victim + 1) % N_PREALLOC_WINDOWS;
+    }
+    w->inode_n = inode_n;
+    return w;
+}
+
+// where we'd like logical block i of file to go: right after 
+// block i - 1, or if there isn't one, at the start of its inode's group.
+uint32_t find_goal(mochi_file *file, uint32_t i) {
+    if (i > 0) {
+        uint32_t prev = map_block(file, i - 1);
+        if (prev != 0) return prev + 1;
+    }
+
+    uint32_t g = (file->inode_n - 1) / super.s_inodes_per_group;
+    uint32_t itable_blocks = 
+        (super.s_inodes_per_group * sizeof(inode_t)) / S_BLOCK_SIZE;
+    return bgdt[g].bg_inode_table + itable_blocks;
+}
+
+/* Finds a block for the end of file, near its other blocks. */
+int reserve_file_block(mochi_file *file, uint32_t *block_n) {
+    uint32_t goal = find_goal(file, i_block_len(file->inode));
+
+    prealloc_window *w = find_prealloc(file->inode_n);
+    if (w != NULL && w->len > 0 && w->start == goal) {
+        *block_n = w->start;
+        w->start++;
+        w->len--;
+        if (w->len == 0) w->inode_n = 0;
+        return 0;
+    }
+
+    // the window doesn't continue the file any more. 
+    if (w != NULL) release_window(w);
+
+    uint32_t want = 1;
+    if ((file->inode.i_mode & 0xf000) == EXT2_S_IFDIR) {
+        want += super.s_prealloc_dir_blocks;
+    } else {
+        want += super.s_prealloc_blocks;
+    }
+
+    uint32_t first, got;
+    if (alloc_blocks(goal, want, &first, &got)) return -1;
+
+    *block_n = first;
+    if (got > 1) {
+        w = new_prealloc(file->inode_n);
+        w->start = first + 1;
+        w->len = got - 1;
+    }
+    return 0;
+}
+
+
+/* Page cache.
+ *
+ * file data is cached in 4kb pages. each inode with pages in the 
+ * cache gets a page_tree: a radix tree from page index (offset / 4kb) 
+ * to page. all pages are also on one LRU list, and the least 
+ * recently used ones are evicted when the cache goes over budget. 
+ * the budget is a share of the memory that's free (see memory.c), 
+ * so the cache shrinks as the rest of the kernel needs more.
+ *
+ * write() only dirties pages (and reserves blocks for them, see 
+ * delay_blocks). dirty pages go to the disk from the flusher 
+ * (see fs_writeback), in pcache_writeback_all() (from fs_commit), 
+ * or when evicted. blocks that are contiguous on disk are 
+ * gathered up so each run is one request.
+ *
+ * directory blocks are cached too, but written through right away 
+ * (see write_file_block), so their pages are never dirty. 
+ *
+ * the data pages come from alloc_kernel_page(), so they're 
+ * page-aligned and mmap() can map them straight into a file mapping. */
+
+#define RADIX_BITS      6
+#define RADIX_SLOTS     (1 << RADIX_BITS)
+#define RADIX_MASK      (RADIX_SLOTS - 1)
+
+#define N_PAGE_TREES        64
+#define PCACHE_SHARE        4   // cache may use 1/4 of free memory
+#define PCACHE_MIN_PAGES    16
+#define PCACHE_WB_PAGES     16  // biggest write-back request (64kb)
+
+typedef struct {
+    void *slots[RADIX_SLOTS];   // radix_nodes, or cpages at the bottom
+    uint32_t count;             // slots in use
+} radix_node;
+
+typedef struct {
+    uint32_t inode_n;   // 0 if unused
+    uint32_t height;    // levels of radix_nodes (0 if empty)
+    radix_node *root;
+    uint32_t npages;
+    uint32_t ndirty;
+    uint32_t npending;  // pages with reserved or convert bits (see reserve_blocks)
+    uint32_t nmeta;     // mapping blocks reserved for them, likewise
+    uint32_t next_new;  // the block after the last one reserved
+    uint32_t next_conv; // the block after the last one marked for converting
+} page_tree;
+
+typedef struct cpage {
+    page_tree *tree;
+    uint32_t index;     // which 4kb of the file this is
+    uint8_t *data;
+    uint8_t dirty;
+    uint32_t dirtied;   // fs_clock when it last went from clean to dirty
+    uint8_t reserved;   // its blocks taken off the free count, one bit each
+    uint8_t convert;    // its unwritten blocks that now hold data, likewise
+    uint32_t mapcount;  // file mappings that have this page mapped
+
+    // LRU list, most recently used first.
+    struct cpage *prev;
+    struct cpage *next;
+} cpage;
+
+static page_tree page_trees[N_PAGE_TREES];
+static uint8_t next_tree_victim = 0;
+
+static cpage *lru_head = NULL;
+static cpage *lru_tail = NULL;
+static uint32_t pcache_npages = 0;
+static uint32_t pcache_ndirty = 0;
+
+static uint8_t *wb_buf = NULL; // staging area for write-back runs
+
+// largest index a tree of this height can hold.
+uint32_t radix_max(uint32_t height) {
+    if (height * RADIX_BITS >= 32) return 0xffffffff;
+    return (1 << (height * RADIX_BITS)) - 1;
+}
+
+radix_node *new_radix_node() {
+    radix_node *n = (radix_node *) kmalloc(sizeof(radix_node));
+    if (n == NULL) return NULL;
+    memset(n, 0, sizeof(radix_node));
+    return n;
+}
+
+cpage *radix_lookup(page_tree *t, uint32_t index) {
+    if (t->height == 0 || index > radix_max(t->height)) return NULL;
+
+    radix_node *n = t->root;
+    for (uint32_t h = t->height - 1; h > 0; h--) {
+        n = n->slots[(index >> (h * RADIX_BITS)) & RADIX_MASK];
+        if (n == NULL) return NULL;
+    }
+    return n->slots[index & RADIX_MASK];
+}
+
+int radix_insert(page_tree *t, uint32_t index, cpage *p) {
+    if (t->height == 0) {
+        t->root = new_radix_node();
+        if (t->root == NULL) return -1;
+        t->height = 1;
+    }
+
+    // grow from the top until index fits.
+    while (index > radix_max(t->height)) {
+        radix_node *top = new_radix_node();
+        if (top == NULL) return -1;
+        top->slots[0] = t->root;
+        top->count = 1;
+        t->root = top;
+        t->height++;
+    }
+
+    radix_node *n = t->root;
+    for (uint32_t h = t->height - 1; h > 0; h--) {
+        uint32_t s = (index >> (h * RADIX_BITS)) & RADIX_MASK;
+        if (n->slots[s] == NULL) {
+            n->slots[s] = new_radix_node();
+            if (n->slots[s] == NULL) return -1;
+            n->count++;
+        }
+        n = n->slots[s];
+    }
+
+    n->slots[index & RADIX_MASK] = p;
+    n->count++;
+    return 0;
+}
+
+// takes index out of the tree, freeing any nodes left empty.
+void radix_delete(page_tree *t, uint32_t index) {
+    if (t->height == 0 || index > radix_max(t->height)) return;
+
+    radix_node *path[8];
+    uint32_t slot[8];
+
+    radix_node *n = t->root;
+    for (uint32_t h = t->height - 1; ; h--) {
+        path[h] = n;
+        slot[h] = (index >> (h * RADIX_BITS)) & RADIX_MASK;
+        if (h == 0) break;
+        n = n->slots[slot[h]];
+        if (n == NULL) return;
+    }
+
+    if (path[0]->slots[slot[0]] == NULL) return;
+
+    for (uint32_t h = 0; h < t->height; h++) {
+        path[h]->slots[slot[h]] = NULL;
+        if (--path[h]->count > 0) return;
+        kfree(path[h]);
+    }
+
+    // the root went too.
+    t->root = NULL;
+    t->height = 0;
+}
+
+// the first page at or after from, in a subtree of this height.
+cpage *radix_next_in(radix_node *n, uint32_t height, uint32_t from) {
+    uint32_t shift = (height - 1) * RADIX_BITS;
+
+    for (uint32_t s = (from >> shift) & RADIX_MASK; s < RADIX_SLOTS; s++) {
+        if (n->slots[s] == NULL) continue;
+        if (height == 1) return n->slots[s];
+
+        // only the first subtree starts partway in.
+        uint32_t sub_from = 0;
+        if (s == ((from >> shift) & RADIX_MASK)) sub_from = from;
+
+        cpage *p = radix_next_in(n->slots[s], height - 1, sub_from);
+        if (p != NULL) return p;
+    }
+    return NULL;
+}
+
+cpage *radix_next(page_tree *t, uint32_t from) {
+    if (t->height == 0 || from > radix_max(t->height)) return NULL;
+    return radix_next_in(t->root, t->height, from);
+}
+
+void lru_unlink(cpage *p) {
+    if (p->prev != NULL) p->prev->next = p->next;
+    else lru_head = p->next;
+
+    if (p->next != NULL) p->next->prev = p->prev;
+    else lru_tail = p->prev;
+}
+
+void lru_push(cpage *p) {
+    p->prev = NULL;
+    p->next = lru_head;
+    if (lru_head != NULL) lru_head->prev = p;
+    lru_head = p;
+    if (lru_tail == NULL) lru_tail = p;
+}
+
+page_tree *find_page_tree(uint32_t inode_n) {
+    for (int i = 0; i < N_PAGE_TREES; i++) {
+        if (page_trees[i].inode_n == inode_n) return &page_trees[i];
+    }
+    return NULL;
+}
+
+// how many pages the cache may hold right now.
+uint32_t pcache_budget() {
+    uint32_t budget = (free_page_count() + pcache_npages) / PCACHE_SHARE;
+    if (budget < PCACHE_MIN_PAGES) budget = PCACHE_MIN_PAGES;
+    return budget;
+}
+
+// how many logical blocks fit in a page.
+uint32_t blocks_per_page() {
+    return PAGE_SIZE / S_BLOCK_SIZE;
+}
+
+// how many blocks from logical block i on (at most max) sit next 
+// to each other on disk, or all read as zeroes. *blockn gets the 
+// first one (0 for zeroes).
+uint32_t contiguous_run(mochi_file *file, uint32_t i, uint32_t max, uint32_t *blockn) {
+    *blockn = data_block(file, i);
+
+    uint32_t n = 1;
+    while (n < max) {
+        uint32_t next = data_block(file, i + n);
+        if (*blockn == 0 ? next != 0 : next != *blockn + n) break;
+        n++;
+    }
+    return n;
+}
+
+// read logical blocks [i, i + n) into buf, one request per run.
+void read_file_blocks(mochi_file *file, uint32_t i, uint32_t n, uint8_t *buf) {
+    while (n > 0) {
+        uint32_t blockn;
+        uint32_t run = contiguous_run(file, i, n, &blockn);
+        if (blockn == 0) {
+            memset(buf, 0, run * S_BLOCK_SIZE);
+        } else {
+            disk_read_blks(blockn, buf, run);
+            journal_overlay(blockn, buf, run);
+        }
+
+        i += run;
+        n -= run;
+        buf += run * S_BLOCK_SIZE;
+    }
+}
+
+void alloc_delayed(uint32_t inode_n);
+void alloc_all_delayed();
+
+// write the dirty pages of one inode.
+void pcache_writeback_tree(page_tree *t) {
+    // its new blocks get picked now. (see alloc_delayed.)
+    alloc_delayed(t->inode_n);
+    if (t->ndirty == 0) return;
+
+    if (wb_buf == NULL) {
+        wb_buf = (uint8_t *) kmalloc(PCACHE_WB_PAGES * PAGE_SIZE);
+        if (wb_buf == NULL) return;
+    }
+
+    // alloc_delayed() just gave it every block the pages need.
+    mochi_file file = {
+        .inode = get_inode(t->inode_n),
+        .inode_n = t->inode_n
+    };
+    uint32_t nblocks = file_blocks(&file.inode);
+    uint32_t max_run = (PCACHE_WB_PAGES * PAGE_SIZE) / S_BLOCK_SIZE;
+
+    // the run being gathered in wb_buf.
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+
+    for (cpage *p = radix_next(t, 0); p != NULL; p = radix_next(t, p->index + 1)) {
+        if (!p->dirty) continue;
+
+        // some of its blocks still don't have one. it stays dirty 
+        // until they do.
+        if (p->reserved != 0 || p->convert != 0) continue;
+
+        uint32_t first = p->index * blocks_per_page();
+        for (uint32_t b = 0; b < blocks_per_page(); b++) {
+            // blocks past the end aren't on disk at all.
+            if (first + b >= nblocks) break;
+
+            // (nor are holes it wasn't written to.)
+            uint32_t blockn = map_block(&file, first + b);
+            if (blockn == 0) continue;
+
+            if (run_len > 0 && (blockn != run_start + run_len || run_len == max_run)) {
+                disk_write_blks(run_start, wb_buf, run_len);
+                run_len = 0;
+            }
+            if (run_len == 0) run_start = blockn;
+
+            memmove(wb_buf + run_len * S_BLOCK_SIZE, p->data + b * S_BLOCK_SIZE, S_BLOCK_SIZE);
+            run_len++;
+        }
+
+        p->dirty = 0;
+        t->ndirty--;
+        pcache_ndirty--;
+    }
+
+    if (run_len > 0) disk_write_blks(run_start, wb_buf, run_len);
+}
+
+uint32_t pcache_flush(uint8_t expired_only);
+
+void pcache_writeback_all() {
+    while (pcache_flush(0) > 0) {}
+
+    // files whose pages have all been dropped still need their size.
+    alloc_all_delayed();
+}
+
+void unmap_cached_page(cpage *p);
+
+void pcache_free_page(cpage *p) {
+    page_tree *t = p->tree;
+
+    // mappings of it fault it back in next time.
+    unmap_cached_page(p);
+
+    // a dirty page being thrown away.
+    if (p->reserved != 0 || p->convert != 0) {
+        delayed_blocks -= __builtin_popcount(p->reserved);
+        t->npending--;
+        if (t->npending == 0) {
+            delayed_blocks -= t->nmeta;
+            t->nmeta = 0;
+        }
+    }
+
+    radix_delete(t, p->index);
+    lru_unlink(p);
+    t->npages--;
+    pcache_npages--;
+
+    if (t->npages == 0) t->inode_n = 0;
+
+    free_kernel_page(p->data);
+    kfree(p);
+}
+
+// drop the least recently used page. -1 if the cache is empty, 
+// or every page is dirty and can't be written back.
+int pcache_evict() {
+    for (cpage *p = lru_tail; p != NULL; p = p->prev) {
+        if (p->dirty) pcache_writeback_tree(p->tree);
+
+        // its blocks couldn't be allocated. it's the only copy.
+        if (p->dirty) continue;
+
+        pcache_free_page(p);
+        return 0;
+    }
+    return -1;
+}
+
+// give up to npages pages back, e.g. when memory is tight.
+void pcache_shrink(uint32_t npages) {
+    for (uint32_t i = 0; i < npages; i++) {
+        if (pcache_evict()) return;
+    }
+}
+
+// forget everything, without writing it back. 
+// (for when the filesystem underneath changes.)
+void drop_page_cache() {
+    while (lru_head != NULL) {
+        lru_head->dirty = 0;
+        pcache_free_page(lru_head);
+    }
+
+    for (int i = 0; i < N_PAGE_TREES; i++) {
+        page_trees[i].inode_n = 0;
+        page_trees[i].ndirty = 0;
+        page_trees[i].npending = 0;
+        page_trees[i].nmeta = 0;
+    }
+    pcache_ndirty = 0;
+}
+
+// a tree for inode_n, taking over another inode's if they're all used.
+// NULL if none of them can be written back.
+page_tree *get_page_tree(uint32_t inode_n) {
+    page_tree *t = find_page_tree(inode_n);
+    if (t != NULL) return t;
+
+    t = find_page_tree(0);
+    for (int k = 0; t == NULL && k < N_PAGE_TREES; k++) {
+        t = &page_trees[next_tree_victim];
+        next_tree_victim = (next_tree_victim + 1) % N_PAGE_TREES;
+
+        // (pages whose blocks couldn't be allocated stay dirty.)
+        pcache_writeback_tree(t);
+        if (t->ndirty > 0) {
+            t = NULL;
+            continue;
+        }
+        while (t->npages > 0) {
+            pcache_free_page(radix_next(t, 0));
+        }
+    }
+    if (t == NULL) return NULL;
+
+    t->inode_n = inode_n;
+    t->height = 0;
+    t->root = NULL;
+    t->npages = 0;
+    t->ndirty = 0;
+    t->npending = 0;
+    t->nmeta = 0;
+    t->next_new = 0;
+    t->next_conv = 0;
+    return t;
+}
+
+cpage *pcache_find(uint32_t inode_n, uint32_t index) {
+    page_tree *t = find_page_tree(inode_n);
+    if (t == NULL) return NULL;
+
+    cpage *p = radix_lookup(t, index);
+    if (p != NULL && p != lru_head) {
+        lru_unlink(p);
+        lru_push(p);
+    }
+    return p;
+}
+
+// a new, empty page for (inode_n, index). its contents are garbage.
+cpage *pcache_add(uint32_t inode_n, uint32_t index) {
+    // make room first. (this can free a tree, so it 
+    // has to happen before we pick ours.)
+    while (pcache_npages >= pcache_budget()) {
+        if (pcache_evict()) break;
+    }
+
+    page_tree *t = get_page_tree(inode_n);
+    if (t == NULL) return NULL;
+
+    cpage *p = (cpage *) kmalloc(sizeof(cpage));
+    if (p == NULL) return NULL;
+
+    p->data = (uint8_t *) alloc_kernel_page();
+    if (p->data == NULL) {
+        kfree(p);
+        return NULL;
+    }
+
+    if (radix_insert(t, index, p)) {
+        free_kernel_page(p->data);
+        kfree(p);
+        return NULL;
+    }
+
+    p->tree = t;
+    p->index = index;
+    p->dirty = 0;
+    p->reserved = 0;
+    p->convert = 0;
+    p->mapcount = 0;
+    lru_push(p);
+    t->npages++;
+    pcache_npages++;
+    return p;
+}
+
+void pcache_mark_dirty(cpage *p) {
+    if (p->dirty) return;
+    p->dirty = 1;
+    p->dirtied = fs_clock;
+    p->tree->ndirty++;
+    pcache_ndirty++;
+}
+
+// page index of file, read in if it isn't cached. 
+// logical blocks from nvalid on are taken to be zeroes, 
+// whatever is on the disk.
+cpage *pcache_get(mochi_file *file, uint32_t index, uint32_t nvalid) {
+    cpage *p = pcache_find(file->inode_n, index);
+    if (p != NULL) return p;
+
+    p = pcache_add(file->inode_n, index);
+    if (p == NULL) return NULL;
+
+    uint32_t first = index * blocks_per_page();
+    uint32_t n = 0;
+    if (nvalid > first) n = nvalid - first;
+    if (n > blocks_per_page()) n = blocks_per_page();
+
+    read_file_blocks(file, first, n, p->data);
+    memset(p->data + n * S_BLOCK_SIZE, 0, PAGE_SIZE - n * S_BLOCK_SIZE);
+    return p;
+}
+
+// block i of file, out of the page cache. the pointer is good 
+// until the next call into the page cache.
+uint8_t *file_block(mochi_file *file, uint32_t i) {
+    cpage *p = pcache_get(file, i / blocks_per_page(), file_blocks(&file->inode));
+    if (p == NULL) return NULL;
+
+    return p->data + (i % blocks_per_page()) * S_BLOCK_SIZE;
+}
+
+// write block i of file straight to disk, keeping the cached copy 
+// (if there is one) in step. data can point into the cache.
+int write_file_block(mochi_file *file, uint32_t i, uint8_t *data) {
+    cpage *p = pcache_find(file->inode_n, i / blocks_per_page());
+    if (p != NULL) {
+        memmove(p->data + (i % blocks_per_page()) * S_BLOCK_SIZE, data, S_BLOCK_SIZE);
+    }
+
+    return meta_write_blk(map_block(file, i), data);
 }
 
-int set_i_block(inode_t *file, uint32_t inode_n, uint32_t i, uint32_t blockn) {
-    /* Direct blocks */
 
-    uint32_t dir_blk_len = 12;
-    if (i < dir_blk_len) {
-        file->i_block[i] = blockn;
-        write_inode_table(inode_n, *file);
-        return 0;
+/* Delayed allocation.
+ *
+ * write() doesn't pick blocks for data where the file has none yet 
+ * (past its end, or in a hole). it only takes them off the free 
+ * count (delayed_blocks, with each page marking which of its blocks), 
+ * along with the most metadata mapping them could take, and notes 
+ * any new size in a delayed_file. the blocks are picked when the 
+ * pages are written back (alloc_delayed), by which time the file has 
+ * usually stopped growing. so they come out as one long run, however 
+ * the writes to different files were interleaved, and the blocks 
+ * nothing was written to stay holes.
+ *
+ * nothing else may allocate reserved blocks (see alloc_blocks), so 
+ * they're there when they're picked. and a page is only written back, 
+ * and marked clean, once all of its blocks have one.
+ *
+ * until then, the inode on disk has the old size and block map. 
+ * file_size() is the size as the file's users see it. */
+
+#define N_DELAYED_FILES     32
+
+typedef struct {
+    uint32_t inode_n;   // 0 if this slot is unused
+    uint32_t size;      // i_size once the blocks are allocated
+} delayed_file;
+
+static delayed_file delayed_files[N_DELAYED_FILES];
+static uint8_t next_delayed_victim = 0;
+
+delayed_file *find_delayed(uint32_t inode_n) {
+    for (int i = 0; i < N_DELAYED_FILES; i++) {
+        if (delayed_files[i].inode_n == inode_n) return &delayed_files[i];
+    }
+    return NULL;
+}
+
+uint32_t file_size(mochi_file *file) {
+    delayed_file *d = find_delayed(file->inode_n);
+    if (d != NULL) return d->size;
+    return file->inode.i_size;
+}
+
+// give logical blocks [i, i + n) of file blocks, in as few runs as 
+// it takes. only the in-memory inode changes. -1 if we run out.
+int alloc_run(mochi_file *file, uint32_t i, uint32_t n) {
+    while (n > 0) {
+        uint32_t first, got;
+        if (alloc_blocks(find_goal(file, i), n, &first, &got)) return -1;
+
+        for (uint32_t k = 0; k < got; k++) {
+            if (fill_hole(file, i + k, first + k)) {
+                free_blocks(first + k, got - k);
+                return -1;
+            }
+        }
+        i += got;
+        n -= got;
+    }
+    return 0;
+}
+
+// pick blocks for the ones inode_n's pages have reserved, mark 
+// the unwritten ones they wrote to as written, and put its new 
+// size on disk. a page keeps the bits of any block that didn't 
+// get one (so write-back leaves it dirty), and they're tried again.
+void alloc_delayed(uint32_t inode_n) {
+    delayed_file *d = find_delayed(inode_n);
+    page_tree *t = find_page_tree(inode_n);
+    if (d == NULL && (t == NULL || t->npending == 0)) return;
+
+    mochi_file file = {
+        .inode = get_inode(inode_n),
+        .inode_n = inode_n
+    };
+    uint32_t size = (d != NULL) ? d->size : file.inode.i_size;
+    uint32_t end = (size + S_BLOCK_SIZE - 1) / S_BLOCK_SIZE;
+    uint32_t old_end = file_blocks(&file.inode);
+
+    // all of the new blocks are wanted now, so a window 
+    // from before would only split the run.
+    discard_prealloc(inode_n);
+
+    // the runs of logical blocks that need one, and that 
+    // need converting, being gathered.
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    uint32_t conv_start = 0;
+    uint32_t conv_len = 0;
+    int err = 0;
+
+    uint8_t pending = (t != NULL && t->npending > 0);
+    if (pending) {
+        // what the pages reserved is ours to spend now.
+        delayed_blocks -= t->nmeta;
+        t->nmeta = 0;
+        t->next_new = 0;
+        t->next_conv = 0;
     }
 
-    /* Indirect blocks. */
+    cpage *p = pending ? radix_next(t, 0) : NULL;
+    for (; p != NULL; p = radix_next(t, p->index + 1)) {
+        if (p->reserved == 0 && p->convert == 0) continue;
+        delayed_blocks -= __builtin_popcount(p->reserved);
+
+        uint32_t first = p->index * blocks_per_page();
+        for (uint32_t b = first; b < first + blocks_per_page() && b < end; b++) {
+            uint8_t bit = 1 << (b - first);
+            if (p->convert & bit) {
+                if (conv_len > 0 && b != conv_start + conv_len) {
+                    if (ext_mark_written(&file.inode, inode_n, conv_start, conv_len)) err = 1;
+                    conv_len = 0;
+                }
+                if (conv_len == 0) conv_start = b;
+                conv_len++;
+                continue;
+            }
 
-    uint32_t ind_blk_len = S_BLOCK_SIZE / sizeof(uint32_t);
+            if (!(p->reserved & bit)) continue;
+            if (b < old_end && map_block(&file, b) != 0) continue;
 
-    if (i < dir_blk_len + ind_blk_len) {
-        uint32_t blocks[ind_blk_len];
-        disk_read_blk(file->i_block[12], (uint8_t *) blocks);
-        uint16_t j = i - dir_blk_len;
-        blocks[j] = blockn;
-        disk_write_blk(file->i_block[12], (uint8_t *) blocks);
+            if (run_len > 0 && b != run_start + run_len) {
+                if (alloc_run(&file, run_start, run_len)) err = 1;
+                run_len = 0;
+            }
+            if (run_len == 0) run_start = b;
+            run_len++;
+        }
+    }
+    if (run_len > 0 && alloc_run(&file, run_start, run_len)) err = 1;
+    if (conv_len > 0 && ext_mark_written(&file.inode, inode_n, conv_start, conv_len)) err = 1;
 
-        return 0;
+    if (d != NULL) {
+        file.inode.i_size = d->size;
+        d->inode_n = 0;
+        d->size = 0;
     }
 
-    /* Doubly-indirect blocks. */
+    // see which blocks got what they needed. (the ones past 
+    // the end were truncated away, and need nothing.)
+    p = pending ? radix_next(t, 0) : NULL;
+    for (; p != NULL; p = radix_next(t, p->index + 1)) {
+        if (p->reserved == 0 && p->convert == 0) continue;
+
+        uint32_t first = p->index * blocks_per_page();
+        for (uint32_t b = first; b < first + blocks_per_page(); b++) {
+            uint8_t bit = 1 << (b - first);
+            if (b >= end || map_block(&file, b) != 0) p->reserved &= ~bit;
+            if (b >= end || !block_unwritten(&file, b)) p->convert &= ~bit;
+        }
+
+        if (p->reserved == 0 && p->convert == 0) {
+            t->npending--;
+        } else {
+            // back on the free count's books until next time.
+            delayed_blocks += __builtin_popcount(p->reserved);
+        }
+    }
 
-    uint32_t dbl_ind_blk_len = S_BLOCK_SIZE * ind_blk_len;
-    if (i < dir_blk_len + ind_blk_len + dbl_ind_blk_len) {
-        uint32_t blocks[ind_blk_len];
-        disk_read_blk(file->i_block[13], (uint8_t *) blocks);
+    // the counts say there was room, but there wasn't: the free 
+    // space was too broken up for what we reserved for metadata.
+    if (err) print("delayed allocation: out of blocks. pages stay dirty.\n");
 
-        uint32_t j = i - dir_blk_len - ind_blk_len;
+    write_inode_table(inode_n, file.inode);
+}
 
-        uint32_t ind_blk_index = j / ind_blk_len;
-        uint32_t blk_index = j % ind_blk_len;
+void alloc_all_delayed() {
+    for (int i = 0; i < N_DELAYED_FILES; i++) {
+        if (delayed_files[i].inode_n != 0) {
+            alloc_delayed(delayed_files[i].inode_n);
+        }
+    }
+}
 
-        uint32_t update_location = blocks[ind_blk_index];
+// gets a slot for file, making room round-robin if all are taken.
+delayed_file *new_delayed(mochi_file *file) {
+    delayed_file *d = find_delayed(0);
+    if (d == NULL) {
+        d = &delayed_files[next_delayed_victim];
+        next_delayed_victim = (next_delayed_victim + 1) % N_DELAYED_FILES;
+
+        // (writing its pages back allocates its blocks.)
+        page_tree *t = find_page_tree(d->inode_n);
+        if (t != NULL) {
+            pcache_writeback_tree(t);
+        } else {
+            alloc_delayed(d->inode_n);
+        }
+    }
 
-        disk_read_blk(update_location, (uint8_t *) blocks);
+    // what's on disk, which file's copy may not be.
+    inode_t inode = get_inode(file->inode_n);
+    d->inode_n = file->inode_n;
+    d->size = inode.i_size;
+    return d;
+}
 
-        blocks[blk_index] = blockn;
+// file is growing to size bytes.
+void grow_delayed(mochi_file *file, uint32_t size) {
+    if (size <= file_size(file)) return;
 
-        disk_write_blk(update_location, (uint8_t *) blocks);
+    delayed_file *d = find_delayed(file->inode_n);
+    if (d == NULL) d = new_delayed(file);
+    d->size = size;
+}
 
-        return 0;
+// the most blocks of mapping metadata (extent tree nodes or 
+// indirect blocks) that giving logical block i of inode a block can 
+// take. cont: block i - 1 is getting one too, so whatever they share 
+// is counted already.
+uint32_t meta_worst(inode_t *inode, uint32_t i, uint8_t cont) {
+    if (inode->i_flags & EXT4_EXTENTS_FL) {
+        // a new extent. adding it can split a node on each level and 
+        // then push the root down a level (which the extents added 
+        // after it in the same go can do again).
+        if (cont) return 0;
+        return ext_root(inode)->eh_depth + 3;
     }
 
-    /* Triply-indirect blocks. TODO */
+    uint32_t off[IND_LEVELS + 1];
+    uint32_t prev[IND_LEVELS + 1];
+    int depth = ind_path(i, off);
+    if (depth <= 0) return 0;
+    if (!cont || ind_path(i - 1, prev) != depth) return depth;
+
+    // a new indirect block starts wherever i is the first it indexes.
+    uint32_t n = 0;
+    for (int level = depth; level > 0 && off[level] == 0; level--) n++;
+    return n;
+}
+
+// take blocks off the free count for logical blocks [i, end) of 
+// file, which are all in page p, where they don't have one yet, 
+// along with the worst case for the metadata mapping them will 
+// need, and note the unwritten ones (see fallocate) for converting. 
+// write() calls this before dirtying them. -1 if there aren't enough.
+//
+// (a run is reserved as one extent. if the free space is so broken 
+// up that its blocks end up in more, and the metadata runs out, the 
+// pages that don't get blocks stay dirty. see alloc_delayed.)
+int reserve_blocks(mochi_file *file, cpage *p, uint32_t i, uint32_t end) {
+    page_tree *t = p->tree;
+    uint32_t first = p->index * blocks_per_page();
+    uint32_t on_disk = file_blocks(&file->inode);
+
+    uint8_t want = 0;
+    uint8_t convert = 0;
+    uint32_t meta = 0;
+    uint32_t next_new = t->next_new;
+    uint32_t next_conv = t->next_conv;
+    for (; i < end; i++) {
+        uint8_t bit = 1 << (i - first);
+        if ((p->reserved | p->convert) & bit) continue;
+        if (i >= on_disk || map_block(file, i) == 0) {
+            want |= bit;
+            meta += meta_worst(&file->inode, i, i > 0 && i == next_new);
+            next_new = i + 1;
+        } else if (block_unwritten(file, i)) {
+            // writing into the middle of an unwritten extent 
+            // splits it in three.
+            convert |= bit;
+            if (i == 0 || i != next_conv) meta += 2 * meta_worst(&file->inode, i, 0);
+            next_conv = i + 1;
+        }
+    }
+    if (want == 0 && convert == 0) return 0;
 
+    uint32_t n = __builtin_popcount(want);
+    if (unreserved_blocks() < n + meta) {
+        print("No free blocks available.\n");
+        return -1;
+    }
+    if (p->reserved == 0 && p->convert == 0) t->npending++;
+    p->reserved |= want;
+    p->convert |= convert;
+    t->nmeta += meta;
+    t->next_new = next_new;
+    t->next_conv = next_conv;
+    delayed_blocks += n + meta;
     return 0;
 }
 
-uint16_t i_block_len(inode_t i) {
-    return i.i_blocks / (2 << super.s_log_block_size);
+// forget all of it. (for when the filesystem underneath changes.)
+void drop_delayed() {
+    for (int i = 0; i < N_DELAYED_FILES; i++) {
+        delayed_files[i].inode_n = 0;
+        delayed_files[i].size = 0;
+    }
+    delayed_blocks = 0;
 }
 
 
-int chdir(mochi_file current_dir, const char *name, mochi_file *ret_dir) {
-    uint16_t nblocks = i_block_len(current_dir.inode);
+/* Background write-back.
+ *
+ * the kernel calls fs_idle() whenever it has nothing better to do, 
+ * and that runs the flusher, fs_writeback(). so dirty data and 
+ * metadata go to the disk there, not in the operations that 
+ * dirtied them. the flusher:
+ *   - once a second (the timer sets wb_due), writes the data 
+ *     pages that have been dirty for DIRTY_EXPIRE_SECS.
+ *   - writes pages regardless of age while more than 
+ *     DIRTY_BG_RATIO percent of the cache is dirty.
+ *   - commits the journal every FS_COMMIT_INTERVAL seconds, and 
+ *     checkpoints it once it's half full.
+ * write() only waits for the disk itself once DIRTY_RATIO percent 
+ * of the cache is dirty (see balance_dirty).
+ *
+ * each pass takes up to WB_BATCH_PAGES pages from any number of 
+ * inodes, sorts their blocks by disk address, and sends each run 
+ * of adjacent blocks as one request. */
+
+#define DIRTY_EXPIRE_SECS   3
+#define DIRTY_BG_RATIO      10
+#define DIRTY_RATIO         40
+#define WB_BATCH_PAGES      64
+
+typedef struct {
+    uint32_t blockn;
+    uint8_t *data;
+} wb_block;
+
+static cpage *wb_pages[WB_BATCH_PAGES];
+static wb_block wb_blocks[WB_BATCH_PAGES * (PAGE_SIZE / 1024)];
+
+// how many dirty pages make ratio percent of the cache.
+uint32_t dirty_limit(uint32_t ratio) {
+    return pcache_budget() * ratio / 100;
+}
+
+// least recently used dirty pages first (only ones dirty for 
+// DIRTY_EXPIRE_SECS, with expired_only), up to WB_BATCH_PAGES.
+// returns how many it found, sorted by inode and page.
+uint32_t collect_dirty(uint8_t expired_only) {
+    uint32_t n = 0;
+    for (cpage *p = lru_tail; p != NULL && n < WB_BATCH_PAGES; p = p->prev) {
+        if (!p->dirty) continue;
+        if (expired_only && fs_clock - p->dirtied < DIRTY_EXPIRE_SECS) continue;
+
+        // insertion sort. the batch is small.
+        uint32_t k = n;
+        while (k > 0 && (wb_pages[k - 1]->tree->inode_n > p->tree->inode_n || 
+                    (wb_pages[k - 1]->tree->inode_n == p->tree->inode_n && 
+                     wb_pages[k - 1]->index > p->index))) {
+            wb_pages[k] = wb_pages[k - 1];
+            k--;
+        }
+        wb_pages[k] = p;
+        n++;
+    }
+    return n;
+}
+
+// write one batch of dirty pages. returns how many were written.
+uint32_t pcache_flush(uint8_t expired_only) {
+    if (wb_buf == NULL) {
+        wb_buf = (uint8_t *) kmalloc(PCACHE_WB_PAGES * PAGE_SIZE);
+        if (wb_buf == NULL) return 0;
+    }
+
+    uint32_t npages = collect_dirty(expired_only);
+    if (npages == 0) return 0;
+
+    // where each block goes. the pages are grouped by inode, 
+    // so each inode is only looked up once.
+    mochi_file file = { .inode_n = 0 };
+    uint32_t nblocks = 0;
+    uint32_t n = 0;
+
+    uint32_t nwritten = 0;
+    for (uint32_t k = 0; k < npages; k++) {
+        cpage *p = wb_pages[k];
+        if (p->tree->inode_n != file.inode_n) {
+            alloc_delayed(p->tree->inode_n);
+            file.inode_n = p->tree->inode_n;
+            file.inode = get_inode(file.inode_n);
+            nblocks = file_blocks(&file.inode);
+        }
+
+        // some of its blocks still don't have one. it stays dirty, 
+        // and goes to the front, so the next batches try others first.
+        if (p->reserved != 0 || p->convert != 0) {
+            lru_unlink(p);
+            lru_push(p);
+            continue;
+        }
+        wb_pages[nwritten++] = p;
+
+        uint32_t first = p->index * blocks_per_page();
+        for (uint32_t b = 0; b < blocks_per_page(); b++) {
+            // blocks past the end aren't on disk at all.
+            if (first + b >= nblocks) break;
+
+            wb_block x = { map_block(&file, first + b), p->data + b * S_BLOCK_SIZE };
+            if (x.blockn == 0) continue;
+
+            uint32_t j = n;
+            while (j > 0 && wb_blocks[j - 1].blockn > x.blockn) {
+                wb_blocks[j] = wb_blocks[j - 1];
+                j--;
+            }
+            wb_blocks[j] = x;
+            n++;
+        }
+    }
+
+    uint32_t max_run = (PCACHE_WB_PAGES * PAGE_SIZE) / S_BLOCK_SIZE;
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+
+    for (uint32_t k = 0; k < n; k++) {
+        uint32_t blockn = wb_blocks[k].blockn;
+        if (run_len > 0 && (blockn != run_start + run_len || run_len == max_run)) {
+            disk_write_blks(run_start, wb_buf, run_len);
+            run_len = 0;
+        }
+        if (run_len == 0) run_start = blockn;
+
+        memmove(wb_buf + run_len * S_BLOCK_SIZE, wb_blocks[k].data, S_BLOCK_SIZE);
+        run_len++;
+    }
+    if (run_len > 0) disk_write_blks(run_start, wb_buf, run_len);
+
+    for (uint32_t k = 0; k < nwritten; k++) {
+        wb_pages[k]->dirty = 0;
+        wb_pages[k]->tree->ndirty--;
+        pcache_ndirty--;
+    }
+    return nwritten;
+}
+
+// the flusher. returns 1 if it found something to do.
+int fs_writeback() {
+    if (pcache_ndirty > dirty_limit(DIRTY_BG_RATIO)) {
+        return pcache_flush(0) > 0;
+    }
+
+    if (wb_due) {
+        if (pcache_flush(1) > 0) return 1;
+        wb_due = 0;
+    }
+
+    if (commit_due) {
+        fs_commit();
+        return 1;
+    }
+
+    // so that commits don't have to.
+    if (journal_on && jsb.s_start != 0 && journal_head - jsb.s_first > journal_len / 2) {
+        journal_checkpoint();
+        return 1;
+    }
+    return 0;
+}
+
+// called by write() after dirtying pages. past DIRTY_RATIO, 
+// the writer helps out, so the flusher can keep up.
+void balance_dirty() {
+    if (pcache_ndirty > dirty_limit(DIRTY_RATIO)) pcache_flush(0);
+}
+
+
+/* Inline data.
+ *
+ * a file or directory with MOCHI_INLINE_DATA_FL keeps its contents in 
+ * i_block (60 bytes) instead of a data block. a small one costs no 
+ * block, and reading it costs nothing past reading the inode. 
+ * new files and directories start out inline. once they outgrow 
+ * i_block, uninline() moves the contents to a block, and they're 
+ * mapped like any other file from then on. */
+
+uint8_t is_inline(inode_t *inode) {
+    return (inode->i_flags & MOCHI_INLINE_DATA_FL) != 0;
+}
+
+int append_block(mochi_file *file, uint32_t new_block);
+
+// an inline directory's entries go out with their rec_len chain 
+// covering the whole block. a file's data is just copied.
+// file (and every other open copy, see write_inode_table) only 
+// changes once it's all worked, so a failure leaves it inline.
+int uninline(mochi_file *file) {
+    mochi_file out = *file;
+    inode_t *inode = &out.inode;
+    uint8_t dir = (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+
+    uint8_t buf[S_BLOCK_SIZE];
+    memset(buf, 0, S_BLOCK_SIZE);
+    memmove(buf, inode->i_block, MOCHI_INLINE_DATA_MAX);
+
+    inode->i_flags &= ~MOCHI_INLINE_DATA_FL;
+    memset(inode->i_block, 0, sizeof(inode->i_block));
+    if (!dir) init_block_map(inode);
+
+    if (dir || inode->i_size > 0) {
+        if (dir) {
+            // the entries stay where they were, and an unused one 
+            // covers the rest of the block. so every offset getdents 
+            // has handed out is still the start of an entry.
+            uint32_t pos = 0;
+            dentry_t *d = (dentry_t *) buf;
+            while (d->rec_len != 0 && pos + d->rec_len < MOCHI_INLINE_DATA_MAX) {
+                pos += d->rec_len;
+                d = (dentry_t *) (buf + pos);
+            }
+            d->rec_len = MOCHI_INLINE_DATA_MAX - pos;
 
-    // NOTE: "dentries_per_blk" only makes sense because we've regularized the size of dentries.
-    // in the future, we'll relax this restriction. 
-    uint16_t dentries_per_blk = S_BLOCK_SIZE / sizeof(dentry_t);
-    dentry_t dentries[dentries_per_blk];
+            dentry_t *rest = (dentry_t *) (buf + MOCHI_INLINE_DATA_MAX);
+            rest->inode = 0;
+            rest->rec_len = S_BLOCK_SIZE - MOCHI_INLINE_DATA_MAX;
+        }
+
+        uint32_t blockn;
+        if (reserve_file_block(&out, &blockn)) return -1;
+        if (append_block(&out, blockn)) {
+            free_blocks(blockn, 1);
+            return -1;
+        }
+
+        // directory blocks are metadata, so they go through the journal.
+        if (dir) {
+            meta_write_blk(blockn, buf);
+        } else {
+            disk_write_blk(blockn, buf);
+        }
+    }
+
+    write_inode_table(out.inode_n, out.inode);
+    *file = out;
+    return 0;
+}
+
+// the blocks of entries in dir. an inline directory 
+// has one short "block": its i_block.
+uint32_t dir_n_blocks(mochi_file *dir) {
+    if (is_inline(&dir->inode)) return 1;
+    return i_block_len(dir->inode);
+}
+
+uint32_t dir_block_size(mochi_file *dir) {
+    if (is_inline(&dir->inode)) return MOCHI_INLINE_DATA_MAX;
+    return S_BLOCK_SIZE;
+}
+
+uint8_t *dir_block(mochi_file *dir, uint32_t i) {
+    if (is_inline(&dir->inode)) return (uint8_t *) dir->inode.i_block;
+    return file_block(dir, i);
+}
 
-    for (int i = 0; i < nblocks; i++) {
-        dentry_t *dentries = (dentry_t *) get_file_block(current_dir, i);
-        if (dentries == NULL) {
+
+// names on disk aren't null-terminated, so compare using name_len.
+int dentry_matches(dentry_t *d, const char *name) {
+    if (d->inode == 0) return 0; // unused entry
+
+    uint16_t len = strlen(name);
+    if (d->name_len != len) return 0;
+
+    return !memcmp(d->name, name, len);
+}
+
+int chdir(mochi_file current_dir, const char *name, mochi_file *ret_dir) {
+    uint32_t nblocks = dir_n_blocks(&current_dir);
+    uint32_t block_size = dir_block_size(&current_dir);
+
+    for (uint32_t i = 0; i < nblocks; i++) {
+        uint8_t *block = dir_block(&current_dir, i);
+        if (block == NULL) {
             print("null\n");
             return -1;
         }
 
-        for (int i = 0; i < dentries_per_blk; i++) {
-            dentry_t d = dentries[i];
-            if (!strcmp(d.name, name)) {
+        // entries are variable-length, so follow the rec_len chain.
+        uint16_t pos = 0;
+        while (pos < block_size) {
+            dentry_t *d = (dentry_t *) (block + pos);
+            if (d->rec_len == 0) break; // corrupt block. don't spin.
+
+            if (dentry_matches(d, name)) {
                 // this is the match. 
                 mochi_file f = {
-                    .inode = get_inode(d.inode),
-                    .inode_n = d.inode
+                    .inode = get_inode(d->inode),
+                    .inode_n = d->inode
                 };
 
                 *ret_dir = f;
                 return 0;
             }
+            pos += d->rec_len;
         }
-        kfree(dentries);
     }
 
     // we didn't find name. 
     return -1; 
 }
 
-int add_block_to_file(mochi_file *file, uint32_t new_block) {
-    // need to: update inode with new i_blocks
-    // and i_block (and make sure inode table is updated...)
-    file->inode.i_blocks += 2;
+// put new_block at the end of the file (which mustn't have holes). 
+// only the in-memory inode is changed; the caller writes it to the 
+// inode table.
+int append_block(mochi_file *file, uint32_t new_block) {
+    return fill_hole(file, i_block_len(file->inode), new_block);
+}
 
-    // update i_block array
-    uint16_t block_len = i_block_len(file->inode);
+int add_block_to_file(mochi_file *file, uint32_t new_block) {
+    if (append_block(file, new_block)) return -1;
 
-    // writes inode table
-    set_i_block(&(file->inode), file->inode_n, block_len - 1, new_block);
+    write_inode_table(file->inode_n, file->inode);
 
     return 0; 
 }
@@ -587,259 +3366,734 @@ int write_block_at(uint32_t block, uint16_t offset, uint8_t *chunk, uint16_t len
 
 int add_dentry_to_new_block(mochi_file dir, dentry_t d) {
     uint32_t new_block;
-    reserve_free_block(&new_block);
+    if (reserve_file_block(&dir, &new_block)) return -1;
 
     add_block_to_file(&dir, new_block);
 
     // set rec_len to the end of the block
     d.rec_len = S_BLOCK_SIZE;
 
-    return write_block_at(new_block, 0, (uint8_t *) &d, sizeof(dentry_t));
+    uint8_t buf[S_BLOCK_SIZE];
+    memset(buf, 0, S_BLOCK_SIZE);
+    memmove(buf, &d, DENTRY_HDR_LEN + d.name_len);
+
+    return write_file_block(&dir, i_block_len(dir.inode) - 1, buf);
+}
+
+// try to place d in a directory block (block_size long), either in 
+// an unused entry that's big enough, or in the slack at the end of a 
+// live entry (which we split off). returns 0 if block was modified.
+int fit_dentry_in_block(uint8_t *block, uint32_t block_size, dentry_t *d) {
+    uint16_t needed = dentry_rec_len(d->name_len);
+    uint16_t pos = 0;
+
+    while (pos < block_size) {
+        dentry_t *curr = (dentry_t *) (block + pos);
+        if (curr->rec_len == 0) return -1; // corrupt block.
+
+        if (curr->inode == 0 && curr->rec_len >= needed) {
+            // reuse the whole record, so the rec_len chain 
+            // still covers the block.
+            d->rec_len = curr->rec_len;
+            memmove(curr, d, DENTRY_HDR_LEN + d->name_len);
+            return 0;
+        }
+
+        uint16_t used = dentry_rec_len(curr->name_len);
+        if (curr->inode != 0 && curr->rec_len - used >= needed) {
+            // curr keeps what it needs, d takes the rest.
+            d->rec_len = curr->rec_len - used;
+            curr->rec_len = used;
+            memmove(block + pos + used, d, DENTRY_HDR_LEN + d->name_len);
+            return 0;
+        }
+
+        pos += curr->rec_len;
+    }
+
+    return -1;
 }
 
 int add_dentry(mochi_file dir, dentry_t d) {
-    // find the insert point
-    inode_t inode = dir.inode;
-    
-    uint16_t block_len = i_block_len(inode);
+    if (is_inline(&dir.inode)) {
+        if (!fit_dentry_in_block((uint8_t *) dir.inode.i_block, MOCHI_INLINE_DATA_MAX, &d)) {
+            write_inode_table(dir.inode_n, dir.inode);
+            return 0;
+        }
 
-    if (block_len == 0) {
-        return add_dentry_to_new_block(dir, d);
+        // full. it gets a block, with room to spare.
+        if (uninline(&dir)) return -1;
     }
 
-    // at least one block in use. see if the last block is full. 
-    // TODO: if entries are deleted, directory might have 
-    // "holes" in it. 
-    uint8_t *block = get_file_block(dir, block_len - 1); 
-    if (block == NULL) return -1; 
+    uint32_t block_len = i_block_len(dir.inode);
 
-    dentry_t *curr;
-    uint8_t dentries_read = 0;
-    uint16_t pos = 0;
-    uint16_t lastpos;
+    // look for slack in the existing blocks first. 
+    // this also picks up "holes" left by deleted entries.
+    for (uint32_t i = 0; i < block_len; i++) {
+        uint8_t *block = file_block(&dir, i); 
+        if (block == NULL) return -1; 
 
-    while (pos < S_BLOCK_SIZE) {
-        curr = (dentry_t *) (block + pos);
-        lastpos = pos;
-        pos += curr->rec_len;
+        if (!fit_dentry_in_block(block, S_BLOCK_SIZE, &d)) {
+            // write this disk block back.
+            return write_file_block(&dir, i, block);
+        }
+    }
+
+    // no room anywhere (or no blocks yet).
+    return add_dentry_to_new_block(dir, d);
+}
+
+// TODO: just cache this, like we do with superblock.
+mochi_file get_root_dir() {
+    mochi_file f = {
+        .inode = get_inode(EXT2_ROOT_INO),
+        .inode_n = EXT2_ROOT_INO     
+    };
+    return f;
+}
+
+// "/test.txt". small enough to be inline.
+int create_test_file() {
+    int fd = open("/test.txt", O_RDWR | O_CREAT);
+    if (fd < 0) return -1;
+
+    write(fd, "Hi\n", 4);
+    close(fd);
+    return 0;
+}
+
+// print file in root directory. 
+// this is just a test.
+void print_file(const char *fn) {
+    char path[EXT2_NAME_LEN + 2];
+    path[0] = '/';
+    strcpy(path + 1, fn);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+
+    char buf[MOCHI_INLINE_DATA_MAX + 1];
+    int n;
+    while ((n = read(fd, buf, MOCHI_INLINE_DATA_MAX)) > 0) {
+        buf[n] = '\0';
+        print(buf);
+    }
+    close(fd);
+}
+
+int create_root_directory() {
+    // the root directory is always at the same location
+    // in the inode table.
+    uint32_t root_inode_n = EXT2_ROOT_INO;
+
+    // Create a new inode, and update the inode table with it.
+    inode_t new_inode = new_dir_inode();
+
+    reserve_inode(root_inode_n, 1);
+
+    // write to inode table
+    write_inode_table(root_inode_n, new_inode);
+}
+
+
+// find the journal, and replay it if we crashed.
+void journal_load() {
+    if (!(super.s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL)) return;
+
+    mochi_file j;
+    j.inode_n = super.s_journal_inum;
+    j.inode = get_inode(j.inode_n);
+
+    // the log is written with big sequential writes, 
+    // so it has to be one run of blocks.
+    journal_len = i_block_len(j.inode);
+    journal_blk = map_block(&j, 0);
+    for (uint32_t i = 1; i < journal_len; i++) {
+        if (map_block(&j, i) != journal_blk + i) {
+            print("journal: not contiguous, not using it\n");
+            return;
+        }
+    }
+
+    uint8_t buf[S_BLOCK_SIZE];
+    disk_read_blk(journal_blk, buf);
+    jsb = *(journal_superblock_t *) buf;
+    if (jsb.s_header.h_magic != JBD_MAGIC_NUMBER || jsb.s_maxlen != journal_len) {
+        print("journal: bad superblock, not using it\n");
+        return;
+    }
+
+    if (journal_io == NULL) {
+        journal_io = (uint8_t *) kmalloc(JOURNAL_IO_BLOCKS * S_BLOCK_SIZE);
+        if (journal_io == NULL) return;
+    }
+
+    if (journal_recover() > 0) {
+        print("journal: recovered\n");
+        // the replay may have rewritten any of these.
+        drop_bmap_caches();
+        set_superblock();
+        set_bgdt();
+    }
+
+    journal_head = jsb.s_first;
+    journal_seq = jsb.s_sequence;
+    journal_on = 1;
+}
+
+// put a journal in one contiguous run, 
+// near the middle of the disk.
+void create_journal() {
+    uint32_t len = JOURNAL_BLOCKS;
+    uint32_t goal = (n_block_groups / 2) * super.s_blocks_per_group;
+    uint32_t first, got;
+
+    while (1) {
+        if (alloc_blocks(goal, len, &first, &got)) return;
+        if (got == len) break;
+
+        free_blocks(first, got);
+
+        // alloc_blocks takes any run that starts at a free goal. 
+        // the block after this one is used, so it looks for the 
+        // longest run instead.
+        if (goal != first + got) {
+            goal = first + got;
+            continue;
+        }
+
+        // no run that long here. try for less.
+        len /= 2;
+        if (len < JOURNAL_MIN_BLOCKS) {
+            print("journal: no room\n");
+            return;
+        }
+    }
+
+    mochi_file j;
+    j.inode_n = EXT2_JOURNAL_INO;
+    j.inode = new_file_inode();
+    j.inode.i_mode |= EXT2_S_IRUSR | EXT2_S_IWUSR;
+
+    // it starts out empty, but it's never inline.
+    j.inode.i_flags &= ~MOCHI_INLINE_DATA_FL;
+    init_block_map(&j.inode);
+    reserve_inode(j.inode_n, 0);
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (append_block(&j, first + i)) return;
+    }
+    j.inode.i_size = len * S_BLOCK_SIZE;
+    write_inode_table(j.inode_n, j.inode);
+
+    // mkfs doesn't zero anything, and an old log 
+    // there could look like part of this one.
+    uint8_t *zero = (uint8_t *) kcalloc(JOURNAL_IO_BLOCKS, S_BLOCK_SIZE);
+    if (zero == NULL) return;
+    for (uint32_t i = 0; i < len; i += JOURNAL_IO_BLOCKS) {
+        uint32_t n = len - i;
+        if (n > JOURNAL_IO_BLOCKS) n = JOURNAL_IO_BLOCKS;
+        disk_write_blks(first + i, zero, n);
+    }
+    kfree(zero);
+
+    // an empty log.
+    memset(&jsb, 0, sizeof(jsb));
+    jsb.s_header.h_magic = JBD_MAGIC_NUMBER;
+    jsb.s_header.h_blocktype = JBD_SUPERBLOCK_V2;
+    jsb.s_blocksize = S_BLOCK_SIZE;
+    jsb.s_maxlen = len;
+    jsb.s_first = 1;
+    jsb.s_sequence = 1;
+    jsb.s_start = 0;
+    journal_blk = first;
+    journal_write_super();
+
+    super.s_journal_inum = j.inode_n;
+    super.s_feature_compat |= EXT3_FEATURE_COMPAT_HAS_JOURNAL;
+    super_dirty = 1;
+}
+
+/* Consistency check.
+ *
+ * fsck() goes through the inode tables a group at a time, reading 
+ * each one in big sequential runs, and only as far as its last inode 
+ * in use. for every inode in use it walks the block map, marking the 
+ * blocks it finds in a bitmap of its own, and directory blocks in 
+ * another. the directory blocks are then read in disk order, a run 
+ * at a time, and their entries checked. last, the bitmap it built is 
+ * compared with the ones on disk, and the free counts with the bitmaps. 
+ *
+ * the working set is those two bitmaps (a bit per block each) and a 
+ * link count per inode. there's one CPU and the disk driver is 
+ * synchronous, so the groups are checked one after another; 
+ * sequential reads are what keeps it quick. 
+ *
+ * directories have no "." or ".." entries, so every inode in use 
+ * but the root and the journal has exactly one entry pointing at it. 
+ * (a cycle of directories cut off from the root isn't caught.) */
+
+#define FSCK_IO_BLOCKS      64  // inode table blocks per read
+
+static uint32_t *fsck_found = NULL;     // blocks in use, as far as we can tell
+static uint32_t *fsck_dirs = NULL;      // blocks that hold directory entries
+static int16_t *fsck_links = NULL;      // per inode: i_links_count minus entries seen
+static uint8_t *fsck_io = NULL;
+static uint32_t fsck_problems;
+static uint16_t fsck_group_dirs[MAX_BLOCK_GROUPS];  // directories found per group
+
+void fsck_problem(const char *what, uint32_t n) {
+    print("fsck: ");
+    print((char *) what);
+    print(" ");
+    print_int(n);
+    print("\n");
+    fsck_problems++;
+}
+
+uint8_t test_bit(uint32_t *words, uint32_t i) {
+    return (words[i / 32] >> (i % 32)) & 1;
+}
+
+uint8_t inode_in_use(uint32_t inode_n) {
+    uint32_t g = (inode_n - 1) / super.s_inodes_per_group;
+    if (bgdt[g].bg_flags & EXT4_BG_INODE_UNINIT) return 0;
+    return test_bit(inode_bitmap(g)->words, (inode_n - 1) % super.s_inodes_per_group);
+}
+
+// note that blkn belongs to inode_n. returns -1 if it can't.
+int fsck_claim(uint32_t inode_n, uint32_t blkn) {
+    if (blkn == 0 || blkn >= super.s_blocks_count) {
+        fsck_problem("bad block number in inode", inode_n);
+        return -1;
+    }
+    if (test_bit(fsck_found, blkn)) {
+        fsck_problem("block used twice, again by inode", inode_n);
+        return -1;
+    }
+    fsck_found[blkn / 32] |= 1 << (blkn % 32);
+    return 0;
+}
+
+// blkn is 0 for an inline directory's entries.
+void fsck_dir_problem(const char *what, uint32_t blkn, uint32_t inode_n) {
+    print("fsck: ");
+    print((char *) what);
+    if (blkn != 0) {
+        print(" in directory block ");
+        print_int(blkn);
+    } else {
+        print(" in inline directory ");
+        print_int(inode_n);
+    }
+    print("\n");
+    fsck_problems++;
+}
+
+// the entries in one directory block, or in an inline 
+// directory's i_block (with blkn 0).
+void fsck_dir_entries(uint8_t *buf, uint32_t len, uint32_t blkn, uint32_t inode_n) {
+    uint32_t pos = 0;
+    while (pos < len) {
+        dentry_t *d = (dentry_t *) (buf + pos);
+        if (d->rec_len < DENTRY_HDR_LEN || d->rec_len % 4 != 0 || 
+                pos + d->rec_len > len || 
+                DENTRY_HDR_LEN + d->name_len > d->rec_len) {
+            fsck_dir_problem("bad entry", blkn, inode_n);
+            return;
+        }
+
+        if (d->inode != 0) {
+            if (d->inode > super.s_inodes_count) {
+                fsck_dir_problem("entry past the last inode", blkn, inode_n);
+            } else if (!inode_in_use(d->inode)) {
+                fsck_dir_problem("entry for a free inode", blkn, inode_n);
+            } else {
+                fsck_links[d->inode - 1]--;
+            }
+        }
+        pos += d->rec_len;
+    }
+}
+
+// one data block of inode_n.
+void fsck_data(uint32_t inode_n, inode_t *inode, uint32_t blkn, uint32_t *n_data) {
+    if (fsck_claim(inode_n, blkn)) return;
+    (*n_data)++;
+
+    // (read later, in disk order.)
+    if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+        fsck_dirs[blkn / 32] |= 1 << (blkn % 32);
+    }
+}
+
+// blkn is an indirect block with level levels of them below it 
+// (or a data block, if level is 0).
+void fsck_ind(uint32_t inode_n, inode_t *inode, uint32_t blkn, int level, uint32_t *n_data) {
+    if (level == 0) {
+        fsck_data(inode_n, inode, blkn, n_data);
+        return;
+    }
+    if (fsck_claim(inode_n, blkn)) return;
+
+    uint32_t ind[S_BLOCK_SIZE / sizeof(uint32_t)];
+    meta_read_blk(blkn, (uint8_t *) ind);
+    for (uint32_t k = 0; k < S_BLOCK_SIZE / sizeof(uint32_t); k++) {
+        if (ind[k] != 0) fsck_ind(inode_n, inode, ind[k], level - 1, n_data);
+    }
+}
+
+void fsck_ext(uint32_t inode_n, inode_t *inode, ext4_extent_header *h, 
+        uint32_t node_size, uint32_t *n_data) {
+    uint32_t max = (node_size - sizeof(ext4_extent_header)) / sizeof(ext4_extent);
+    if (h->eh_magic != EXT4_EXT_MAGIC || h->eh_entries > max || h->eh_depth > 4) {
+        fsck_problem("bad extent node in inode", inode_n);
+        return;
+    }
+
+    if (h->eh_depth > 0) {
+        uint8_t buf[S_BLOCK_SIZE];
+        for (uint32_t k = 0; k < h->eh_entries; k++) {
+            uint32_t blkn = ext_indexes(h)[k].ei_leaf_lo;
+            if (fsck_claim(inode_n, blkn)) continue;
+
+            meta_read_blk(blkn, buf);
+            ext4_extent_header *child = (ext4_extent_header *) buf;
+            if (child->eh_depth != h->eh_depth - 1) {
+                fsck_problem("extent tree depth wrong in inode", inode_n);
+                continue;
+            }
+            fsck_ext(inode_n, inode, child, S_BLOCK_SIZE, n_data);
+        }
+        return;
+    }
+
+    for (uint32_t k = 0; k < h->eh_entries; k++) {
+        ext4_extent *e = &ext_leaves(h)[k];
+        for (uint32_t b = 0; b < ext_len(e); b++) {
+            fsck_data(inode_n, inode, e->ee_start_lo + b, n_data);
+        }
+    }
+}
+
+void fsck_inode(uint32_t inode_n, inode_t *inode) {
+    if (inode->i_mode == 0 || inode->i_links_count == 0) {
+        fsck_problem("nothing in (but marked in use) inode", inode_n);
+        return;
+    }
+    fsck_links[inode_n - 1] += inode->i_links_count;
+    if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) fsck_group_dirs[inode_group(inode_n)]++;
+
+    if (inode->i_flags & MOCHI_INLINE_DATA_FL) {
+        if (inode->i_blocks != 0 || (inode->i_flags & EXT4_EXTENTS_FL)) {
+            fsck_problem("blocks as well as inline data in inode", inode_n);
+        }
+        if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+            fsck_dir_entries((uint8_t *) inode->i_block, MOCHI_INLINE_DATA_MAX, 0, inode_n);
+        } else if (inode->i_size > MOCHI_INLINE_DATA_MAX) {
+            fsck_problem("size past the inline data of inode", inode_n);
+        }
+        return;
+    }
 
-        dentries_read++;
+    uint32_t n_data = 0;
+    if (inode->i_flags & EXT4_EXTENTS_FL) {
+        fsck_ext(inode_n, inode, ext_root(inode), sizeof(inode->i_block), &n_data);
+    } else {
+        for (int k = 0; k < 12; k++) {
+            if (inode->i_block[k] != 0) fsck_ind(inode_n, inode, inode->i_block[k], 0, &n_data);
+        }
+        for (int level = 1; level <= IND_LEVELS; level++) {
+            uint32_t blkn = inode->i_block[11 + level];
+            if (blkn != 0) fsck_ind(inode_n, inode, blkn, level, &n_data);
+        }
     }
 
-    if (dentries_read >= S_BLOCK_SIZE / sizeof(dentry_t)) {
-        // we can't fit another dentry in this block.
-        return add_dentry_to_new_block(dir, d);
+    if (n_data != i_block_len(*inode)) {
+        fsck_problem("i_blocks doesn't match the block map of inode", inode_n);
     }
+    // (a file can have fewer, with holes.)
+    if (n_data > file_blocks(inode)) {
+        fsck_problem("blocks past the size of inode", inode_n);
+    }
+}
 
-    // we can fit another dentry in this block.
+// the inodes in use in group_n.
+void fsck_group_inodes(uint32_t group_n) {
+    if (bgdt[group_n].bg_flags & EXT4_BG_INODE_UNINIT) return;
 
-    // modify the last dentry, if it exists.
-    // it will still be pointing to the end of the block, 
-    // and we don't want that. 
-    if (dentries_read > 0) {
-        curr->rec_len = sizeof(dentry_t); 
-    }
+    uint32_t *words = inode_bitmap(group_n)->words;
+    uint32_t ipg = super.s_inodes_per_group;
+    uint32_t per_block = S_BLOCK_SIZE / sizeof(inode_t);
 
-    dentry_t *new_dentry = curr + 1;
-    *new_dentry = d;
+    // how much of the table to read.
+    uint32_t last = ipg;
+    while (last > 0 && !test_bit(words, last - 1)) last--;
+    uint32_t n_blocks = (last + per_block - 1) / per_block;
 
-    // update rec_len to appropriately point to the end of the block
-    // from the start of this dentry.
-    new_dentry->rec_len = S_BLOCK_SIZE - dentries_read * sizeof(dentry_t);
+    for (uint32_t b = 0; b < n_blocks; b += FSCK_IO_BLOCKS) {
+        uint32_t n = n_blocks - b;
+        if (n > FSCK_IO_BLOCKS) n = FSCK_IO_BLOCKS;
 
-    // write this disk block back.
+        uint32_t blkn = bgdt[group_n].bg_inode_table + b;
+        disk_read_blks(blkn, fsck_io, n);
+        journal_overlay(blkn, fsck_io, n);
 
-    uint32_t fblock_n = get_data_block_n(dir.inode, block_len - 1);
-   
-    disk_write_blk(fblock_n, block);
+        for (uint32_t i = b * per_block; i < (b + n) * per_block && i < last; i++) {
+            if (!test_bit(words, i)) continue;
 
-    return 0;
+            inode_t *inode = (inode_t *) (fsck_io + (i - b * per_block) * sizeof(inode_t));
+            fsck_inode(group_n * ipg + i + 1, inode);
+        }
+    }
 }
 
-// TODO: just cache this, like we do with superblock.
-mochi_file get_root_dir() {
-    mochi_file f = {
-        .inode = get_inode(EXT2_ROOT_INO),
-        .inode_n = EXT2_ROOT_INO     
-    };
-    return f;
+// every directory block, a run of them per read.
+void fsck_dir_blocks() {
+    uint32_t end = n_block_groups * super.s_blocks_per_group;
+    uint32_t blkn = next_set_bit(fsck_dirs, 0, end);
+    while (blkn < end) {
+        uint32_t n = next_zero_bit(fsck_dirs, blkn, end) - blkn;
+        if (n > FSCK_IO_BLOCKS) n = FSCK_IO_BLOCKS;
+
+        disk_read_blks(blkn, fsck_io, n);
+        journal_overlay(blkn, fsck_io, n);
+        for (uint32_t i = 0; i < n; i++) {
+            fsck_dir_entries(fsck_io + i * S_BLOCK_SIZE, S_BLOCK_SIZE, blkn + i, 0);
+        }
+        blkn = next_set_bit(fsck_dirs, blkn + n, end);
+    }
 }
 
-// deprecate! use a generic mkfile thing. 
-// "/test.txt"
-int create_test_file() {
-    char *fn = "test.txt";
-    uint8_t flen = 9; 
-    uint8_t dlen = 4;
-
-    char data[dlen];
-    data[0] = 'H';
-    data[1] = 'i';
-    data[2] = '\n';
-    data[3] = '\0';
-
-    // reserve a free block and free inode
-    uint32_t free_block_n, free_inode_n;
-    if (first_free_block_num(&free_block_n)) {
-        print("No free blocks available.\n");
-        return -1;
+// compare group_n's block bitmap with what we found, 
+// and its free counts with its bitmaps.
+void fsck_group_counts(uint32_t group_n, uint8_t fix) {
+    uint32_t bpg = super.s_blocks_per_group;
+    uint32_t *found = fsck_found + group_n * bpg / 32;
+    bitmap_cache *bm = block_bitmap(group_n);
+
+    uint32_t n_free = 0;
+    uint8_t differs = 0;
+    for (uint32_t i = 0; i < group_n_blocks(group_n); i++) {
+        uint8_t used = test_bit(found, i);
+        if (used != test_bit(bm->words, i)) differs = 1;
+        if (!used) n_free++;
     }
-
-    if (first_free_inode_num(&free_inode_n)) {
-        print("No free inodes available.\n");
-        return -1;
+    if (differs) {
+        fsck_problem("block bitmap wrong in group", group_n);
+        if (fix) {
+            memmove(bm->words, found, bpg / 8);
+            bm->first_free = 0;
+            bm->dirty = 1;
+        }
+    }
+    if (n_free != bgdt[group_n].bg_free_blocks_count) {
+        fsck_problem("free block count wrong in group", group_n);
+        if (fix) bgdt[group_n].bg_free_blocks_count = n_free;
     }
 
-    // create file inode, etc.
-    inode_t n = { 0 };
-    n.i_mode = EXT2_S_IFREG;
-    n.i_size = 4;
-    n.i_blocks = 2; // ~wasteful~
-    n.i_block[0] = free_block_n;
+    uint32_t n_free_inodes = super.s_inodes_per_group;
+    if (!(bgdt[group_n].bg_flags & EXT4_BG_INODE_UNINIT)) {
+        uint32_t *words = inode_bitmap(group_n)->words;
+        for (uint32_t i = 0; i < super.s_inodes_per_group; i++) {
+            if (test_bit(words, i)) n_free_inodes--;
+        }
+    }
+    if (n_free_inodes != bgdt[group_n].bg_free_inodes_count) {
+        fsck_problem("free inode count wrong in group", group_n);
+        if (fix) bgdt[group_n].bg_free_inodes_count = n_free_inodes;
+    }
 
-    write_inode_table(free_inode_n, n);
+    if (fsck_group_dirs[group_n] != bgdt[group_n].bg_used_dirs_count) {
+        fsck_problem("directory count wrong in group", group_n);
+        if (fix) bgdt[group_n].bg_used_dirs_count = fsck_group_dirs[group_n];
+    }
+}
 
-    set_inode_bitmap(free_inode_n);
+void drop_fsck() {
+    if (fsck_found != NULL) kfree(fsck_found);
+    if (fsck_dirs != NULL) kfree(fsck_dirs);
+    if (fsck_links != NULL) kfree(fsck_links);
+    if (fsck_io != NULL) kfree(fsck_io);
+    fsck_found = NULL;
+    fsck_dirs = NULL;
+    fsck_links = NULL;
+    fsck_io = NULL;
+}
 
-    set_block_bitmap(free_block_n);
+uint32_t fsck(uint8_t fix) {
+    if (!fs_start_set) return 0;
 
-    // add a "directory entry" in the root directory. 
-    dentry_t d = {
-        .inode = free_inode_n,
-        .rec_len = S_BLOCK_SIZE, // rec_len needs to point to end of block
-        // since it's the last entry. 
-        .name_len = flen,
-        .file_type = EXT2_FT_DIR };
+    // preallocated blocks are marked used without belonging to 
+    // anyone. give them back, and get everything onto the disk.
+    discard_all_prealloc();
+    fs_sync();
 
-    strcpy(d.name, fn);
+    uint32_t bpg = super.s_blocks_per_group;
+    fsck_found = (uint32_t *) kcalloc(n_block_groups, bpg / 8);
+    fsck_dirs = (uint32_t *) kcalloc(n_block_groups, bpg / 8);
+    fsck_links = (int16_t *) kcalloc(super.s_inodes_count, sizeof(int16_t));
+    fsck_io = (uint8_t *) kmalloc(FSCK_IO_BLOCKS * S_BLOCK_SIZE);
+    if (fsck_found == NULL || fsck_dirs == NULL || fsck_links == NULL || fsck_io == NULL) {
+        print("fsck: out of memory\n");
+        drop_fsck();
+        return 0;
+    }
+    fsck_problems = 0;
+    memset(fsck_group_dirs, 0, sizeof(fsck_group_dirs));
 
-    // put the dentry d in the directory file!
-    mochi_file root = get_root_dir();
+    // the groups' own metadata is in use. 
+    for (uint32_t g = 0; g < n_block_groups; g++) {
+        bitmap_cache meta = { .words = fsck_found + g * bpg / 32 };
+        init_block_bitmap(g, &meta);
+    }
 
-    // for our test file, we can write to the first block~
+    // nothing points at these two.
+    if (!inode_in_use(EXT2_ROOT_INO)) fsck_problem("root directory not in use: inode", EXT2_ROOT_INO);
+    fsck_links[EXT2_ROOT_INO - 1]--;
+    if (super.s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL) {
+        fsck_links[super.s_journal_inum - 1]--;
+    }
 
-    // write to the directory file.
-    uint32_t data_block_n = root.inode.i_block[0];
+    for (uint32_t g = 0; g < n_block_groups; g++) fsck_group_inodes(g);
+    fsck_dir_blocks();
 
-    // TODO: fix disk_write_blk
-    // so we don't have to read the whole thing
-    disk_write_bn(data_block_n, (uint8_t *) &d, sizeof(d));
+    for (uint32_t n = 1; n <= super.s_inodes_count; n++) {
+        if (fsck_links[n - 1] != 0 && inode_in_use(n)) {
+            fsck_problem("link count wrong for inode", n);
+        }
+    }
 
-    // write the data (finally) to the actual file!
-    disk_write_bn(free_block_n, (uint8_t *) data, dlen);
+    uint32_t free_blocks = 0;
+    uint32_t free_inodes = 0;
+    for (uint32_t g = 0; g < n_block_groups; g++) {
+        fsck_group_counts(g, fix);
+        free_blocks += bgdt[g].bg_free_blocks_count;
+        free_inodes += bgdt[g].bg_free_inodes_count;
+    }
+    if (free_blocks != super.s_free_blocks_count) {
+        fsck_problem("superblock free block count wrong:", super.s_free_blocks_count);
+    }
+    if (free_inodes != super.s_free_inodes_count) {
+        fsck_problem("superblock free inode count wrong:", super.s_free_inodes_count);
+    }
 
-    // add to inode table in free place
-    update_inode_bg_desc(free_inode_n);
-    update_block_bg_desc(free_block_n);
-    disk_sync_bgdt();
+    if (fix && fsck_problems > 0) {
+        super.s_free_blocks_count = free_blocks;
+        super.s_free_inodes_count = free_inodes;
+        super_dirty = 1;
+        bgdt_dirty = 1;
+        fs_sync();
+    }
 
-    // update the block group descriptor that the block belongs to.
-    // update the superblock. 
-    super.s_free_blocks_count -= 1;
-    super.s_free_inodes_count -= 1;
-    disk_sync_super();
+    drop_fsck();
+    return fsck_problems;
 }
 
-// print file in root directory. 
-// this is just a test.
-void print_file(const char *fn) {
-    mochi_file root = get_root_dir();
-    // read from directory
-    uint32_t data_block_n = root.inode.i_block[0];
-
-    uint8_t buf[S_BLOCK_SIZE];
-    disk_read_blk(data_block_n, (uint8_t *) buf);
+/* Mounting.
+ *
+ * EXT2_VALID_FS is set in s_state only while the filesystem isn't 
+ * in use: mounting clears it on disk, and umount_fs() sets it again 
+ * once everything's written out. finding it clear at mount time 
+ * means we went down without unmounting. */
 
-    dentry_t *d = (dentry_t *) buf;
+// could we make sense of the filesystem described by b?
+uint8_t super_usable(superblock_t *b) {
+    if (b->s_magic != EXT2_SUPER_MAGIC) return 0;
 
-    if(!strcmp((const char *) d->name, fn)) {
-        // this is the entry we want!
+    // stack buffers and the page cache assume at most 4kb blocks.
+    if (b->s_log_block_size > 2) return 0;
 
-        // get the inode
-        uint32_t inode_n = d->inode;
-        inode_t ind = get_inode(inode_n);
+    if (b->s_blocks_per_group == 0 || b->s_inodes_per_group == 0) return 0;
 
-        data_block_n = ind.i_block[0];
-        uint8_t bufb[S_BLOCK_SIZE];
+    uint32_t n_groups = (b->s_blocks_count + b->s_blocks_per_group - 1) 
+        / b->s_blocks_per_group;
+    if (n_groups == 0 || n_groups > MAX_BLOCK_GROUPS) return 0;
 
-        // should be...
-        disk_read_blk(data_block_n, (uint8_t *) bufb);
-    
-        uint8_t fdata[ind.i_size];
-        for (int i = 0; i < ind.i_size; i++) {
-            fdata[i] = bufb[i];
-        }
-        print((char *) fdata);
-    }
+    if (b->s_feature_incompat & ~MOCHI_FEATURE_INCOMPAT_SUPP) return 0;
+    if (b->s_feature_ro_compat & ~MOCHI_FEATURE_RO_COMPAT_SUPP) return 0;
+    return 1;
 }
 
-int create_root_directory() {
-    // the root directory is always at the same location
-    // in the inode table.
-    uint32_t root_inode_n = EXT2_ROOT_INO;
-
-    // Create a new inode, and update the inode table with it.
-    inode_t new_inode = new_dir_inode();
+// note on disk that the filesystem is in use.
+void mark_mounted() {
+    super.s_state &= ~EXT2_VALID_FS;
+    super.s_mnt_count++;
+    super_dirty = 1;
+    fs_commit();
+}
 
-    reserve_inode(root_inode_n);
+int mount_fs(uint32_t mb_start) {
+    // look before read_fs() trusts any of it.
+    superblock_t b;
+    disk_read_sectors(fs_start_to_lba_superblk(mb_start), (uint8_t *) &b, 
+            sizeof(superblock_t) / DISK_SECTOR_SIZE);
+    if (!super_usable(&b)) return -1;
 
-    // write to inode table
-    write_inode_table(root_inode_n, new_inode);
-}
+    // only the superblock and BGDT are read here (and the journal, 
+    // if it needs replaying). bitmaps and inodes are read on demand, 
+    // so this doesn't take longer on a bigger disk.
+    read_fs(mb_start);
 
+    if (!(super.s_state & EXT2_VALID_FS)) {
+        if (journal_on) {
+            print("fs: not cleanly unmounted; the journal covers it.\n");
+        } else {
+            print("fs: not cleanly unmounted, and there's no journal.\n");
+        }
+    }
 
-void set_initial_used_blocks() {
-    // how many blocks for inode table, in each block group?
-    uint16_t inodes_per_block = S_BLOCK_SIZE / sizeof(inode_t);
-    uint32_t inode_table_blocks = super.s_inodes_per_group / inodes_per_block;
+    // without a journal to replay, an unclean filesystem 
+    // may need fixing. and every so often, check anyway.
+    uint8_t check = !(super.s_state & EXT2_VALID_FS) && !journal_on;
+    int16_t max_mnt = (int16_t) super.s_max_mnt_count;
+    if (max_mnt > 0 && super.s_mnt_count >= max_mnt) check = 1;
 
-    uint32_t bpg = super.s_blocks_per_group;
+    if (check) {
+        print("fs: checking.\n");
+        fsck(1);
+        super.s_mnt_count = 0;
+    }
 
-    // set for block group 1 + 2
-    uint16_t boot_offset = 1;
-    uint16_t super_bgdt_offset = 2; // superblock, bgdt
-    uint16_t bitmap_offset = 2;
+    mark_mounted();
+    return 0;
+}
 
-    // boot
-    set_block_bitmap(0);
+void umount_fs() {
+    if (!fs_start_set) return;
 
-    // superblock + backup
-    set_block_bitmap(1);
-    set_block_bitmap(1 + bpg);
+    // fs_sync() checkpoints, so the log is empty 
+    // and the home locations are up to date.
+    discard_all_prealloc();
+    super.s_state |= EXT2_VALID_FS;
+    super_dirty = 1;
+    fs_sync();
 
-    // bgdt + backup
-    set_block_bitmap(2);
-    set_block_bitmap(2 + bpg);
-   
-    // mark the bitmaps + inode table blocks, for each block group. 
-    for (int i = 0; i < bitmap_offset + inode_table_blocks; i++) {
-        // block group 1
-        set_block_bitmap(boot_offset + super_bgdt_offset + i);
-        // block group 2
-        set_block_bitmap(boot_offset + super_bgdt_offset + bpg + i);
-        // block group 3
-        set_block_bitmap(boot_offset + 2*bpg + i);
-    }
+    fs_start_set = 0;
 }
 
-
 void finish_fs_init(uint32_t mb_start) {
     // read the metadata into our "local" variables.
+    // (the bitmaps don't need setting up: see init_block_bitmap.)
     read_fs(mb_start);
 
-    set_initial_used_blocks();
-
     create_root_directory();
 
+    create_journal();
+
+    fs_sync();
+
+    journal_load();
+
+    // mkfs leaves it clean. we're using it now, though.
+    mark_mounted();
 }
 
 void test_fs() {
-    // deprecate. make a "mkfile" function, 
-    // that doesn't assume directory, etc.
-//    create_test_file();
+    create_test_file();
 
     // test!
-//    print_file("test.txt");
+    print_file("test.txt");
 
     mkdir("/usr");
 
@@ -848,12 +4102,14 @@ void test_fs() {
 
     rmdir("/usr/hi");
 
+    fs_sync();
+
     print("test_fs finished.\n");
 }
 
 int split_path(const char *usr_path, mochi_file *parent, char *leaf) {
     // copy the path right away, so strtok doesn't corrupt it.
-    char path[strlen(usr_path)];
+    char path[strlen(usr_path) + 1];
     strcpy(path, usr_path);
 
     char *next_dirname = strtok(path, "/");
@@ -862,10 +4118,17 @@ int split_path(const char *usr_path, mochi_file *parent, char *leaf) {
 
     next_dirname = strtok(NULL, "/");
 
-    char *following_dirname = strtok(NULL, "/");
-
     mochi_file curr_dir = get_root_dir();
 
+    // just "/". the leaf is empty, and the root is its own parent.
+    if (next_dirname == NULL) {
+        leaf[0] = '\0';
+        *parent = curr_dir;
+        return 0;
+    }
+
+    char *following_dirname = strtok(NULL, "/");
+
     mochi_file next_dir;
     while (following_dirname != NULL) {
         // failed to change directory
@@ -884,39 +4147,45 @@ int split_path(const char *usr_path, mochi_file *parent, char *leaf) {
     return 0;
 }
 
+// print the names in the directory at path, one per line.
 int ls(char *path) {
-    mochi_file parent_dir;
-    char leaf[64];
-    split_path(path, &parent_dir, leaf);
-    mochi_file leaf_dir;
-    chdir(parent_dir, leaf, &leaf_dir);
-
-    // list all files in leaf_directory
-    uint32_t block_len = i_block_len(leaf_dir.inode);
-    for (uint32_t i = 0; i < block_len; i++) {
-        // read the block
-        uint8_t *block = get_file_block(leaf_dir, i);
-
-        kfree(block); 
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    uint32_t buf[128];
+    int n;
+    while ((n = getdents(fd, (mochi_dirent *) buf, sizeof(buf))) > 0) {
+        for (int pos = 0; pos < n; ) {
+            mochi_dirent *d = (mochi_dirent *) ((uint8_t *) buf + pos);
+            print(d->d_name);
+            print("\n");
+            pos += d->d_reclen;
+        }
     }
+
+    close(fd);
+    return (n < 0) ? -1 : 0;
 }
 
 int mkdir(char *path) {
     mochi_file parent_dir;
-    char new_dirname[64];
+    char new_dirname[EXT2_NAME_LEN + 1];
     if (split_path(path, &parent_dir, new_dirname)) return -1;
+    if (new_dirname[0] == '\0') return -1;
 
     // looks good here!!
     print("mkdir: ");
     print(new_dirname);
     print("\n");
 
-    uint32_t new_inode_n, new_block_n;
-    reserve_free_inode(&new_inode_n);
-    reserve_free_block(&new_block_n);
+    // the inode's group is picked by reserve_free_inode (see 
+    // "Inode placement"). the directory's first block is allocated 
+    // when it outgrows its inode, next to the inode table.
+    uint32_t new_inode_n;
+    if (reserve_free_inode(&parent_dir, 1, &new_inode_n)) return -1;
 
     // Create a new inode, and update the inode table with it.
-    inode_t new_inode = new_dir_inode(new_block_n);
+    inode_t new_inode = new_dir_inode();
 
     // write to inode table
     write_inode_table(new_inode_n, new_inode);
@@ -924,7 +4193,7 @@ int mkdir(char *path) {
     // add a dentry for this new directory
     dentry_t d = {
         .inode = new_inode_n,
-        .rec_len = sizeof(dentry_t),
+        .rec_len = dentry_rec_len(strlen(new_dirname)),
         .name_len = strlen(new_dirname),
         .file_type = EXT2_FT_DIR,
     };
@@ -932,13 +4201,20 @@ int mkdir(char *path) {
     // copy the name
     strcpy(d.name, new_dirname);
 
-    // add directory entry to parent directory
-    add_dentry(parent_dir, d);
+    // add directory entry to parent directory. 
+    // (the new one has no blocks yet, so the inode is all there is to undo.)
+    if (add_dentry(parent_dir, d)) {
+        release_inode(new_inode_n, 1);
+        return -1;
+    }
+
+    commit_if_due();
+    return 0;
 }
 
 int rmdir(char *path) {
     mochi_file parent_dir;
-    char target_dirname[64];
+    char target_dirname[EXT2_NAME_LEN + 1];
     print("\nin rmdir\n");
     print("received path: "); print(path); print("\n");
     if (split_path(path, &parent_dir, target_dirname)) return -1;
@@ -948,3 +4224,666 @@ int rmdir(char *path) {
     print("\n");
 }
 
+
+/* Files.
+ *
+ * open() puts the file in the file table, and the fd is its index. 
+ * both read() and write() go through the page cache (see "Page cache"). 
+ * read() copies out of cached pages. whole pages it doesn't have are 
+ * read straight into the caller's buffer, a run at a time, and then 
+ * copied into the cache. write() copies into pages and marks them 
+ * dirty, reserving blocks for any that have none (see "Delayed 
+ * allocation"). the blocks are picked, and the data goes to the disk, 
+ * when the pages are written back. 
+ * a small file lives in its inode instead (see "Inline data"), and 
+ * read() and write() just copy to and from that. */
+
+static FILE file_table[MAX_OPEN_FILES];
+
+FILE *get_open_file(int fd) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES) return NULL;
+    if (!file_table[fd].in_use) return NULL;
+    return &file_table[fd];
+}
+
+// give every open copy of file's inode the one in file. 
+// (write_inode_table() does this for every inode it writes.)
+void update_open_files(mochi_file *file) {
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        FILE *f = &file_table[fd];
+        if (f->in_use && f->file.inode_n == file->inode_n) f->file.inode = file->inode;
+    }
+}
+
+// make an empty regular file called name in dir.
+int create_file(mochi_file dir, const char *name, mochi_file *ret) {
+    uint32_t inode_n;
+    if (reserve_free_inode(&dir, 0, &inode_n)) return -1;
+
+    inode_t inode = new_file_inode();
+    write_inode_table(inode_n, inode);
+
+    dentry_t d = {
+        .inode = inode_n,
+        .rec_len = dentry_rec_len(strlen(name)),
+        .name_len = strlen(name),
+        .file_type = EXT2_FT_REG_FILE,
+    };
+    strcpy(d.name, name);
+
+    if (add_dentry(dir, d)) {
+        release_inode(inode_n, 0);
+        return -1;
+    }
+
+    ret->inode = inode;
+    ret->inode_n = inode_n;
+    return 0;
+}
+
+int open(const char *pathname, int flags) {
+    int fd = 0;
+    while (fd < MAX_OPEN_FILES && file_table[fd].in_use) fd++;
+    if (fd == MAX_OPEN_FILES) return -1;
+
+    mochi_file dir, file;
+    char name[EXT2_NAME_LEN + 1];
+    if (split_path(pathname, &dir, name)) return -1;
+
+    if (name[0] == '\0') {
+        file = dir; // "/"
+    } else if (chdir(dir, name, &file)) {
+        if (!(flags & O_CREAT)) return -1;
+        if (create_file(dir, name, &file)) return -1;
+    }
+
+    FILE *f = &file_table[fd];
+    f->file = file;
+    f->offset = 0;
+    f->flags = flags;
+    f->in_use = 1;
+    return fd;
+}
+
+int read(int fd, void *buf, uint32_t count) {
+    FILE *f = get_open_file(fd);
+    if (f == NULL || (f->flags & O_ACCMODE) == O_WRONLY) return -1;
+
+    mochi_file *file = &f->file;
+    uint32_t size = file_size(file);
+    if (f->offset >= size) return 0;
+    if (count > size - f->offset) count = size - f->offset;
+
+    if (is_inline(&file->inode)) {
+        memmove(buf, (uint8_t *) file->inode.i_block + f->offset, count);
+        f->offset += count;
+        return count;
+    }
+
+    uint8_t *dst = (uint8_t *) buf;
+    uint32_t done = 0;
+
+    while (done < count) {
+        uint32_t pos = f->offset + done;
+        uint32_t index = pos / PAGE_SIZE;
+        uint32_t in_pg = pos % PAGE_SIZE;
+        uint32_t left = count - done;
+
+        cpage *p = pcache_find(file->inode_n, index);
+
+        if (p == NULL && in_pg == 0 && left >= PAGE_SIZE) {
+            // whole pages we don't have. read as many as we can 
+            // straight into buf, in as few requests as we can, 
+            // then keep copies.
+            uint32_t n = 1;
+            while (n < left / PAGE_SIZE && pcache_find(file->inode_n, index + n) == NULL) {
+                n++;
+            }
+            read_file_blocks(file, index * blocks_per_page(), n * blocks_per_page(), dst + done);
+
+            for (uint32_t k = 0; k < n; k++) {
+                cpage *copy = pcache_add(file->inode_n, index + k);
+                if (copy == NULL) break;
+                memmove(copy->data, dst + done + k * PAGE_SIZE, PAGE_SIZE);
+            }
+            done += n * PAGE_SIZE;
+            continue;
+        }
+
+        if (p == NULL) p = pcache_get(file, index, file_blocks(&file->inode));
+        if (p == NULL) return -1;
+
+        uint32_t len = PAGE_SIZE - in_pg;
+        if (len > left) len = left;
+        memmove(dst + done, p->data + in_pg, len);
+        done += len;
+    }
+
+    f->offset += count;
+    return count;
+}
+
+int write(int fd, const void *buf, uint32_t count) {
+    FILE *f = get_open_file(fd);
+    if (f == NULL || (f->flags & O_ACCMODE) == O_RDONLY) return -1;
+
+    // directories only change through mkdir and friends.
+    mochi_file *file = &f->file;
+    if ((file->inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFREG) return -1;
+    if (count == 0) return 0;
+    if (f->flags & O_APPEND) f->offset = file_size(file);
+    if (f->offset + count < f->offset) return -1; // past 4gb
+
+    if (is_inline(&file->inode)) {
+        if (f->offset + count <= MOCHI_INLINE_DATA_MAX) {
+            memmove((uint8_t *) file->inode.i_block + f->offset, buf, count);
+            if (f->offset + count > file->inode.i_size) {
+                file->inode.i_size = f->offset + count;
+            }
+            write_inode_table(file->inode_n, file->inode);
+
+            f->offset += count;
+            commit_if_due();
+            return count;
+        }
+        if (uninline(file)) return -1;
+    }
+
+    // no blocks are picked here (see "Delayed allocation"), and 
+    // the inode stays as it is until the pages are written back.
+    uint32_t old_size = file_size(file);
+    grow_delayed(file, f->offset + count);
+
+    uint8_t *src = (uint8_t *) buf;
+    uint32_t done = 0;
+
+    while (done < count) {
+        uint32_t pos = f->offset + done;
+        uint32_t index = pos / PAGE_SIZE;
+        uint32_t in_pg = pos % PAGE_SIZE;
+
+        uint32_t len = PAGE_SIZE - in_pg;
+        if (len > count - done) len = count - done;
+
+        uint8_t fresh = 0;
+        cpage *p = pcache_find(file->inode_n, index);
+        if (p == NULL && len == PAGE_SIZE) {
+            // all of it is being replaced; no need to read it.
+            p = pcache_add(file->inode_n, index);
+            fresh = 1;
+        } else if (p == NULL) {
+            // blocks that aren't on disk yet have nothing worth reading.
+            p = pcache_get(file, index, file_blocks(&file->inode));
+        }
+        if (p == NULL) break;
+
+        // only the blocks written to get one. the rest of 
+        // the page can stay a hole.
+        uint32_t first_blk = pos / S_BLOCK_SIZE;
+        uint32_t end_blk = (pos + len - 1) / S_BLOCK_SIZE + 1;
+        if (reserve_blocks(file, p, first_blk, end_blk)) {
+            // nothing worth keeping in it.
+            if (fresh) pcache_free_page(p);
+            break;
+        }
+
+        memmove(p->data + in_pg, src + done, len);
+        pcache_mark_dirty(p);
+        done += len;
+    }
+
+    f->offset += done;
+    if (done < count) {
+        // ran out of memory or space partway. 
+        // the size only covers what we wrote.
+        delayed_file *d = find_delayed(file->inode_n);
+        if (d != NULL) d->size = (f->offset > old_size) ? f->offset : old_size;
+    }
+
+    balance_dirty();
+    commit_if_due();
+    if (done == 0) return -1;
+    return done;
+}
+
+int lseek(int fd, int32_t offset, int whence) {
+    FILE *f = get_open_file(fd);
+    if (f == NULL) return -1;
+
+    // (in 64 bits: a file can be bigger than an int32_t.)
+    int64_t base;
+    if (whence == SEEK_SET) {
+        base = 0;
+    } else if (whence == SEEK_CUR) {
+        base = f->offset;
+    } else if (whence == SEEK_END) {
+        base = file_size(&f->file);
+    } else {
+        return -1;
+    }
+
+    // it has to fit in what we return.
+    int64_t pos = base + offset;
+    if (pos < 0 || pos > INT32_MAX) return -1;
+
+    f->offset = pos;
+    return f->offset;
+}
+
+// give logical blocks [i, i + n) of file, which are all holes,
+// unwritten extents, in as few runs as it takes. -1 if we run out.
+int alloc_unwritten(mochi_file *file, uint32_t i, uint32_t n) {
+    while (n > 0) {
+        uint32_t want = n;
+        if (want > ext_max_len(1)) want = ext_max_len(1);
+
+        uint32_t first, got;
+        if (alloc_blocks(find_goal(file, i), want, &first, &got)) return -1;
+
+        ext4_extent x = { .ee_block = i, .ee_start_lo = first };
+        ext_set_len(&x, got, 1);
+        if (ext_add(&file->inode, file->inode_n, &x)) {
+            free_blocks(first, got);
+            return -1;
+        }
+
+        file->inode.i_blocks += got * (2 << super.s_log_block_size);
+        i += got;
+        n -= got;
+    }
+    return 0;
+}
+
+// reserve blocks for bytes [offset, offset + len) of the file,
+// growing it to cover them. the new blocks are unwritten, so
+// they read as zeroes. the bitmaps and the inode are only
+// changed in memory, and go to the disk in one commit.
+int fallocate(int fd, uint32_t offset, uint32_t len) {
+    FILE *f = get_open_file(fd);
+    if (f == NULL || (f->flags & O_ACCMODE) == O_RDONLY) return -1;
+    if (len == 0 || offset + len < offset) return -1;
+
+    mochi_file *file = &f->file;
+    if ((file->inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFREG) return -1;
+    if (is_inline(&file->inode) && uninline(file)) return -1;
+
+    // unwritten blocks need an extent tree to say so.
+    if (!(file->inode.i_flags & EXT4_EXTENTS_FL)) return -1;
+
+    // the blocks and size write() has put off go on disk first,
+    // so the map we add to is the whole story.
+    alloc_delayed(file->inode_n);
+    file->inode = get_inode(file->inode_n);
+    discard_prealloc(file->inode_n);
+
+    uint32_t first = offset / S_BLOCK_SIZE;
+    uint32_t end = (offset + len + S_BLOCK_SIZE - 1) / S_BLOCK_SIZE;
+    uint32_t old_end = file_blocks(&file->inode);
+
+    // all or nothing: count the holes, and the worst case for the 
+    // extent nodes adding them takes (each run of them is at least 
+    // one extent per ext_max_len blocks), and leave the blocks 
+    // write() has reserved alone.
+    uint32_t want = 0;
+    uint32_t meta = 0;
+    uint32_t run = 0;
+    for (uint32_t i = first; i < end; i++) {
+        if (i < old_end && map_block(file, i) != 0) {
+            run = 0;
+            continue;
+        }
+        if (run % ext_max_len(1) == 0) meta += meta_worst(&file->inode, i, 0);
+        want++;
+        run++;
+    }
+    if (unreserved_blocks() < want + meta) {
+        print("No free blocks available.\n");
+        return -1;
+    }
+
+    int err = 0;
+    uint32_t i = first;
+    while (i < end && !err) {
+        if (i < old_end && map_block(file, i) != 0) {
+            i++;
+            continue;
+        }
+
+        uint32_t n = 1;
+        while (i + n < end && (i + n >= old_end || map_block(file, i + n) == 0)) n++;
+
+        if (alloc_unwritten(file, i, n)) err = 1;
+        i += n;
+    }
+
+    // (the blocks we did get are past the old end, so it grows anyway.)
+    if (offset + len > file->inode.i_size) file->inode.i_size = offset + len;
+
+    write_inode_table(file->inode_n, file->inode);
+    commit_if_due();
+    return err ? -1 : 0;
+}
+
+int close(int fd) {
+    FILE *f = get_open_file(fd);
+    if (f == NULL) return -1;
+
+    // hand back the blocks we grabbed ahead of the writes.
+    discard_prealloc(f->file.inode_n);
+    f->in_use = 0;
+
+    commit_if_due();
+    return 0;
+}
+
+
+/* Directory listing.
+ *
+ * getdents() fills the caller's buffer with as many entries as fit, 
+ * starting from the fd's offset into the directory (block number 
+ * times block size, plus the position in the block), and moves the 
+ * offset past them. it returns how many bytes it filled, 0 at the 
+ * end of the directory, or -1 if even one entry didn't fit. 
+ *
+ * getdents_plus() also fills in each entry's inode attributes. 
+ * rather than a read per entry, it collects a batch of inode numbers, 
+ * sorts them by inode table block, and reads those blocks in runs 
+ * (reading through short gaps). a listing then costs about one read 
+ * per run of inode table blocks, not one per entry. */
+
+#define DIRENT_BATCH        128 // entries per inode fetch
+#define DIRENT_IO_BLOCKS    16  // inode table blocks per read
+#define DIRENT_MAX_GAP      4   // unwanted blocks worth reading through
+
+typedef struct {
+    uint32_t itable_blk;
+    uint32_t inode_n;
+    mochi_dirent_plus *rec;
+} dirent_fetch;
+
+// the inode table block holding inode_n.
+uint32_t itable_blk_of(uint32_t inode_n) {
+    uint32_t index = inode_n - 1;
+    uint32_t g = index / super.s_inodes_per_group;
+    uint32_t offset = index % super.s_inodes_per_group;
+    return bgdt[g].bg_inode_table + offset * sizeof(inode_t) / S_BLOCK_SIZE;
+}
+
+// fill in the attributes of a batch of getdents_plus() records. 
+// io has room for DIRENT_IO_BLOCKS blocks.
+void fetch_dirent_inodes(dirent_fetch *batch, uint32_t n, uint8_t *io) {
+    // insertion sort by block. the batch is small.
+    for (uint32_t k = 1; k < n; k++) {
+        dirent_fetch x = batch[k];
+        uint32_t j = k;
+        while (j > 0 && batch[j - 1].itable_blk > x.itable_blk) {
+            batch[j] = batch[j - 1];
+            j--;
+        }
+        batch[j] = x;
+    }
+
+    uint32_t per_block = S_BLOCK_SIZE / sizeof(inode_t);
+    uint32_t k = 0;
+    while (k < n) {
+        uint32_t first = batch[k].itable_blk;
+        uint32_t last = first;
+        uint32_t end = k + 1;
+        while (end < n && batch[end].itable_blk - last <= DIRENT_MAX_GAP + 1 && 
+                batch[end].itable_blk - first < DIRENT_IO_BLOCKS) {
+            last = batch[end].itable_blk;
+            end++;
+        }
+
+        disk_read_blks(first, io, last - first + 1);
+        journal_overlay(first, io, last - first + 1);
+
+        for (; k < end; k++) {
+            uint32_t slot = (batch[k].inode_n - 1) % per_block;
+            inode_t *inode = (inode_t *) (io + (batch[k].itable_blk - first) * S_BLOCK_SIZE 
+                    + slot * sizeof(inode_t));
+
+            mochi_dirent_plus *r = batch[k].rec;
+            r->i_mode = inode->i_mode;
+            r->i_links_count = inode->i_links_count;
+            r->i_size = inode->i_size;
+
+            // writes that haven't reached the disk yet.
+            delayed_file *d = find_delayed(batch[k].inode_n);
+            if (d != NULL) r->i_size = d->size;
+            r->i_blocks = inode->i_blocks;
+            r->i_mtime = inode->i_mtime;
+        }
+    }
+}
+
+// whether the entry at pos in a directory block of block_size bytes 
+// is one we can follow: its rec_len is a whole number of words that 
+// stays in the block and holds its name, and if it's in use, its 
+// inode exists.
+uint8_t dentry_ok(dentry_t *d, uint32_t pos, uint32_t block_size) {
+    if (d->rec_len < DENTRY_HDR_LEN || d->rec_len % 4 != 0) return 0;
+    if (pos + d->rec_len > block_size) return 0;
+    if (d->inode == 0) return 1; // unused. the name doesn't matter.
+
+    if (DENTRY_HDR_LEN + d->name_len > d->rec_len) return 0;
+    return d->inode <= super.s_inodes_count;
+}
+
+int getdents_common(int fd, uint8_t *buf, uint32_t count, uint8_t plus) {
+    FILE *f = get_open_file(fd);
+    if (f == NULL) return -1;
+
+    // entries may have been added since open().
+    mochi_file *dir = &f->file;
+    dir->inode = get_inode(dir->inode_n);
+    if ((dir->inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) return -1;
+
+    dirent_fetch *batch = NULL;
+    uint8_t *io = NULL;
+    if (plus) {
+        batch = (dirent_fetch *) kmalloc(DIRENT_BATCH * sizeof(dirent_fetch));
+        io = (uint8_t *) kmalloc(DIRENT_IO_BLOCKS * S_BLOCK_SIZE);
+        if (batch == NULL || io == NULL) {
+            if (batch != NULL) kfree(batch);
+            if (io != NULL) kfree(io);
+            return -1;
+        }
+    }
+    uint32_t n_batch = 0;
+
+    uint32_t block_size = dir_block_size(dir);
+    uint32_t end = dir_n_blocks(dir) * block_size;
+    uint32_t used = 0;
+    uint8_t bad = 0;
+
+    while (f->offset < end) {
+        uint8_t *block = dir_block(dir, f->offset / block_size);
+        if (block == NULL) break;
+
+        uint32_t pos = f->offset % block_size;
+        dentry_t *d = (dentry_t *) (block + pos);
+        if (!dentry_ok(d, pos, block_size)) {
+            // corrupt. nothing after it can be trusted either.
+            print("getdents: bad directory entry.\n");
+            f->offset = end;
+            bad = 1;
+            break;
+        }
+
+        if (d->inode != 0) {
+            mochi_dirent *r = (mochi_dirent *) (buf + used);
+            char *name = plus ? ((mochi_dirent_plus *) r)->d_name : r->d_name;
+            uint32_t reclen = ((name - (char *) r) + d->name_len + 1 + 3) & ~3;
+            if (used + reclen > count) break;
+
+            r->d_ino = d->inode;
+            r->d_off = f->offset + d->rec_len;
+            r->d_reclen = reclen;
+            r->d_type = d->file_type;
+            memmove(name, d->name, d->name_len);
+            name[d->name_len] = '\0';
+            used += reclen;
+
+            if (plus) {
+                batch[n_batch].itable_blk = itable_blk_of(d->inode);
+                batch[n_batch].inode_n = d->inode;
+                batch[n_batch].rec = (mochi_dirent_plus *) r;
+                if (++n_batch == DIRENT_BATCH) {
+                    fetch_dirent_inodes(batch, n_batch, io);
+                    n_batch = 0;
+                }
+            }
+        }
+        f->offset += d->rec_len;
+    }
+
+    if (plus) {
+        if (n_batch > 0) fetch_dirent_inodes(batch, n_batch, io);
+        kfree(batch);
+        kfree(io);
+    }
+
+    if (used == 0 && (bad || f->offset < end)) return -1;
+    return used;
+}
+
+int getdents(int fd, mochi_dirent *buf, uint32_t count) {
+    return getdents_common(fd, (uint8_t *) buf, count, 0);
+}
+
+int getdents_plus(int fd, mochi_dirent_plus *buf, uint32_t count) {
+    return getdents_common(fd, (uint8_t *) buf, count, 1);
+}
+
+
+/* Memory-mapped files.
+ *
+ * mmap() only records a vm_area. the first touch of each page 
+ * faults, and mmap_fault() maps the page cache's own copy of that 
+ * page there. so every mapping of a file shares one copy, and it's 
+ * the same data read() and write() see. mappings are meant to be 
+ * read-only, but nothing enforces it: map_page() doesn't set the 
+ * writable bit on any page, and without CR0.WP the kernel (which is 
+ * all that runs) can write anyway. a store through a mapping changes 
+ * the cached page without dirtying it, so it may or may not reach 
+ * the disk. clean pages can still be dropped: when the cache evicts 
+ * a page, it's unmapped everywhere first, and the next touch reads 
+ * it back. */
+
+#define N_VM_AREAS      16
+#define MMAP_START      0xd0000000
+#define MMAP_END        0xe0000000  // kernel pages start here
+
+typedef struct {
+    uint32_t start;     // 0 if unused
+    uint32_t len;       // a multiple of PAGE_SIZE
+    mochi_file file;
+    uint32_t offset;    // where in the file start maps to
+} vm_area;
+
+static vm_area vm_areas[N_VM_AREAS];
+
+// address space is handed out in order, and only given back 
+// when the newest mapping goes away.
+static uint32_t next_mmap_addr = MMAP_START;
+
+void *mmap(uint32_t inode_n, uint32_t offset, uint32_t len) {
+    if (offset % PAGE_SIZE != 0 || len == 0) return NULL;
+
+    len = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (len > MMAP_END - next_mmap_addr) return NULL;
+
+    vm_area *vma = NULL;
+    for (int i = 0; i < N_VM_AREAS; i++) {
+        if (vm_areas[i].start == 0) {
+            vma = &vm_areas[i];
+            break;
+        }
+    }
+    if (vma == NULL) return NULL;
+
+    mochi_file file = {
+        .inode = get_inode(inode_n),
+        .inode_n = inode_n
+    };
+
+    // pages can't point into an inode.
+    if (is_inline(&file.inode) && uninline(&file)) return NULL;
+
+    vma->start = next_mmap_addr;
+    vma->len = len;
+    vma->offset = offset;
+    vma->file = file;
+
+    next_mmap_addr += len;
+    return (void *) vma->start;
+}
+
+vm_area *find_vm_area(uint32_t addr) {
+    for (int i = 0; i < N_VM_AREAS; i++) {
+        vm_area *vma = &vm_areas[i];
+        if (vma->start != 0 && addr - vma->start < vma->len) return vma;
+    }
+    return NULL;
+}
+
+// 0 if addr's page is mapped now, 1 if addr isn't in a mapping 
+// at all, -1 if it is but the page can't be had.
+int mmap_fault(uint32_t addr) {
+    vm_area *vma = find_vm_area(addr);
+    if (vma == NULL) return 1;
+
+    uint32_t vpage = addr & ~(PAGE_SIZE - 1);
+    uint32_t index = (vma->offset + (vpage - vma->start)) / PAGE_SIZE;
+
+    // the file may have grown, had holes filled or been uninlined 
+    // since mmap() or the last fault, so the copy in vma is no good.
+    vma->file.inode = get_inode(vma->file.inode_n);
+
+    cpage *p = pcache_get(&vma->file, index, file_blocks(&vma->file.inode));
+    if (p == NULL) {
+        // out of memory, most likely. make some room and try again.
+        pcache_shrink(PCACHE_MIN_PAGES);
+        p = pcache_get(&vma->file, index, file_blocks(&vma->file.inode));
+    }
+    if (p == NULL) return -1;
+
+    map_page(vpage, virt_to_phys((uint32_t) p->data));
+    p->mapcount++;
+    return 0;
+}
+
+// take p out of every mapping it's in.
+void unmap_cached_page(cpage *p) {
+    if (p->mapcount == 0) return;
+
+    uint32_t phys = virt_to_phys((uint32_t) p->data);
+    uint32_t pos = p->index * PAGE_SIZE;
+
+    for (int i = 0; i < N_VM_AREAS; i++) {
+        vm_area *vma = &vm_areas[i];
+        if (vma->start == 0 || vma->file.inode_n != p->tree->inode_n) continue;
+        if (pos < vma->offset || pos - vma->offset >= vma->len) continue;
+
+        uint32_t vaddr = vma->start + (pos - vma->offset);
+        if (virt_to_phys(vaddr) == phys) unmap_page(vaddr);
+    }
+    p->mapcount = 0;
+}
+
+int munmap(void *addr) {
+    vm_area *vma = find_vm_area((uint32_t) addr);
+    if (vma == NULL || vma->start != (uint32_t) addr) return -1;
+
+    for (uint32_t off = 0; off < vma->len; off += PAGE_SIZE) {
+        if (unmap_page(vma->start + off) == 0) continue;
+
+        cpage *p = pcache_find(vma->file.inode_n, (vma->offset + off) / PAGE_SIZE);
+        if (p != NULL && p->mapcount > 0) p->mapcount--;
+    }
+
+    if (vma->start + vma->len == next_mmap_addr) next_mmap_addr = vma->start;
+    vma->start = 0;
+    return 0;
+}
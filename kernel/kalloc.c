@@ -23,19 +23,21 @@ void *insert_head(uint32_t req_size) {
     base->size = req_size;
     base->next = old_base;
     base->prev = NULL;
+    if (old_base != NULL) old_base->prev = base;
     return (void *) (base + 1);
 }
 
 // insert a new node into the linked list. 
 // return the pointer to the user's requested memory region.
 void *insert_after(header_t *p, uint32_t req_size) {
-    uint32_t curr_end = ((uint32_t) p) + p->size;
+    // size doesn't count the header.
+    uint32_t curr_end = ((uint32_t) (p + 1)) + p->size;
     header_t *new = (header_t *) curr_end;
     new->size = req_size;
     new->next = p->next;
     new->prev = p;
     p->next = new;
-    new->next->prev = new;
+    if (new->next != NULL) new->next->prev = new;
 
     return (void *) (new + 1);
 }
@@ -70,7 +72,7 @@ void *kmalloc(uint32_t req_size) {
         // get the difference between the end of this chunk and the beginning
         // of the next
         right = (uint32_t) curr->next;
-        left = ((uint32_t) curr) + curr->size;
+        left = ((uint32_t) (curr + 1)) + curr->size;
         if (right - left >= needed_size) {
             return insert_after(curr, req_size);
         }
@@ -79,7 +81,7 @@ void *kmalloc(uint32_t req_size) {
     // curr->next is null. see if we can fit it in the available region.
     // if not, return a null pointer. 
     right = AVAIL_MEM_END;
-    left = ((uint32_t) curr) + curr->size;
+    left = ((uint32_t) (curr + 1)) + curr->size;
     if (right - left > needed_size) {
         return insert_after(curr, req_size);
     }
@@ -90,8 +92,10 @@ void *kmalloc(uint32_t req_size) {
 void kfree(void *p) {
     header_t *hdr = ((header_t *) p) - 1;
     // update pointers of hdr's neighbors to skip over hdr
-    hdr->prev->next = hdr->next;
-    hdr->next->prev = hdr->prev;
+    if (hdr->prev != NULL) hdr->prev->next = hdr->next;
+    else base = hdr->next;
+
+    if (hdr->next != NULL) hdr->next->prev = hdr->prev;
 }
 
 void *kcalloc(uint32_t nitems, uint32_t size) {
@@ -102,7 +106,7 @@ void *kcalloc(uint32_t nitems, uint32_t size) {
     if (ret == NULL) return NULL;
 
     for (uint32_t i = 0; i < mult; i++) {
-        *((uint8_t *)ret) = 0;
+        ((uint8_t *) ret)[i] = 0;
     }
     return ret;
 }
@@ -121,7 +125,7 @@ void *krealloc(void *ptr, uint32_t size) {
     uint32_t old_size = old_hdr->size;
 
     for (uint32_t i = 0; i < old_size; i++) {
-        *bnew = *bptr;
+        bnew[i] = bptr[i];
     }
 
     // free old region
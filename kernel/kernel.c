@@ -93,15 +93,20 @@ int kmain() {
     print("Welcome to Mochi ^_^ \n");
     print(">");
 
-    mkfs(8, 24);
-    test_fs();
+    // use the filesystem from last time, if there is one.
+    if (mount_fs(8)) {
+        mkfs(8, 24);
+        test_fs();
+    }
 
     initialize_e1000();
+    e1000_tx_test();
     dhcp_bootstrap_ip();
 
     // hang out for a while. 
+    // (the filesystem does its background work meanwhile.)
     while (1) {
-
+        fs_idle();
     }
 
     return 0;
@@ -70,12 +70,20 @@ uint32_t *pt_at_index(uint16_t i) {
 // 
 static physical_page ppages[N_FREE_PAGES];
 
+// how many of ppages aren't in use.
+static uint32_t n_free_pages = 0;
+
 void init_physical_pages() {
     uint32_t paddr = FREE_START;
     for (int i = 0; i < N_FREE_PAGES; i++) {
         // defaults low bit to "not in-use"
         ppages[i].start = paddr + i * 0x1000;
     }
+    n_free_pages = N_FREE_PAGES;
+}
+
+uint32_t free_page_count() {
+    return n_free_pages;
 }
 
 uint32_t alloc_page() {
@@ -87,6 +95,7 @@ uint32_t alloc_page() {
 
         // otherwise, set as in-use and return!
         ppages[i].start |= 1;
+        n_free_pages--;
 
         // when we cached start_addr, it didn't have the flag set. 
         // otherwise, we'd have to xor off the present flag.
@@ -103,6 +112,7 @@ void free_page(uint32_t addr) {
     for (int i = 0; i < N_FREE_PAGES; i++) {
         if (ppages[i].start == addr + 1) {
             ppages[i].start -= 1;
+            n_free_pages++;
             return;
         }
     }
@@ -155,8 +165,8 @@ uint32_t *get_free_page_table() {
     }
 }
 
-// we have a virtual address we need a page for. 
-uint8_t map_free_page(uint32_t virtual_addr) {
+// map virtual_addr to the physical page at phy_page_addr.
+uint8_t map_page(uint32_t virtual_addr, uint32_t phy_page_addr) {
     uint16_t pd_i = virtual_addr >> 22;
     uint16_t pt_i = (virtual_addr >> 12) & 0x3ff; // 0011 1111 1111
 //    print("looking for page directory index: ");
@@ -164,12 +174,6 @@ uint8_t map_free_page(uint32_t virtual_addr) {
 //    print("page table index: ");
 //    print_word(pt_i);
 
-    // get a free physical page. 
-    // TODO: this should be able to fail.
-    // when it does...time to evict!
-
-    uint32_t phy_page_addr = alloc_page();
-
 
     // CASE 1: this 4Mb section is totally unassigned! 
     // (not marked "present" in the page directory)
@@ -204,6 +208,7 @@ uint8_t map_free_page(uint32_t virtual_addr) {
 //    print("page allocated: "); print_word(phy_page_addr);
     pt[pt_i] = phy_page_addr | 1;
 
+    return 0;
 
     // we'll handle this later...
 //    if (!page_found) {
@@ -212,6 +217,82 @@ uint8_t map_free_page(uint32_t virtual_addr) {
 //    }
 }
 
+// we have a virtual address we need a page for. 
+uint8_t map_free_page(uint32_t virtual_addr) {
+    // get a free physical page. 
+    // TODO: this should be able to fail.
+    // when it does...time to evict!
+    return map_page(virtual_addr, alloc_page());
+}
+
+// page table entry for virtual_addr, or NULL if its 
+// 4Mb section has no page table.
+uint32_t *pte_for(uint32_t virtual_addr) {
+    uint32_t pd_entry = pd[virtual_addr >> 22];
+    if (!(pd_entry & PAGE_PRESENT)) return NULL;
+
+    uint32_t *pt = (uint32_t *) ((pd_entry & 0xfffff000) + KERNEL_OFFSET);
+    return &pt[(virtual_addr >> 12) & 0x3ff];
+}
+
+// physical address behind virtual_addr (0 if it isn't mapped).
+uint32_t virt_to_phys(uint32_t virtual_addr) {
+    uint32_t *pte = pte_for(virtual_addr);
+    if (pte == NULL || !(*pte & PAGE_PRESENT)) return 0;
+
+    return (*pte & 0xfffff000) | (virtual_addr & 0xfff);
+}
+
+// take virtual_addr's page out of the page tables. the physical 
+// page is left alone; its address is returned (0 if none).
+uint32_t unmap_page(uint32_t virtual_addr) {
+    uint32_t *pte = pte_for(virtual_addr);
+    if (pte == NULL || !(*pte & PAGE_PRESENT)) return 0;
+
+    uint32_t phy_page_addr = *pte & 0xfffff000;
+    *pte = 0;
+    asm volatile ("invlpg (%0)" : : "r" (virtual_addr) : "memory");
+    return phy_page_addr;
+}
+
+
+/* Kernel pages.
+ *
+ * whole, page-aligned pages for the kernel (the page cache uses 
+ * these), mapped in their own window so they can be mapped 
+ * somewhere else at the same time. */
+
+#define KPAGE_START     0xe0000000
+#define KPAGE_END       0xf0000000  // the stack starts here
+#define N_KPAGES        ((KPAGE_END - KPAGE_START) / PAGE_SIZE)
+
+static uint32_t kpage_bitmap[N_KPAGES / 32];
+static uint32_t kpage_hint = 0; // no free slot below this word
+
+void *alloc_kernel_page() {
+    for (uint32_t w = kpage_hint; w < N_KPAGES / 32; w++) {
+        if (kpage_bitmap[w] == 0xffffffff) continue;
+
+        uint32_t bit = __builtin_ctz(~kpage_bitmap[w]);
+        kpage_bitmap[w] |= 1 << bit;
+        kpage_hint = w;
+
+        uint32_t vaddr = KPAGE_START + (w * 32 + bit) * PAGE_SIZE;
+        map_free_page(vaddr);
+        return (void *) vaddr;
+    }
+    return NULL;
+}
+
+void free_kernel_page(void *p) {
+    uint32_t vaddr = (uint32_t) p;
+    free_page(unmap_page(vaddr));
+
+    uint32_t slot = (vaddr - KPAGE_START) / PAGE_SIZE;
+    kpage_bitmap[slot / 32] &= ~(1 << (slot % 32));
+    if (slot / 32 < kpage_hint) kpage_hint = slot / 32;
+}
+
 void zero_page_directory() {
     // from bootloader. the page tables
     // that had "init pt" called on them.
@@ -5,69 +5,144 @@
 #include "screen.h"
 #include "string.h"
 
-// TODO: dynamically calculate.
-// right now, it's based on our test 24Mb size disk. 
-#define N_BLOCK_GROUPS 3
+// everything below is worked out from the partition length,
+// roughly the way mke2fs does it.
 
-#define MOCHI_EXT2_BLK_SIZE   1024
+// small filesystems get 1kb blocks, so small files don't waste much.
+// bigger ones get 4kb blocks (the same as a page).
+#define MOCHI_EXT2_SMALL_FS_MB      512
 
-// this is based off the 214-block, 1kb block-size 
-// that's in the sample 20kb ext2 filesystem
-// with our current values, it yields 1712 inodes per group.
-#define MOCHI_EXT2_INODES_PER_GROUP     ((214 * MOCHI_EXT2_BLK_SIZE) / sizeof(inode_t))
+// bytes of disk per inode. small filesystems tend to
+// have lots of small files.
+#define MOCHI_EXT2_SMALL_INODE_RATIO    4096
+#define MOCHI_EXT2_INODE_RATIO          16384
 
-// see "Sample 20mb Partition Layout"
-// subtracting off the blocks for block bitmap (1)
-// inode bitmap (1), inode table (214)
-#define MOCHI_EXT2_FREE_BLOCKS_PER_GROUP    7976
+// a last group smaller than its metadata plus this
+// many blocks isn't worth having.
+#define MOCHI_EXT2_MIN_LAST_GROUP   50
 
-// correct this for what the inode table uses
-#define MOCHI_EXT2_BLOCKS_PER_GROUP 8192
+// how many extra blocks to grab past the one a file asked for,
+// so sequential writes come out contiguous. (ext2 uses 8.)
+#define MOCHI_EXT2_PREALLOC_BLOCKS      8
+#define MOCHI_EXT2_PREALLOC_DIR_BLOCKS  4
 
-#define SECTORS_PER_BLOCK   (MOCHI_EXT2_BLK_SIZE / DISK_SECTOR_SIZE)
 
-#define SECTORS_PER_BLOCK_GROUP (SECTORS_PER_BLOCK * MOCHI_EXT2_BLOCKS_PER_GROUP)
+uint32_t itable_blocks(superblock_t *b) {
+    uint32_t block_size = 1024 << b->s_log_block_size;
+    return b->s_inodes_per_group * sizeof(inode_t) / block_size;
+}
+
+// blocks at the start of group_n taken up by the superblock and
+// BGDT copies, the bitmaps and the inode table.
+uint32_t group_overhead(superblock_t *b, uint32_t group_n) {
+    uint32_t n = 2 + itable_blocks(b);
+    if (ext2_bg_has_super(b, group_n)) n += 1 + ext2_bgdt_blocks(b);
+
+    // and group 0's boot block, with 1kb blocks. (the other groups
+    // start their metadata a block in too, but that block is free.)
+    if (group_n == 0) n += b->s_first_data_block;
+    return n;
+}
 
+uint32_t group_blocks(superblock_t *b, uint32_t group_n) {
+    uint32_t left = b->s_blocks_count - group_n * b->s_blocks_per_group;
+    if (left < b->s_blocks_per_group) return left;
+    return b->s_blocks_per_group;
+}
+
+// block size, group count and inodes per group, for len Mb.
+// returns -1 if that's too small for a filesystem.
+int make_geometry(superblock_t *b, uint32_t len) {
+    uint32_t block_size = 1024;
+    uint32_t inode_ratio = MOCHI_EXT2_SMALL_INODE_RATIO;
+    if (len >= MOCHI_EXT2_SMALL_FS_MB) {
+        block_size = 4096;
+        inode_ratio = MOCHI_EXT2_INODE_RATIO;
+    }
 
-superblock_t make_super(uint16_t block_group_nr) {
-    superblock_t b = { 0 };
+    b->s_log_block_size = (block_size == 1024) ? 0 : 2;
+    b->s_log_frag_size = b->s_log_block_size;
 
-    // TODO: dynamically calculate.
-    uint8_t n_block_groups = N_BLOCK_GROUPS;
+    // with 1kb blocks, block 0 is the boot block and the
+    // superblock is block 1. otherwise they share block 0.
+    b->s_first_data_block = (block_size == 1024) ? 1 : 0;
 
-    b.s_inodes_per_group = MOCHI_EXT2_INODES_PER_GROUP;
-    b.s_blocks_per_group = MOCHI_EXT2_BLOCKS_PER_GROUP;
-    b.s_frags_per_group = MOCHI_EXT2_BLOCKS_PER_GROUP;
+    // each group's block bitmap is one block.
+    b->s_blocks_per_group = 8 * block_size;
+    b->s_frags_per_group = b->s_blocks_per_group;
 
-    b.s_inodes_count = b.s_inodes_per_group * n_block_groups;
-    b.s_blocks_count = b.s_blocks_per_group * n_block_groups;
+    uint32_t blocks_per_mb = (1024 * 1024) / block_size;
+    b->s_blocks_count = len * blocks_per_mb;
 
-    // all blocks are free after init.
-    // -4 for the superblock and block group descriptor, and their backups.
-    // each is 1 block in size.
-    b.s_free_blocks_count = MOCHI_EXT2_FREE_BLOCKS_PER_GROUP * n_block_groups - 4;
+    uint32_t n_groups = (b->s_blocks_count + b->s_blocks_per_group - 1)
+        / b->s_blocks_per_group;
+    if (n_groups > MAX_BLOCK_GROUPS) {
+        n_groups = MAX_BLOCK_GROUPS;
+        b->s_blocks_count = n_groups * b->s_blocks_per_group;
+    }
+
+    // whole inode table blocks, and no more than the
+    // (one block) inode bitmap can track.
+    uint32_t inodes_per_block = block_size / sizeof(inode_t);
+    uint32_t n_inodes = b->s_blocks_count / (inode_ratio / block_size);
+    uint32_t ipg = (n_inodes + n_groups - 1) / n_groups;
+    ipg = (ipg + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+    if (ipg < inodes_per_block) ipg = inodes_per_block;
+    if (ipg > 8 * block_size) ipg = 8 * block_size;
+    b->s_inodes_per_group = ipg;
+
+    // the BGDT size depends on the group count,
+    // so settle that before the last group is checked.
+    b->s_feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+
+    uint32_t last = n_groups - 1;
+    if (group_blocks(b, last) < group_overhead(b, last) + MOCHI_EXT2_MIN_LAST_GROUP) {
+        if (n_groups == 1) return -1;
+        n_groups--;
+        b->s_blocks_count = n_groups * b->s_blocks_per_group;
+    }
+
+    b->s_inodes_count = ipg * n_groups;
+    return 0;
+}
+
+superblock_t make_super(superblock_t geometry, bgdesc_t *table, uint16_t block_group_nr) {
+    superblock_t b = geometry;
+
+    uint32_t n_block_groups = b.s_blocks_count / b.s_blocks_per_group;
+    if (b.s_blocks_count % b.s_blocks_per_group) n_block_groups++;
+
+    b.s_free_blocks_count = 0;
+    for (uint32_t i = 0; i < n_block_groups; i++) {
+        b.s_free_blocks_count += table[i].bg_free_blocks_count;
+    }
 
     // all inodes are free after init.
     b.s_free_inodes_count = b.s_inodes_count;
 
-    b.s_first_data_block = 1;
-    b.s_log_block_size = 0;
-    // we don't do anything with fragments. 
-    // just set it equal to block size.
-    b.s_log_frag_size = 1;
-
-    // We ignore all times and counts for now. 
+    // We ignore all times and counts for now.
     // we don't have clock set up yet, and they aren't really needed.
 
     b.s_magic = EXT2_SUPER_MAGIC;
-    b.s_state = EXT2_ERROR_FS;
+    b.s_state = EXT2_VALID_FS;
+    b.s_mnt_count = 0;
+    b.s_max_mnt_count = EXT2_DFL_MAX_MNT_COUNT;
     b.s_errors = EXT2_ERRORS_RO;
     b.s_creator_os = EXT2_OS_MOCHI;
+    b.s_rev_level = EXT2_DYNAMIC_REV;
     b.s_checkinterval = (1 << 24); // something big
     b.s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
-    b.s_inode_size = EXT2_GOOD_OLD_INODE_SIZE; 
+    b.s_inode_size = EXT2_GOOD_OLD_INODE_SIZE;
     b.s_block_group_nr = block_group_nr;
 
+    // regular files are mapped with extent trees, and small files 
+    // and directories live in their inodes (our layout, not ext4's).
+    b.s_feature_incompat = EXT4_FEATURE_INCOMPAT_EXTENTS | 
+        MOCHI_FEATURE_INCOMPAT_INLINE_DATA;
+
+    b.s_prealloc_blocks = MOCHI_EXT2_PREALLOC_BLOCKS;
+    b.s_prealloc_dir_blocks = MOCHI_EXT2_PREALLOC_DIR_BLOCKS;
+
     return b;
 }
 
@@ -76,74 +151,72 @@ void write_superblock(uint32_t location, superblock_t b) {
     disk_write(location, (uint8_t *) &b, sizeof(b));
 }
 
-void make_bgdt(bgdesc_t *table) {
-    for (int i = 0; i < N_BLOCK_GROUPS; i++) {
-        // first 2 block groups have 2 initial blocks before the 
-        // bitmaps: superblock and block group descriptor.
-        if (i < 2) {
-            uint8_t extra_blocks = 2;
-            table[i].bg_block_bitmap = 1 + extra_blocks + i * MOCHI_EXT2_BLOCKS_PER_GROUP;
-            table[i].bg_inode_bitmap = 2 + extra_blocks + i * MOCHI_EXT2_BLOCKS_PER_GROUP;
-            table[i].bg_inode_table = 3 + extra_blocks + i * MOCHI_EXT2_BLOCKS_PER_GROUP;
-
-            table[i].bg_free_blocks_count = MOCHI_EXT2_FREE_BLOCKS_PER_GROUP - extra_blocks;
-        } else {
-            table[i].bg_block_bitmap = 1 + i * MOCHI_EXT2_BLOCKS_PER_GROUP;
-            table[i].bg_inode_bitmap = 2 + i * MOCHI_EXT2_BLOCKS_PER_GROUP;
-            table[i].bg_inode_table = 3 + i * MOCHI_EXT2_BLOCKS_PER_GROUP;
-            table[i].bg_free_blocks_count = MOCHI_EXT2_FREE_BLOCKS_PER_GROUP;
-        }
+// none of the bitmaps or inode tables get written here. the
+// UNINIT flags tell fs.c to make the bitmaps up when it first
+// needs them, and fs_idle() zeroes the inode tables later.
+// that keeps mkfs from having to touch every group.
+void make_bgdt(superblock_t *b, bgdesc_t *table, uint32_t n_block_groups) {
+    for (uint32_t i = 0; i < n_block_groups; i++) {
+        uint32_t pos = i * b->s_blocks_per_group + b->s_first_data_block;
 
+        // superblock and BGDT copies come first.
+        if (ext2_bg_has_super(b, i)) pos += 1 + ext2_bgdt_blocks(b);
+
+        table[i].bg_block_bitmap = pos;
+        table[i].bg_inode_bitmap = pos + 1;
+        table[i].bg_inode_table = pos + 2;
+
+        table[i].bg_free_blocks_count = group_blocks(b, i) - group_overhead(b, i);
+        table[i].bg_free_inodes_count = b->s_inodes_per_group;
         table[i].bg_used_dirs_count = 0;
-        table[i].bg_free_inodes_count = MOCHI_EXT2_INODES_PER_GROUP;
+        table[i].bg_flags = EXT4_BG_INODE_UNINIT | EXT4_BG_BLOCK_UNINIT;
     }
 }
 
 // write block group descriptor table
-void write_bgdt(uint32_t addr, bgdesc_t *table) {
+void write_bgdt(uint32_t addr, bgdesc_t *table, uint32_t n_block_groups) {
     // sizeof bgdesc_t is 32.
-    if ((N_BLOCK_GROUPS * sizeof(bgdesc_t)) > MOCHI_EXT2_BLK_SIZE) {
-        print("Error: cannot fit bgdt on one ext2 block. \n");
-        sys_exit();
-    }
-
     // should we pad to a full block?
-    disk_write(addr, (uint8_t *) table, N_BLOCK_GROUPS * sizeof(bgdesc_t));
+    disk_write(addr, (uint8_t *) table, n_block_groups * sizeof(bgdesc_t));
 }
 
-
+// TODO: initialize this with a calloc
+static bgdesc_t to_write_bgdt[MAX_BLOCK_GROUPS];
 
 void mkfs(uint32_t mb_start, uint32_t len) {
-    uint32_t write_addr = fs_start_to_lba_superblk(mb_start);
+    superblock_t geometry = { 0 };
+    if (make_geometry(&geometry, len)) {
+        print("mkfs: partition too small.\n");
+        return;
+    }
 
-    uint32_t nblks = len * 1024 * 2; // disk blocks
+    uint32_t n_block_groups = geometry.s_blocks_count / geometry.s_blocks_per_group;
+    if (geometry.s_blocks_count % geometry.s_blocks_per_group) n_block_groups++;
 
-    // create a superblock.
-    superblock_t b = make_super(0);
+    uint32_t block_size = 1024 << geometry.s_log_block_size;
+    uint32_t sectors_per_block = block_size / DISK_SECTOR_SIZE;
 
-    write_superblock(write_addr, b);
+    make_bgdt(&geometry, to_write_bgdt, n_block_groups);
 
-    // make + write the backup superblock
-    b = make_super(1);
-    write_superblock(write_addr + SECTORS_PER_BLOCK_GROUP, b);
-    write_addr += SECTORS_PER_BLOCK;
+    // the primary superblock is always 1024 bytes in.
+    superblock_t b = make_super(geometry, to_write_bgdt, 0);
+    write_superblock(fs_start_to_lba_superblk(mb_start), b);
 
-    uint32_t test;
-    // create block group descriptor table
-    bgdesc_t to_write_bgdt[N_BLOCK_GROUPS];
- 
-    // this writes the global static thing.
-    // we need to read the state from disk to properly initialize
-    // otherwise you will always need to run "mkfs" before doing any
-    // filesystem operation...
-    make_bgdt(to_write_bgdt);
+    // the BGDT starts in the block after it.
+    uint32_t fs_start = mb_to_lba(mb_start);
+    uint32_t bgdt_blk = geometry.s_first_data_block + 1;
+    write_bgdt(fs_start + bgdt_blk * sectors_per_block, to_write_bgdt, n_block_groups);
 
-    write_bgdt(write_addr, to_write_bgdt);
+    // backups go at the start of the groups sparse_super picks.
+    for (uint32_t i = 1; i < n_block_groups; i++) {
+        if (!ext2_bg_has_super(&geometry, i)) continue;
 
-    // write backup bgdt
-    write_bgdt(write_addr + SECTORS_PER_BLOCK_GROUP, to_write_bgdt);
+        uint32_t blk = i * geometry.s_blocks_per_group + geometry.s_first_data_block;
+
+        b = make_super(geometry, to_write_bgdt, i);
+        write_superblock(fs_start + blk * sectors_per_block, b);
+        write_bgdt(fs_start + (blk + 1) * sectors_per_block, to_write_bgdt, n_block_groups);
+    }
 
     finish_fs_init(mb_start);
 }
-
-
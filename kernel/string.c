@@ -38,10 +38,10 @@ void *memchr(const void *s, int c, size_t n) {
 
 int memcmp(const void *s1, const void *s2, size_t n) {
     uint8_t *p1 = (uint8_t *) s1;
-    uint8_t *p2 = (uint8_t *) p2;
+    uint8_t *p2 = (uint8_t *) s2;
     for (size_t i = 0; i < n; i++) {
         if (p1[i] != p2[i]) {
-            return (p1[i] < p2[i]);
+            return p1[i] - p2[i];
         }
     }
     return 0;
@@ -56,14 +56,15 @@ void *memset(void *dest, int c, size_t n) {
 }
 
 
+// (compared as unsigned chars, like memcmp.)
 int strcmp(const char *s1, const char *s2) {
-    char *is1 = s1;
-    char *is2 = s2;
-    while (*is1++ == *is2++) {
-        if (*is1 == '\0') return 0;
+    uint8_t *p1 = (uint8_t *) s1;
+    uint8_t *p2 = (uint8_t *) s2;
+    while (*p1 != '\0' && *p1 == *p2) {
+        p1++;
+        p2++;
     }
-    // strings unequal at this point
-    return *is1 < *is2;
+    return *p1 - *p2;
 }
 
 char *strcpy(char *s, const char *ct) {
@@ -6,6 +6,7 @@
 #include "process.h"
 #include <stdint.h>
 #include "devices.h"
+#include "fs.h"
 
 // programmable interrupt timer stuff -- from ToaruOS
 #define PIT_A       0x40
@@ -51,6 +52,7 @@ void timer_handler_inner(registers r) {
     if (++timer_subticks == SUBTICKS_PER_TICK) {
         timer_ticks++;
         timer_subticks = 0;
+        fs_timer_tick();
     }
 
     ack_interrupt_pic1();
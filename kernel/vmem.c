@@ -4,6 +4,7 @@
 #include "hardware.h"
 #include "devices.h"
 #include "screen.h"
+#include "fs.h"
 
 __attribute__ ((interrupt))
 void page_fault_handler(struct interrupt_frame *frame, uint32_t error_code) {
@@ -12,7 +13,16 @@ void page_fault_handler(struct interrupt_frame *frame, uint32_t error_code) {
     asm volatile ("mov %%cr2, %%eax\n\t"
             "mov %%eax, %0" : "=r" (mem_addr) :); 
 
-    map_free_page(mem_addr);
+    // pages of a mapped file come out of the page cache. 
+    // anything else gets a fresh page.
+    int ret = mmap_fault(mem_addr);
+    if (ret > 0) {
+        map_free_page(mem_addr);
+    } else if (ret < 0) {
+        // a fresh page would hand back garbage as the file's data.
+        print("page fault: can't read in a mapped file's page. aborting...\n");
+        sys_exit();
+    }
 
     // TODO: if all pages used, evict some page
 
@@ -8,6 +8,7 @@
 #include "string.h"
 #include "net.h"
 #include "udp.h"
+#include "mbuf.h"
 
 
 #define DHCP_OPT_MSG_TYPE       53
@@ -20,8 +21,11 @@
 #define DHCP_MSG_TYPE_DISCOVER  1
 #define DHCP_OPT_PARAM_REQ_LIST 55
 
+#define DHCP_OPT_PAD            0
 #define DHCP_OPT_END            255
 
+#define DHCP_MAGIC_LEN          4   // the cookie before the options
+
 // unset, at the start. 
 ip_config_t ip_config = { 0 };
 
@@ -67,79 +71,100 @@ void send_dhcp_discover() {
         0x37, 0x04, 0x01, 0x03, 0x0f, 0x06,
         0xff };
 
-    uint16_t dhcp_pkt_len = sizeof(dhcp_hdr) + sizeof(dhcp_options);
-    uint8_t dhcp_pkt[dhcp_pkt_len];
-    dhcp_hdr dm = { 0 };
-    dm.hlen = 0x06;
-    dm.htype = 0x01;
-    dm.op = 0x01;
-    dm.xid = hton(0x3903f326);
+    // the message is built right where it'll be sent from.
+    mbuf *m = mbuf_alloc();
+    if (m == NULL) return;
+
+    dhcp_hdr *dm = (dhcp_hdr *) mbuf_put(m, sizeof(dhcp_hdr));
+    memset(dm, 0, sizeof(dhcp_hdr));
+    dm->hlen = 0x06;
+    dm->htype = 0x01;
+    dm->op = 0x01;
+    dm->xid = hton(0x3903f326);
+
+    memmove(dm->chaddr, MAC_ADDR_ARR, 6); 
+
+    memmove(mbuf_put(m, sizeof(dhcp_options)), dhcp_options, sizeof(dhcp_options));
+
+    send_pkt_to_udp(m, DHCP_SRC_PORT, DHCP_DST_PORT);
+}
+
+// the next packet from a DHCP server to a client, with room for 
+// the header and the cookie. (anything else is dropped.)
+mbuf *recv_dhcp_reply() {
+    while (1) {
+        uint16_t src_port, dst_port;
+        mbuf *m = recv_pkt_from_udp(&src_port, &dst_port);
+        if (m == NULL) continue;
+
+        if (src_port == DHCP_DST_PORT && dst_port == DHCP_SRC_PORT && 
+                m->len >= sizeof(dhcp_hdr) + DHCP_MAGIC_LEN) {
+            return m;
+        }
+        mbuf_free(m);
+    }
+}
 
-    memmove(dm.chaddr, MAC_ADDR_ARR, 6); 
+// the option at *p, which is moved past it. its value is at *val, 
+// *len bytes long. DHCP_OPT_END when there are no more, or the 
+// rest of them would run past end.
+uint8_t dhcp_next_opt(uint8_t **p, uint8_t *end, uint8_t **val, uint8_t *len) {
+    while (*p < end && **p == DHCP_OPT_PAD) (*p)++;
+    if (*p + 2 > end || **p == DHCP_OPT_END) return DHCP_OPT_END;
 
-    memmove(dhcp_pkt, &dm, sizeof(dhcp_hdr));
-    memmove(dhcp_pkt + sizeof(dhcp_hdr), dhcp_options, sizeof(dhcp_options));
+    uint8_t opt = (*p)[0];
+    *len = (*p)[1];
+    *val = *p + 2;
+    if (*val + *len > end) return DHCP_OPT_END;
 
-    send_pkt_to_udp(dhcp_pkt, dhcp_pkt_len, DHCP_SRC_PORT, DHCP_DST_PORT);
+    *p = *val + *len;
+    return opt;
 }
 
 void read_dhcp_offer() {
-    uint16_t src_port, dst_port;
-    uint8_t *pkt = recv_pkt_from_udp(&src_port, &dst_port);
+    mbuf *m = recv_dhcp_reply();
 
-    // pkt should be a DHCP offer. 
-    dhcp_hdr *hdr = (dhcp_hdr *) pkt;
+    // m should be a DHCP offer. 
+    dhcp_hdr *hdr = (dhcp_hdr *) m->data;
 
     ip_config.ip_addr = ntoh(hdr->yiaddr);
 
     // parse options
     uint8_t *p = ((uint8_t *) hdr) + sizeof(dhcp_hdr);
-    p += 4; // skip the magic DHCP cookie.
+    p += DHCP_MAGIC_LEN; // skip the magic DHCP cookie.
+    uint8_t *end = m->data + m->len;
 
-    while (*p != DHCP_OPT_END) {
-        switch (*p) {
-            case DHCP_OPT_MSG_TYPE: {
-                p += 3;
+    uint8_t opt, len, *val;
+    while ((opt = dhcp_next_opt(&p, end, &val, &len)) != DHCP_OPT_END) {
+        // (the addresses and the lease time are all 4 bytes.)
+        if (opt != DHCP_OPT_DNS_SERVERS && len < 4) continue;
+
+        switch (opt) {
+            case DHCP_OPT_SUBNET_MASK:
+                ip_config.subnet_mask = ntoh(*((uint32_t *) val));
                 break;
-            }
-            case DHCP_OPT_SUBNET_MASK: {
-                p += 2;
-                ip_config.subnet_mask = ntoh(*((uint32_t *) p));
-                p += 4;
+            case DHCP_OPT_ROUTER:
+                ip_config.router_ip = ntoh(*((uint32_t *) val));
                 break;
-            }
-            case DHCP_OPT_ROUTER: {
-                p += 2;
-                ip_config.router_ip = ntoh(*((uint32_t *) p));
-                p += 4;
-                break;
-            }
-            case DHCP_OPT_IP_LEASE_TIME: {
-                p += 2;
-                ip_config.ip_lease_time = ntoh(*((uint32_t *) p));
-                p += 4;
+            case DHCP_OPT_IP_LEASE_TIME:
+                ip_config.ip_lease_time = ntoh(*((uint32_t *) val));
                 break;
-            }
-            case DHCP_OPT_SERVER: {
-                p += 2;
-                ip_config.dhcp_server = ntoh(*((uint32_t *) p));
-                p += 4;
+            case DHCP_OPT_SERVER:
+                ip_config.dhcp_server = ntoh(*((uint32_t *) val));
                 break;
-            }
             case DHCP_OPT_DNS_SERVERS: {
-                p++;
-                uint8_t len = *p++;
-                for (int i = 0; i < len / 4; i++, p += 4) {
-                    ip_config.dns_servers[i] = ntoh(*((uint32_t *) p));
+                uint32_t max = sizeof(ip_config.dns_servers) / sizeof(uint32_t);
+                for (uint32_t i = 0; i < len / 4 && i < max; i++) {
+                    ip_config.dns_servers[i] = ntoh(((uint32_t *) val)[i]);
                 }
                 break;
             }
-            default:  // FIXME. need to read the option type to know 
-                      // how much to advance p
-                p++;
+            default: // (the message type, and whatever we didn't ask for.)
                 break;
         }
     }
+
+    mbuf_free(m);
 }
 
 void send_dhcp_request() {
@@ -161,50 +186,45 @@ void send_dhcp_request() {
         (ip_config.dhcp_server & 0xff),
         0xff };
 
-    uint16_t dhcp_pkt_len = sizeof(dhcp_hdr) + sizeof(dhcp_options);
-    uint8_t dhcp_pkt[dhcp_pkt_len];
+    mbuf *m = mbuf_alloc();
+    if (m == NULL) return;
 
-    dhcp_hdr dm = { 0 };
-    dm.hlen = 0x06;
-    dm.htype = 0x01;
-    dm.op = 0x01;
-    dm.xid = hton(0x3903f326);
+    dhcp_hdr *dm = (dhcp_hdr *) mbuf_put(m, sizeof(dhcp_hdr));
+    memset(dm, 0, sizeof(dhcp_hdr));
+    dm->hlen = 0x06;
+    dm->htype = 0x01;
+    dm->op = 0x01;
+    dm->xid = hton(0x3903f326);
 
-    memmove(dm.chaddr, MAC_ADDR_ARR, 6); 
-    memmove(dm.siaddr, ip_config.dhcp_server, 4);
+    memmove(dm->chaddr, MAC_ADDR_ARR, 6); 
+    dm->siaddr = hton(ip_config.dhcp_server);
 
-    memmove(dhcp_pkt, &dm, sizeof(dhcp_hdr));
-    memmove(dhcp_pkt + sizeof(dhcp_hdr), dhcp_options, sizeof(dhcp_options));
+    memmove(mbuf_put(m, sizeof(dhcp_options)), dhcp_options, sizeof(dhcp_options));
 
-    send_pkt_to_udp(dhcp_pkt, dhcp_pkt_len, DHCP_SRC_PORT, DHCP_DST_PORT);
+    send_pkt_to_udp(m, DHCP_SRC_PORT, DHCP_DST_PORT);
 }
 
 void read_dhcp_ack() {
-    uint16_t src_port, dst_port;
-    uint8_t *pkt = recv_pkt_from_udp(&src_port, &dst_port);
+    mbuf *m = recv_dhcp_reply();
 
-    // pkt should be a DHCP offer. 
-    dhcp_hdr *hdr = (dhcp_hdr *) pkt;
+    // m should be a DHCP ack. 
+    dhcp_hdr *hdr = (dhcp_hdr *) m->data;
 
     ip_config.ip_addr = ntoh(hdr->yiaddr);
 
     // parse options
     uint8_t *p = ((uint8_t *) hdr) + sizeof(dhcp_hdr);
-    p += 4; // skip the magic DHCP cookie.
+    p += DHCP_MAGIC_LEN; // skip the magic DHCP cookie.
+    uint8_t *end = m->data + m->len;
 
     uint8_t ack = 0;
-    while (*p != DHCP_OPT_END && !ack) {
-        switch (*p) {
-            case 53:
-                p += 2;
-                if (*p == 5) {
-                   ack = 1;
-                }
-                break;
-            default:
-                p++;
+    uint8_t opt, len, *val;
+    while (!ack && (opt = dhcp_next_opt(&p, end, &val, &len)) != DHCP_OPT_END) {
+        if (opt == DHCP_OPT_MSG_TYPE && len >= 1 && val[0] == 5) {
+            ack = 1;
         }
     }
+    mbuf_free(m);
 
     // if we don't get an acknowledge, just error out for now.
     if (!ack) {
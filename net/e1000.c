@@ -7,11 +7,29 @@
 #include "devices.h"
 #include "string.h"
 #include "eth.h"
+#include "e1000.h"
 #include "net.h"
 #include "kalloc.h"
+#include "mbuf.h"
 
 #define E1000_NUM_RX_DESC 32
-#define E1000_NUM_TX_DESC 8
+#define E1000_NUM_TX_DESC 16 // (TDLEN has to be a multiple of 128 bytes)
+
+// filled receive descriptors go back to the card in 
+// batches of up to this many, with one RDT write.
+#define E1000_RX_RETURN_BATCH   8
+
+// frames in e1000_tx_test's burst. (fewer than the ring holds.)
+#define E1000_TX_TEST_FRAMES    4
+
+// interrupt moderation defaults. (see e1000_set_moderation.)
+#define E1000_MAX_INTS_PER_SEC  8000
+#define E1000_RX_DELAY_US       20
+#define E1000_RX_ABS_DELAY_US   100
+
+// receive buffers: one per descriptor, and some spare to swap 
+// in while the stack still has the filled ones.
+#define E1000_RX_POOL_SIZE  (E1000_NUM_RX_DESC + 16)
 
 #define E1000_CTRL_REGISTER             0x00000
 #define E1000_STATUS_REGISTER           0x00008
@@ -21,6 +39,9 @@
 // Interrupt Cause Register
 #define E1000_ICR                       0x000c0
 
+// Interrupt Throttling Register (in 256ns units)
+#define E1000_ITR                       0x000c4
+
 // Interrupt Mask/Set Register
 #define E1000_IMS                       0x000d0
 
@@ -30,7 +51,8 @@
 #define E1000_RDLEN                     0x02808
 #define E1000_RDH                       0x02810
 #define E1000_RDT                       0x02818
-#define E1000_RDTR                      0x02820
+#define E1000_RDTR                      0x02820     // in 1.024us units
+#define E1000_RADV                      0x0282c     // likewise
 
 #define E1000_TCTL                      0x00400
 #define E1000_TIPG                      0x00410
@@ -48,6 +70,12 @@
 
 // Receive Timer Interrupt (p.312)
 #define E1000_INT_RXT0                  (1 << 7)
+// free receive descriptors went below the RCTL_RDMTS threshold
+#define E1000_INT_RXDMT0                (1 << 4)
+// receiver overrun: the ring was full
+#define E1000_INT_RXO                   (1 << 6)
+
+#define E1000_INT_RX    (E1000_INT_RXT0 | E1000_INT_RXDMT0 | E1000_INT_RXO)
 
 /* Straight up copied from ToaruOS. */
 // TODO: only use the ones we need. 
@@ -290,13 +318,60 @@ typedef struct __attribute__((packed)) {
     uint16_t special;
 } tx_desc;
 
-static tx_desc ring_buf[E1000_NUM_TX_DESC];
+static tx_desc ring_buf[E1000_NUM_TX_DESC] __attribute__((aligned (16)));
+
+/* each descriptor has its own buffer, and these are static so that 
+ * we can correct for the kernel offset. the e1000 needs to know the 
+ * physical address, not a virtual address, and this is an easy way 
+ * to do it. a frame is copied in once, and sits there until the 
+ * card has sent it.
+ *
+ * the ring: descriptors from tx_clean up to tx_kicked are the 
+ * card's, and the ones from tx_kicked up to tx_tail are filled in 
+ * but waiting for the TDT write that hands them over. one is always 
+ * left empty, so a full ring doesn't look like an empty one. */
+static uint8_t tx_bufs[E1000_NUM_TX_DESC][MBUF_SIZE];
+
+static uint16_t tx_clean = 0;   // oldest one not taken back yet
+static uint16_t tx_kicked = 0;  // what TDT was last set to
+static uint16_t tx_tail = 0;    // next one to fill in
+static uint8_t tx_batch = 0;    // e1000_tx_begin() depth
+static uint32_t tx_doorbells = 0; // TDT writes so far (see e1000_tx_test)
 
 static rx_desc rx_list[E1000_NUM_RX_DESC] __attribute__((aligned (16)));
 
 #define RCTL_BSIZE 2048 // this is the default (in RCTL)
-static uint8_t rx_bufs[E1000_NUM_RX_DESC][RCTL_BSIZE];
+
+/* the receive buffers are mbufs, so a frame goes up the stack in 
+ * the buffer the e1000 put it in. they're static for the same 
+ * reason tx_bufs is (see above): their physical addresses are easy. */
+static mbuf rx_pool_bufs[E1000_RX_POOL_SIZE];
+static mbuf_pool rx_pool;
+
+// the mbuf each descriptor points at.
+static mbuf *rx_mbufs[E1000_NUM_RX_DESC];
+
+// the next descriptor the card will fill. the ones before it 
+// have fresh buffers, and rx_unreturned of them haven't been 
+// given back to the card yet (see rx_return).
 static uint16_t rx_i = 0;
+static uint16_t rx_unreturned = 0;
+
+uint32_t rx_buf_addr(mbuf *m) {
+    return ((uint32_t) m->buf) - KERNEL_OFFSET;
+}
+
+// at most max_per_sec interrupts (0 for no limit). a received packet 
+// waits up to rx_delay_us for another one to come in before it 
+// interrupts, but no longer than rx_abs_delay_us in all.
+static void e1000_set_moderation(uint32_t max_per_sec, uint32_t rx_delay_us, uint32_t rx_abs_delay_us) {
+    uint32_t itr = 0;
+    if (max_per_sec > 0) itr = 1000000000 / 256 / max_per_sec;
+    pci_reg_write(E1000_ITR, itr);
+
+    pci_reg_write(E1000_RDTR, rx_delay_us * 1000 / 1024);
+    pci_reg_write(E1000_RADV, rx_abs_delay_us * 1000 / 1024);
+}
 
 // we can dump this
 void initialize_e1000() {
@@ -317,6 +392,7 @@ void initialize_e1000() {
     // 4. set TDH and TDT to 0
     pci_reg_write(E1000_TDH, 0);
     pci_reg_write(E1000_TDT, 0);
+    tx_clean = tx_kicked = tx_tail = 0;
 
     // 5. set TCTL for:
     //  normal operation, pad short packets, full duplex mode
@@ -343,11 +419,12 @@ void initialize_e1000() {
     }
 
     // 3. program the IMS register (interrupt mask)
-    // to receive interrupts for packet reception
-    // set the packet timer to 0, so the interrupt fires 
-    // immediately. 
-    pci_reg_write(E1000_IMS, E1000_INT_RXT0); 
-    pci_reg_write(E1000_RDTR, 0);
+    // to receive interrupts for packet reception, 
+    // and for when the ring is running low on buffers. 
+    // the timers let a few packets gather per interrupt.
+    pci_reg_write(E1000_IMS, E1000_INT_RX); 
+    e1000_set_moderation(E1000_MAX_INTS_PER_SEC, 
+            E1000_RX_DELAY_US, E1000_RX_ABS_DELAY_US);
 
 
     // 4. allocate memory for receive descriptor list. 
@@ -356,16 +433,21 @@ void initialize_e1000() {
     uint32_t rloc = ((uint32_t) rx_list) - KERNEL_OFFSET;
     pci_reg_write(E1000_RDBAL, rloc);
 
+    mbuf_pool_init(&rx_pool, rx_pool_bufs, E1000_RX_POOL_SIZE);
     for (int i = 0; i < E1000_NUM_RX_DESC; i++) {
-        rx_list[i].addr = ((uint32_t) (rx_bufs + i)) - KERNEL_OFFSET;
+        rx_mbufs[i] = mbuf_pool_get(&rx_pool);
+        rx_list[i].addr = rx_buf_addr(rx_mbufs[i]);
     }
 
     // 5. set RDLEN to size of descriptor ring (in bytes)
     pci_reg_write(E1000_RDLEN, E1000_NUM_RX_DESC * sizeof(rx_desc));
 
-    // 6. initialize RDH/RDT
+    // 6. initialize RDH/RDT. the card gets every descriptor 
+    // but the last: RDH == RDT means it has none.
     pci_reg_write(E1000_RDH, 0);
-    pci_reg_write(E1000_RDT, E1000_NUM_RX_DESC);
+    pci_reg_write(E1000_RDT, E1000_NUM_RX_DESC - 1);
+    rx_i = 0;
+    rx_unreturned = 0;
 
     // 7. program RCTL
     // (enable broadcast since that's what DHCP server 
@@ -374,39 +456,97 @@ void initialize_e1000() {
 }
 
 
-/* this pkt is static so that we can correct for the kernel offset. 
- * the e1000 needs to know the physical address, not a virtual 
- * address, and this is an easy way to do it. as a kind of "staging area"
- */
-static eth_pkt epkt;
+uint16_t tx_next(uint16_t i) {
+    return (i + 1) % E1000_NUM_TX_DESC;
+}
+
+// take back the descriptors the card has finished with. 
+// (there's nothing to free: the mbufs went when they were copied.)
+void tx_reclaim() {
+    while (tx_clean != tx_kicked && (ring_buf[tx_clean].status & STATUS_DD)) {
+        ring_buf[tx_clean].status = 0;
+        tx_clean = tx_next(tx_clean);
+    }
+}
 
-static uint16_t tx_i = 0;
+// hand the card everything filled in so far, with one TDT write.
+void tx_kick() {
+    if (tx_kicked == tx_tail) return;
+    pci_reg_write(E1000_TDT, tx_tail);
+    tx_kicked = tx_tail;
+    tx_doorbells++;
+}
+
+void e1000_tx_begin() {
+    tx_batch++;
+}
 
-void update_txi() {
-    tx_i++; if (tx_i >= E1000_NUM_TX_DESC) tx_i = 0;
+void e1000_tx_end() {
+    if (tx_batch > 0) tx_batch--;
+    if (tx_batch == 0) tx_kick();
 }
 
+// queues the frame and returns; it doesn't wait for the wire. 
+// -1 if the ring is full (the frame is dropped).
+int send_eth_to_e1000(mbuf *m) {
+    tx_reclaim();
 
-void send_eth_to_e1000(const eth_pkt *ep) {
-    // copy user's packet over to our packet area, 
+    if (tx_next(tx_tail) == tx_clean) {
+        // the card is this far behind. don't wait for it.
+        tx_kick();
+        mbuf_free(m);
+        return -1;
+    }
+
+    // copy user's packet over to the descriptor's buffer, 
     // where we know the location in physical memory.
-    epkt = *ep;
+    memmove(tx_bufs[tx_tail], m->data, m->len);
 
     tx_desc pkt = {0}; // "memset" to 0
 
-    pkt.addr = ((uint32_t) &epkt) - KERNEL_OFFSET;
+    pkt.addr = ((uint32_t) tx_bufs[tx_tail]) - KERNEL_OFFSET;
 
-    pkt.length = sizeof(eth_pkt);
+    // (short ones are padded out, see TCTL_PSP.)
+    pkt.length = m->len;
 
     pkt.cmd = CMD_RS | CMD_RPS | CMD_EOP;
 
-    ring_buf[tx_i] = pkt;
+    mbuf_free(m);
+
+    ring_buf[tx_tail] = pkt;
+    tx_tail = tx_next(tx_tail);
+
+    if (tx_batch == 0) tx_kick();
+    return 0;
+}
+
+// sends a burst of E1000_TX_TEST_FRAMES empty frames to ourselves 
+// (with an ethertype nobody uses), and checks they went to the card 
+// in one TDT write. 0 if they did.
+int e1000_tx_test() {
+    print("e1000 tx test: ");
+    uint32_t before = tx_doorbells;
+
+    e1000_tx_begin();
+    for (int i = 0; i < E1000_TX_TEST_FRAMES; i++) {
+        mbuf *m = mbuf_alloc();
+        if (m == NULL) break;
 
-    pci_reg_write(E1000_TDT, tx_i + 1);
+        eth_hdr *eh = (eth_hdr *) mbuf_put(m, sizeof(eth_hdr));
+        memmove(eh->mac_dest, MAC_ADDR_ARR, 6);
+        memmove(eh->mac_src, MAC_ADDR_ARR, 6);
+        eh->ethertype = htons(ETHERTYPE_EXPERIMENTAL);
 
-    // busy wait until packet is sent.
-    while (!(ring_buf[tx_i].status & STATUS_DD)) { }
-    update_txi();
+        send_eth_to_e1000(m);
+    }
+    e1000_tx_end();
+
+    if (tx_doorbells - before != 1) {
+        print("failed.\n");
+        return -1;
+    }
+    print("ok.\n");
+    return 0;
 }
 
 void update_rxi() {
@@ -419,93 +559,71 @@ void update_rxi() {
 //    return last_rdh == pci_reg_read(E1000_RDH);
 //}
 
-uint8_t *get_next_rxbuf() {
-    while (!(rx_list[rx_i].status & STATUS_DD)) {
-        // busy wait
+// the next filled receive buffer (which has to be ready), with 
+// the frame in it. a fresh one from the pool takes its place in 
+// the ring. if the pool's empty, the frame is dropped (the ring 
+// keeps the old buffer) and this returns NULL.
+mbuf *get_next_rxbuf() {
+    mbuf *m = rx_mbufs[rx_i];
+    mbuf *fresh = mbuf_pool_get(&rx_pool);
+
+    if (fresh != NULL) {
+        m->data = m->buf;
+        m->len = rx_list[rx_i].length;
+
+        rx_mbufs[rx_i] = fresh;
+        rx_list[rx_i].addr = rx_buf_addr(fresh);
+    } else {
+        m = NULL;
     }
-    uint8_t *buf = rx_bufs[rx_i];
 
     // "consume" this entry
     rx_list[rx_i].status = 0;
     update_rxi();
+    rx_unreturned++;
 //    last_rdh = pci_reg_read(E1000_RDH);
 
-    return buf;
+    return m;
 }
 
-/* TODO: this is very temporary. 
- * it will be replaced by mbufs very soon.
- * as well as proper protocol queues. */
-typedef struct _epkt_buf {
-    struct _epkt_buf *next_ebuf;
-    struct _epkt_buf *prev_ebuf;
-    eth_pkt data;
-} epkt_buf;
-
-static epkt_buf *ebuf_head = NULL;
-static epkt_buf *ebuf_tail = NULL;
-
-epkt_buf *ebuf_alloc() {
-    epkt_buf *ebuf = (epkt_buf *) kmalloc(sizeof(epkt_buf));
-
-    ebuf->next_ebuf = NULL;
-
-    if (ebuf_head == NULL) {
-        ebuf->prev_ebuf = NULL;
-        ebuf_head = ebuf;
-        ebuf_tail = ebuf;
-    } else {
-        ebuf_tail->next_ebuf = ebuf;
-        ebuf->prev_ebuf = ebuf_tail;
-        ebuf_tail = ebuf; 
-    }
-
-    return ebuf;
+// give the card back the descriptors before rx_i, with one RDT write. 
+// (it stops one short of RDT, so the one just before rx_i is held 
+// back: otherwise a full ring would look like an empty one.)
+void rx_return() {
+    if (rx_unreturned == 0) return;
+    pci_reg_write(E1000_RDT, (rx_i + E1000_NUM_RX_DESC - 1) % E1000_NUM_RX_DESC);
+    rx_unreturned = 0;
 }
 
-void ebuf_free(epkt_buf *ebuf) {
-    if (ebuf == NULL) return;
+/* frames the interrupt handler has taken off the ring, 
+ * oldest first, waiting for recv_eth_from_e1000(). 
+ * TODO: proper protocol queues. */
+static mbuf *rx_head = NULL;
+static mbuf *rx_tail = NULL;
 
-    if (ebuf->prev_ebuf == NULL) {
-        // this ebuf is the head. 
-        if (ebuf->next_ebuf == NULL) {
-            // this ebuf is the only ebuf
-            ebuf_head = NULL;
-            ebuf_tail = NULL;
-        }
-        ebuf_head = ebuf->next_ebuf;
-        ebuf_head->prev_ebuf = NULL;
-    } else if (ebuf->next_ebuf == NULL) {
-        // this ebuf is the tail.
-        ebuf_tail = ebuf->prev_ebuf;
-        ebuf_tail->next_ebuf = NULL;
+void rx_enqueue(mbuf *m) {
+    m->next = NULL;
+    if (rx_head == NULL) {
+        rx_head = m;
+    } else {
+        rx_tail->next = m;
     }
-
-    kfree(ebuf);
+    rx_tail = m;
 }
 
-eth_pkt recv_eth_from_e1000() {
-    // TODO: this is bad, since it involves 
-    // some extra data copies of a large 
-    // ethernet packet. 
-
+mbuf *recv_eth_from_e1000() {
     // wait until a packet is ready to be received.
-    while (ebuf_head == NULL) { }
-
-    eth_pkt ret = ebuf_head->data;
-
-    ebuf_free(ebuf_head);
-
-    return ret;
-}
+    while (rx_head == NULL) { }
 
+    // (the interrupt handler adds to the queue.)
+    asm volatile ("cli");
+    mbuf *m = rx_head;
+    rx_head = m->next;
+    if (rx_head == NULL) rx_tail = NULL;
+    asm volatile ("sti");
 
-void copy_to_ebuf_chain(eth_pkt *pkt) {
-    // allocate a new member of the chain
-    epkt_buf *ebuf = ebuf_alloc();
-
-    ebuf->data = *pkt;
-
+    m->next = NULL;
+    return m;
 }
 
 __attribute__ ((interrupt)) 
@@ -516,12 +634,16 @@ void e1000_interrupt(struct interrupt_frame *frame) {
     // (13.14.17, p.307)
     uint32_t icr = pci_reg_read(E1000_ICR);
 
-    if (icr & E1000_INT_RXT0) {
-        // new packet
-        uint8_t *buf = get_next_rxbuf();
+    if (icr & E1000_INT_RX) {
+        // new packets, maybe several. they go up as they are: 
+        // no copy, no kmalloc.
+        while (rx_list[rx_i].status & STATUS_DD) {
+            mbuf *m = get_next_rxbuf();
+            if (m != NULL) rx_enqueue(m);
 
-        // dereference + copy to the packet chain (in vmem)
-        copy_to_ebuf_chain((eth_pkt *) buf); 
+            if (rx_unreturned >= E1000_RX_RETURN_BATCH) rx_return();
+        }
+        rx_return();
     }
 
     port_byte_out(PIC2A, PIC_EOI);
@@ -529,5 +651,3 @@ void e1000_interrupt(struct interrupt_frame *frame) {
 
     asm volatile ("sti");
 }
-
-
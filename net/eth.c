@@ -6,34 +6,35 @@
 
 #include "kalloc.h"
 
-// TODO: reduce the amount of copies that are performed
-int send_ip_pkt_to_eth(uint8_t *ip_pkt, uint32_t len) {
-    eth_pkt ep = { 0 };
+int send_ip_pkt_to_eth(mbuf *m) {
+    eth_hdr *eh = (eth_hdr *) mbuf_push(m, sizeof(eth_hdr));
+    if (eh == NULL) {
+        mbuf_free(m);
+        return -1;
+    }
 
     // FIXME: these are only for DHCP.
-    memset(ep.mac_dest, 0xff, 6);
-    memmove(ep.mac_src, MAC_ADDR_ARR, 6);
+    memset(eh->mac_dest, 0xff, 6);
+    memmove(eh->mac_src, MAC_ADDR_ARR, 6);
 
-    memmove(ep.buf, ip_pkt, len);
+    eh->ethertype = htons(ETHERTYPE_IPV4); 
 
-    // how big do we want to send? 
-    // should be size of IP/UDP message. but this works.
-    ep.ethertype = htons(ETHERTYPE_IPV4); 
-
-    return send_eth_to_e1000(&ep);
+    return send_eth_to_e1000(m);
 }
 
-uint8_t *recv_ip_pkt_from_eth() {
-    eth_pkt ep = recv_eth_from_e1000();
-
-    uint16_t payload_len = ETH_MAX_PKT_LEN - 4;
-    uint8_t *pkt = kmalloc(payload_len);
-
-    // TODO: don't have every packet be max length, lol.
-    // also deal with fragmentation.
-    memmove(pkt, ep.buf, payload_len);
-
-    return pkt;
+mbuf *recv_ip_pkt_from_eth() {
+    while (1) {
+        mbuf *m = recv_eth_from_e1000();
+
+        // the header is just stepped over. 
+        // TODO: deal with fragmentation.
+        eth_hdr *eh = (eth_hdr *) m->data;
+        if (m->len >= sizeof(eth_hdr) && eh->ethertype == htons(ETHERTYPE_IPV4)) {
+            mbuf_pull(m, sizeof(eth_hdr));
+            return m;
+        }
+
+        // ARP and so on. nothing here wants them yet.
+        mbuf_free(m);
+    }
 }
-
-
@@ -3,6 +3,7 @@
 #include "string.h"
 #include "net.h"
 #include "ip.h"
+#include "eth.h"
 
 // https://en.wikipedia.org/wiki/IPv4_header_checksum
 void ipv4_cksum(ip_hdr *ih) {
@@ -42,47 +43,68 @@ void ip_cksum_test() {
 
 
 // can be either TCP or UDP
-int send_pkt_to_ip(uint8_t *tpkt, uint16_t tlen, uint8_t protocol) {
-    uint32_t ip_pkt_len = tlen + sizeof(ip_hdr);
+int send_pkt_to_ip(mbuf *m, uint8_t protocol) {
+    uint32_t ip_pkt_len = m->len + sizeof(ip_hdr);
 
-    ip_hdr ip = { 0 };
-    ip.version = 4;
-    ip.header_len = 5;
+    ip_hdr *ip = (ip_hdr *) mbuf_push(m, sizeof(ip_hdr));
+    if (ip == NULL) {
+        mbuf_free(m);
+        return -1;
+    }
+    memset(ip, 0, sizeof(ip_hdr));
+
+    ip->version = 4;
+    ip->header_len = 5;
 
-    ip.ttl = 0xff; // just needs to be nonzero.
+    ip->ttl = 0xff; // just needs to be nonzero.
 
-    ip.total_len = htons(ip_pkt_len);
+    ip->total_len = htons(ip_pkt_len);
  
-    ip.protocol = protocol;
+    ip->protocol = protocol;
 
-    ip.src_addr = hton(0);
-    ip.dst_addr = hton(0xffffffff); // 255.255.255.255
+    ip->src_addr = hton(0);
+    ip->dst_addr = hton(0xffffffff); // 255.255.255.255
 
     // need to be VERY careful about endianness.
-    ipv4_cksum(&ip);
-
-    uint8_t ip_pkt[ip_pkt_len]; // make a buffer big enough for the ip_hdr and the msg
-
-    memmove(ip_pkt, &ip, sizeof(ip_hdr));
-    memmove(ip_pkt + sizeof(ip_hdr), tpkt, tlen);
+    ipv4_cksum(ip);
 
-    return send_ip_pkt_to_eth(ip_pkt, ip_pkt_len);
+    return send_ip_pkt_to_eth(m);
 }
 
-uint8_t *recv_pkt_from_ip(uint8_t *protocol) {
-    uint8_t *buf = recv_ip_pkt_from_eth();
+// whether the packet at the front of m is one we can read: 
+// a whole IPv4 header, and the lengths in it add up.
+int ip_pkt_ok(mbuf *m) {
+    if (m->len < sizeof(ip_hdr)) return 0;
 
-    ip_hdr *hdr = (ip_hdr *) buf;
-    *protocol = hdr->protocol;
+    ip_hdr *hdr = (ip_hdr *) m->data;
+    uint16_t header_len = hdr->header_len * 4;
+    uint16_t total_len = ntohs(hdr->total_len);
 
-    uint32_t payload_len = hdr->total_len - sizeof(ip_hdr);
+    if (hdr->version != 4 || header_len < sizeof(ip_hdr)) return 0;
+    return total_len >= header_len && total_len <= m->len;
+}
 
-    uint8_t *pkt = kmalloc(payload_len);
+mbuf *recv_pkt_from_ip(uint8_t *protocol) {
+    while (1) {
+        mbuf *m = recv_ip_pkt_from_eth();
 
-    memmove(pkt, buf + sizeof(ip_hdr), payload_len);
+        // anything malformed is dropped, like a bad frame would be.
+        if (!ip_pkt_ok(m)) {
+            mbuf_free(m);
+            continue;
+        }
 
-    kfree(buf); // don't need buf anymore. 
+        ip_hdr *hdr = (ip_hdr *) m->data;
+        *protocol = hdr->protocol;
 
-    return pkt;
-}
+        // the frame can have padding past the IP packet, 
+        // and the header can have options.
+        mbuf_trim(m, ntohs(hdr->total_len));
+        if (mbuf_pull(m, hdr->header_len * 4) == NULL) {
+            mbuf_free(m);
+            continue;
+        }
 
+        return m;
+    }
+}
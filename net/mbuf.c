@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "kalloc.h"
+#include "mbuf.h"
+
+// pools are shared with interrupt handlers, so their lists are only 
+// touched with interrupts off. (and then put back the way they were, 
+// since the handlers call in with them off already.)
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    asm volatile ("pushf; pop %0; cli" : "=r" (flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    asm volatile ("push %0; popf" : : "r" (flags) : "memory", "cc");
+}
+
+void mbuf_reset(mbuf *m) {
+    m->data = m->buf + MBUF_HEADROOM;
+    m->len = 0;
+    m->next = NULL;
+}
+
+mbuf *mbuf_alloc() {
+    mbuf *m = (mbuf *) kmalloc(sizeof(mbuf));
+    if (m == NULL) return NULL;
+
+    mbuf_reset(m);
+    m->pool = NULL;
+    return m;
+}
+
+void mbuf_free(mbuf *m) {
+    if (m == NULL) return;
+
+    mbuf_pool *p = m->pool;
+    if (p == NULL) {
+        kfree(m);
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    m->next = p->free;
+    p->free = m;
+    p->nfree++;
+    irq_restore(flags);
+}
+
+void mbuf_pool_init(mbuf_pool *p, mbuf *bufs, uint32_t n) {
+    p->free = NULL;
+    p->nfree = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        bufs[i].pool = p;
+        mbuf_free(&bufs[i]);
+    }
+}
+
+mbuf *mbuf_pool_get(mbuf_pool *p) {
+    uint32_t flags = irq_save();
+    mbuf *m = p->free;
+    if (m != NULL) {
+        p->free = m->next;
+        p->nfree--;
+    }
+    irq_restore(flags);
+
+    if (m != NULL) mbuf_reset(m);
+    return m;
+}
+
+uint8_t *mbuf_push(mbuf *m, uint16_t n) {
+    if (m->data - m->buf < n) return NULL;
+
+    m->data -= n;
+    m->len += n;
+    return m->data;
+}
+
+uint8_t *mbuf_put(mbuf *m, uint16_t n) {
+    uint8_t *tail = m->data + m->len;
+    if (m->buf + MBUF_SIZE - tail < n) return NULL;
+
+    m->len += n;
+    return tail;
+}
+
+uint8_t *mbuf_pull(mbuf *m, uint16_t n) {
+    if (m->len < n) return NULL;
+
+    m->data += n;
+    m->len -= n;
+    return m->data;
+}
+
+void mbuf_trim(mbuf *m, uint16_t len) {
+    if (m->len > len) m->len = len;
+}
@@ -11,38 +11,49 @@ typedef struct {
 } udp_hdr;
 
 
-int send_pkt_to_udp(uint8_t *pkt, uint16_t len, uint16_t src_port, uint16_t dst_port) {
+int send_pkt_to_udp(mbuf *m, uint16_t src_port, uint16_t dst_port) {
     //====================== UDP PACKET
     //
-    uint16_t udp_pkt_len = sizeof(udp_hdr) + len;
-    uint8_t udp_pkt[udp_pkt_len];
+    uint16_t udp_pkt_len = sizeof(udp_hdr) + m->len;
 
-    udp_hdr udp = { 0 };
-    udp.src_port = htons(src_port);
-    udp.dst_port = htons(dst_port);
-    udp.len = htons(udp_pkt_len);
+    udp_hdr *udp = (udp_hdr *) mbuf_push(m, sizeof(udp_hdr));
+    if (udp == NULL) {
+        mbuf_free(m);
+        return -1;
+    }
 
-    memmove(udp_pkt, &udp, sizeof(udp_hdr));
-    memmove(udp_pkt + sizeof(udp_hdr), pkt, len);
+    udp->src_port = htons(src_port);
+    udp->dst_port = htons(dst_port);
+    udp->len = htons(udp_pkt_len);
+    udp->checksum = 0; // optional over IPv4
 
-    return send_pkt_to_ip(udp_pkt, udp_pkt_len, IP_PROTOCOL_UDP);
+    return send_pkt_to_ip(m, IP_PROTOCOL_UDP);
 }
 
-uint8_t *recv_pkt_from_udp(uint16_t *src_port, uint16_t *dst_port) {
+mbuf *recv_pkt_from_udp(uint16_t *src_port, uint16_t *dst_port) {
     uint8_t protocol;
-    uint8_t *pkt = recv_pkt_from_ip(&protocol);
-    if (protocol != IP_PROTOCOL_UDP) return NULL;
-
-    udp_hdr *hdr = (udp_hdr *) pkt;
-    *src_port = hdr->src_port;
-    *dst_port = hdr->dst_port;
-
-    uint8_t *ret = kmalloc(hdr->len);
-
-    memmove(ret, pkt+sizeof(udp_hdr), hdr->len);
-
-    kfree(pkt);
-
-    return ret;
+    mbuf *m = recv_pkt_from_ip(&protocol);
+    if (protocol != IP_PROTOCOL_UDP) {
+        mbuf_free(m);
+        return NULL;
+    }
+
+    // drop it if the header, or the length in it, doesn't fit.
+    udp_hdr *hdr = (udp_hdr *) m->data;
+    if (m->len < sizeof(udp_hdr) || ntohs(hdr->len) < sizeof(udp_hdr) || 
+            ntohs(hdr->len) > m->len) {
+        mbuf_free(m);
+        return NULL;
+    }
+
+    *src_port = ntohs(hdr->src_port);
+    *dst_port = ntohs(hdr->dst_port);
+
+    mbuf_trim(m, ntohs(hdr->len));
+    if (mbuf_pull(m, sizeof(udp_hdr)) == NULL) {
+        mbuf_free(m);
+        return NULL;
+    }
+
+    return m;
 }
-